@@ -0,0 +1,233 @@
+// Closed-loop echo load generator
+//
+// Opens a number of connections to the server, keeps one request of msg_size
+// bytes outstanding on each, and reports round trips per second and latency
+// percentiles once the run is over. With -b, bulk connections connect first
+// (taking the server's low slots) and keep up to BULK_WINDOW bytes of
+// bulk_size writes in flight the whole time, to see how well the latency of
+// the small round trips holds up next to them:
+//
+//   ./build/bench/echo_load [-H host] [-p port] [-c conns] [-s msg_size] [-d seconds] [-b bulk_conns [-B bulk_size]]
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+
+#define MAX_EVENTS 256
+#define MAX_SAMPLES (1 << 22)
+#define BULK_WINDOW (4 << 20) // Echo bytes a bulk connection may have outstanding
+
+typedef struct {
+    int fd;
+    size_t received; // Bytes of the current echo received so far
+    uint64_t sent_at;
+    bool bulk;
+    size_t in_flight; // Bulk bytes sent and not echoed yet
+    bool want_out;    // Bulk connection is watching for writability
+} LoadConn;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Send a full request; the server echoes so nothing is pending on our side
+static void send_request(LoadConn *conn, const char *payload, size_t len) {
+    size_t done = 0;
+    conn->sent_at = now_ns();
+    conn->received = 0;
+    while (done < len) {
+        ssize_t n = send(conn->fd, payload + done, len - done, 0);
+        if (n < 0) {
+            fatal_error("send");
+        }
+        done += n;
+    }
+}
+
+// Watch a bulk connection for writability only while its window has room
+static void bulk_watch(int epfd, LoadConn *conn) {
+    bool want_out = conn->in_flight < BULK_WINDOW;
+    if (want_out != conn->want_out) {
+        struct epoll_event ev = {.events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = conn};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->want_out = want_out;
+    }
+}
+
+// Keep a bulk connection's window full and drain its echoes. Returns the
+// echoed bytes received.
+static size_t bulk_service(int epfd, LoadConn *conn, uint32_t events, const char *payload, size_t bulk_size, char *scratch, size_t scratch_size) {
+    size_t echoed = 0;
+    if (events & EPOLLIN) {
+        ssize_t got;
+        while ((got = recv(conn->fd, scratch, scratch_size, MSG_DONTWAIT)) > 0) {
+            echoed += got;
+            conn->in_flight -= got < (ssize_t)conn->in_flight ? (size_t)got : conn->in_flight;
+        }
+        if (got == 0 || (got < 0 && errno != EAGAIN)) {
+            fatal_error("Server closed bulk connection");
+        }
+    }
+    while (conn->in_flight < BULK_WINDOW) {
+        ssize_t sent = send(conn->fd, payload, bulk_size, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN) {
+                fatal_error("send");
+            }
+            break;
+        }
+        conn->in_flight += sent;
+    }
+    bulk_watch(epfd, conn);
+    return echoed;
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-H host] [-p port] [-c conns] [-s msg_size] [-d seconds] [-b bulk_conns [-B bulk_size]]";
+    const char *host = "127.0.0.1";
+    int port = 8080, nconns = 64, seconds = 5, nbulk = 0;
+    size_t msg_size = 64, bulk_size = 256 * 1024;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:s:d:b:B:")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 's':
+            msg_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'b':
+            nbulk = atoi(optarg);
+            break;
+        case 'B':
+            bulk_size = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    if (nconns <= 0 || msg_size == 0 || seconds <= 0 || nbulk < 0 || bulk_size == 0) {
+        usage_error(argv[0], usage);
+    }
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        usage_error(argv[0], usage);
+    }
+
+    char *payload = malloc(msg_size);
+    char *scratch = malloc(msg_size);
+    memset(payload, 'x', msg_size);
+    uint64_t *samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    size_t nsamples = 0;
+    uint64_t round_trips = 0, bulk_bytes = 0;
+    char *bulk_payload = malloc(bulk_size);
+    char *bulk_scratch = malloc(bulk_size);
+    memset(bulk_payload, 'y', bulk_size);
+
+    int epfd = epoll_create1(0);
+    LoadConn *bulk = calloc(nbulk > 0 ? nbulk : 1, sizeof(LoadConn));
+    for (int i = 0; i < nbulk; i++) {
+        bulk[i] = (LoadConn){.fd = socket(AF_INET, SOCK_STREAM, 0), .bulk = true, .want_out = true};
+        if (bulk[i].fd < 0 || connect(bulk[i].fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            fatal_error("connect");
+        }
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = &bulk[i]};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, bulk[i].fd, &ev);
+    }
+    LoadConn *conns = calloc(nconns, sizeof(LoadConn));
+    for (int i = 0; i < nconns; i++) {
+        conns[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (conns[i].fd < 0 || connect(conns[i].fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            fatal_error("connect");
+        }
+        int one = 1;
+        setsockopt(conns[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &conns[i]};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+        send_request(&conns[i], payload, msg_size);
+    }
+
+    uint64_t deadline = now_ns() + (uint64_t)seconds * 1000000000ull;
+    struct epoll_event events[MAX_EVENTS];
+    while (now_ns() < deadline) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        if (n < 0 && errno != EINTR) {
+            fatal_error("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            LoadConn *conn = events[i].data.ptr;
+            if (conn->bulk) {
+                bulk_bytes += bulk_service(epfd, conn, events[i].events, bulk_payload, bulk_size, bulk_scratch, bulk_size);
+                continue;
+            }
+            ssize_t got = recv(conn->fd, scratch, msg_size - conn->received, MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN)) {
+                fprintf(stderr, "Server closed connection\n");
+                return EXIT_FAILURE;
+            }
+            if (got < 0) {
+                continue;
+            }
+            conn->received += got;
+            if (conn->received < msg_size) {
+                continue;
+            }
+            uint64_t latency = now_ns() - conn->sent_at;
+            if (nsamples < MAX_SAMPLES) {
+                samples[nsamples++] = latency;
+            }
+            round_trips++;
+            send_request(conn, payload, msg_size);
+        }
+    }
+
+    qsort(samples, nsamples, sizeof(uint64_t), compare_u64);
+    uint64_t p50 = nsamples ? samples[nsamples / 2] : 0;
+    uint64_t p99 = nsamples ? samples[nsamples * 99 / 100] : 0;
+    uint64_t p999 = nsamples ? samples[nsamples * 999 / 1000] : 0;
+    printf("conns=%d msg_size=%zu rtt/s=%.0f p50_us=%.1f p99_us=%.1f p999_us=%.1f", nconns, msg_size, (double)round_trips / seconds, p50 / 1e3, p99 / 1e3,
+           p999 / 1e3);
+    if (nbulk > 0) {
+        printf(" bulk_conns=%d bulk_MB/s=%.1f", nbulk, bulk_bytes / 1e6 / seconds);
+    }
+    printf("\n");
+
+    for (int i = 0; i < nconns; i++) {
+        close(conns[i].fd);
+    }
+    for (int i = 0; i < nbulk; i++) {
+        close(bulk[i].fd);
+    }
+    return 0;
+}
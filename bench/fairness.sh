@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compare interactive latency next to bulk connections with and without the
+# select loop's deficit round-robin scheduling.
+#
+#   make all bench && ./bench/fairness.sh [conns] [bulk_conns] [seconds]
+#
+# Runs echo_load's round-trip connections alongside bulk ones that keep the
+# server busy, once with -Q 0 (no per-pass limit) and once with the default
+# quantum, so the percentiles show what the scheduling buys. "make fairness"
+# runs it with defaults.
+
+BUILD_DIR=${BUILD_DIR:-build}
+PORT=${PORT:-9081}
+CONNS=${1:-16}
+BULK_CONNS=${2:-4}
+SECONDS_PER_RUN=${3:-5}
+
+run() {
+    label=$1
+    shift
+    "$BUILD_DIR/tcp_server" -p "$PORT" -m select -q "$@" >/dev/null 2>&1 &
+    server=$!
+    sleep 0.5
+    printf '%-20s ' "$label"
+    "$BUILD_DIR/bench/echo_load" -p "$PORT" -c "$CONNS" -d "$SECONDS_PER_RUN" -b "$BULK_CONNS"
+    kill "$server"
+    wait "$server" 2>/dev/null
+    sleep 1
+}
+
+run "no scheduling" -Q 0
+run "deficit round-robin"
@@ -0,0 +1,259 @@
+// Allocator benchmark: the server's heap against glibc malloc
+//
+// Each thread plays an event loop: it holds a connection record per slot,
+// borrows a write buffer when a slot's output backs up (mostly a few KB,
+// sometimes up to 256 KB) and returns it once drained, allocates a short-lived
+// protocol object per request, and now and then replaces a connection. The
+// remote pattern pairs threads up instead: one allocates messages and hands
+// them over a ring, the other frees them, so every heap free is a remote one.
+// Each allocator runs in a child process of its own so peak RSS compares.
+//
+//   ./build/bench/heap_bench [-t threads] [-c conns_per_thread] [-n ops_per_thread] [-v]
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "heap.h"
+
+#define RECORD_SIZE 32
+#define REMOTE_RING 1024 // Messages in flight between a producer and its consumer
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+} Allocator;
+
+static const Allocator allocators[] = {
+    {"glibc", malloc, free},
+    {"heap", heap_alloc, heap_free},
+};
+
+typedef struct {
+    const Allocator *allocator;
+    int conns;
+    uint64_t ops;
+    uint32_t rng;
+    // Remote pattern: single-producer single-consumer ring shared by a pair
+    void **ring;
+    uint64_t *produced;
+    uint64_t *consumed;
+    bool producer;
+} Worker;
+
+static uint32_t next_random(uint32_t *state) {
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Queued output sizes: mostly small echoes, some bulk transfers
+static size_t buffer_size(uint32_t *rng) {
+    uint32_t pick = next_random(rng) % 100;
+    if (pick < 60) {
+        return 512 + next_random(rng) % (4096 - 512);
+    }
+    if (pick < 90) {
+        return 8192 + next_random(rng) % (65536 - 8192);
+    }
+    return 131072 + next_random(rng) % (262144 - 131072);
+}
+
+static void *checked_alloc(const Allocator *allocator, size_t size) {
+    char *ptr = allocator->alloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s: out of memory\n", allocator->name);
+        exit(EXIT_FAILURE);
+    }
+    // Write to every page, as filling a buffer would
+    for (size_t offset = 0; offset < size; offset += 4096) {
+        ptr[offset] = 1;
+    }
+    ptr[size - 1] = 1;
+    return ptr;
+}
+
+static void *loop_pattern(void *arg) {
+    Worker *w = arg;
+    const Allocator *a = w->allocator;
+    void **records = calloc(w->conns, sizeof(void *));
+    void **buffers = calloc(w->conns, sizeof(void *));
+    for (int i = 0; i < w->conns; i++) {
+        records[i] = checked_alloc(a, RECORD_SIZE);
+    }
+
+    for (uint64_t op = 0; op < w->ops; op++) {
+        int slot = next_random(&w->rng) % w->conns;
+        uint32_t event = next_random(&w->rng) % 100;
+        if (event < 2) {
+            // Connection replaced
+            a->free(buffers[slot]);
+            buffers[slot] = NULL;
+            a->free(records[slot]);
+            records[slot] = checked_alloc(a, RECORD_SIZE);
+            continue;
+        }
+        // A request: parsed into a short-lived object, its reply queued
+        // unless the slot is still draining earlier output
+        void *request = checked_alloc(a, 48 + next_random(&w->rng) % 464);
+        if (buffers[slot] != NULL) {
+            a->free(buffers[slot]);
+            buffers[slot] = NULL;
+        } else if (event < 32) {
+            buffers[slot] = checked_alloc(a, buffer_size(&w->rng));
+        }
+        a->free(request);
+    }
+
+    for (int i = 0; i < w->conns; i++) {
+        a->free(buffers[i]);
+        a->free(records[i]);
+    }
+    free(records);
+    free(buffers);
+    return NULL;
+}
+
+static void *remote_pattern(void *arg) {
+    Worker *w = arg;
+    const Allocator *a = w->allocator;
+    for (uint64_t op = 0; op < w->ops; op++) {
+        if (w->producer) {
+            while (op - __atomic_load_n(w->consumed, __ATOMIC_ACQUIRE) >= REMOTE_RING) {
+                sched_yield();
+            }
+            w->ring[op % REMOTE_RING] = checked_alloc(a, 64 + next_random(&w->rng) % 1984);
+            __atomic_store_n(w->produced, op + 1, __ATOMIC_RELEASE);
+        } else {
+            while (__atomic_load_n(w->produced, __ATOMIC_ACQUIRE) <= op) {
+                sched_yield();
+            }
+            a->free(w->ring[op % REMOTE_RING]);
+            __atomic_store_n(w->consumed, op + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+static long long peak_rss_kb(void) {
+    char line[256];
+    long long kb = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmHWM: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+static void run(const Allocator *allocator, bool remote, int nthreads, int conns, uint64_t ops, bool verbose) {
+    if (allocator->alloc == heap_alloc) {
+        // Every slot could hold a largest buffer, twice over for class spread
+        heap_init(((size_t)2 * nthreads * conns << 18) + ((size_t)64 << 20), 0);
+    }
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    uint64_t *counters = calloc(nthreads, sizeof(uint64_t));
+    void **rings = calloc((size_t)nthreads * REMOTE_RING, sizeof(void *));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nthreads; i++) {
+        int pair = i & ~1;
+        workers[i] = (Worker){
+            .allocator = allocator,
+            .conns = conns,
+            .ops = ops,
+            .rng = 0x9e3779b9u * (i + 1),
+            .ring = &rings[(size_t)pair * REMOTE_RING],
+            .produced = &counters[pair],
+            .consumed = &counters[pair + 1],
+            .producer = (i & 1) == 0,
+        };
+        if (pthread_create(&threads[i], NULL, remote ? remote_pattern : loop_pattern, &workers[i]) != 0) {
+            fatal_error("pthread_create");
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    uint64_t total = (uint64_t)nthreads * ops;
+    printf("allocator=%s pattern=%s threads=%d ops=%llu wall_s=%.3f ns/op=%.1f peak_rss_kB=%lld\n", allocator->name, remote ? "remote" : "loop", nthreads,
+           (unsigned long long)total, elapsed, elapsed * 1e9 / total, peak_rss_kb());
+    if (verbose && allocator->alloc == heap_alloc) {
+        write_heap_stats(stdout);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-t threads] [-c conns_per_thread] [-n ops_per_thread] [-v]";
+    int nthreads = 4, conns = 256;
+    uint64_t ops = 2000000;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:n:v")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    // The remote pattern needs producer/consumer pairs
+    if (nthreads <= 0 || nthreads % 2 != 0 || nthreads > HEAP_MAX_THREADS || conns <= 0 || ops == 0) {
+        usage_error(argv[0], usage);
+    }
+
+    for (int remote = 0; remote <= 1; remote++) {
+        for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                fatal_error("fork");
+            }
+            if (pid == 0) {
+                run(&allocators[i], remote, nthreads, conns, ops, verbose);
+                exit(EXIT_SUCCESS);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,223 @@
+// Idle connection scaling harness
+//
+// Starts the server command given after "--", then opens connections to it in
+// steps and holds them idle. After each step it reports the server's RSS, the
+// kernel's TCP memory and the cost per connection, and fails if the server's
+// userspace memory per connection exceeds the budget. Source addresses are
+// spread over 127.0.1.0/24 so ephemeral ports don't run out, and
+// RLIMIT_NOFILE is raised for both ends.
+//
+//   ./build/bench/idle_scale [-p port] [-n conns] [-i step] [-b budget_bytes] -- ./build/tcp_server -m uring -c 110000 -q -p 9090
+//
+// "make idle-scale" runs it with defaults (see the Makefile).
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define SOURCE_ADDRESSES 250 // 127.0.1.1 - 127.0.1.250
+#define MIN_CONNS_FOR_BUDGET 1000 // Below this, fixed costs dominate the per-connection figure
+#define SETTLE_US 500000
+
+// Raise RLIMIT_NOFILE to at least wanted, lifting the hard limit if permitted.
+// Returns the soft limit in effect.
+static rlim_t raise_nofile_limit(rlim_t wanted) {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_max < wanted) {
+        struct rlimit raised = {.rlim_cur = wanted, .rlim_max = wanted};
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            return wanted;
+        }
+    }
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur;
+}
+
+// Resident set size of a process in bytes, from /proc/<pid>/status
+static long long process_rss(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    long long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+// Kernel memory charged to TCP sockets in bytes, from /proc/net/sockstat
+static long long tcp_kernel_memory(void) {
+    char line[256];
+    FILE *f = fopen("/proc/net/sockstat", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    long long pages = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *mem = strstr(line, " mem ");
+        if (strncmp(line, "TCP:", 4) == 0 && mem != NULL) {
+            pages = atoll(mem + 5);
+            break;
+        }
+    }
+    fclose(f);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static pid_t start_server(char **argv) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fatal_error("fork");
+    }
+    if (pid == 0) {
+        execv(argv[0], argv);
+        fatal_error("execv");
+    }
+    return pid;
+}
+
+static int open_connection(const struct sockaddr_in *server, long index) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // Let connect() pick the port per source address instead of bind()
+    int one = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+    struct sockaddr_in source = {
+        .sin_family = AF_INET,
+        .sin_addr = {.s_addr = htonl((127u << 24) | (1u << 8) | (1 + index % SOURCE_ADDRESSES))},
+    };
+    if (bind(fd, (struct sockaddr *)&source, sizeof(source)) == -1 || connect(fd, (const struct sockaddr *)server, sizeof(*server)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-p port] [-n conns] [-i step] [-b budget_bytes] -- server_command [args...]";
+    int port = 9090;
+    long target = 100000, step = 10000;
+    long long budget = 2048;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:i:b:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            target = atol(optarg);
+            break;
+        case 'i':
+            step = atol(optarg);
+            break;
+        case 'b':
+            budget = atoll(optarg);
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    if (optind >= argc || target <= 0 || step <= 0) {
+        usage_error(argv[0], usage);
+    }
+
+    // Both the server (inherits it) and this process need a descriptor per connection
+    rlim_t limit = raise_nofile_limit(target + 1024);
+    if (limit < (rlim_t)target + 64) {
+        fprintf(stderr, "RLIMIT_NOFILE is %llu, capping at %llu connections\n", (unsigned long long)limit, (unsigned long long)(limit - 64));
+        target = limit - 64;
+    }
+
+    pid_t server_pid = start_server(&argv[optind]);
+    usleep(SETTLE_US);
+
+    struct sockaddr_in server = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr = {.s_addr = htonl(INADDR_LOOPBACK)}};
+    long long base_rss = process_rss(server_pid);
+    long long base_tcp = tcp_kernel_memory();
+    if (base_rss < 0) {
+        fprintf(stderr, "Server exited during startup\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("baseline: server_rss_kB=%lld tcp_mem_kB=%lld\n", base_rss / 1024, base_tcp / 1024);
+
+    int *fds = malloc(target * sizeof(int));
+    long open_conns = 0;
+    bool over_budget = false;
+
+    printf("%10s %14s %12s %14s %16s\n", "conns", "server_rss_kB", "rss/conn_B", "tcp_mem_kB", "kernel/conn_B");
+    while (open_conns < target) {
+        long goal = open_conns + step < target ? open_conns + step : target;
+        for (; open_conns < goal; open_conns++) {
+            fds[open_conns] = open_connection(&server, open_conns);
+            if (fds[open_conns] < 0) {
+                fprintf(stderr, "connect #%ld failed: %s\n", open_conns, strerror(errno));
+                goto report;
+            }
+        }
+        usleep(SETTLE_US); // Let the server accept the backlog
+
+        long long rss = process_rss(server_pid);
+        long long tcp = tcp_kernel_memory();
+        if (rss < 0) {
+            fprintf(stderr, "Server exited\n");
+            return EXIT_FAILURE;
+        }
+        long long rss_per_conn = (rss - base_rss) / open_conns;
+        // Both ends of every loopback connection are charged to TCP memory
+        long long kernel_per_conn = (tcp - base_tcp) / open_conns;
+        printf("%10ld %14lld %12lld %14lld %16lld\n", open_conns, rss / 1024, rss_per_conn, tcp / 1024, kernel_per_conn);
+        fflush(stdout);
+
+        if (open_conns >= MIN_CONNS_FOR_BUDGET && rss_per_conn > budget) {
+            over_budget = true;
+        }
+    }
+
+report:
+    for (long i = 0; i < open_conns; i++) {
+        close(fds[i]);
+    }
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+
+    if (over_budget) {
+        fprintf(stderr, "FAIL: server memory per idle connection exceeded budget of %lld bytes\n", budget);
+        return EXIT_FAILURE;
+    }
+    if (open_conns < target) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS: %ld idle connections within %lld bytes each\n", open_conns, budget);
+    return 0;
+}
@@ -0,0 +1,166 @@
+// Key-value store write load
+//
+// Runs conns connections against a server started with -K, each on its own
+// thread, sending batches of depth pipelined SETs and waiting for the batch's
+// replies before the next. Keys cycle through keys distinct names, values are
+// value_size bytes. Reports SETs per second; with the server's metrics
+// (log_records against log_syncs) that shows how many commands each sync
+// covered, and restarting the server on the log it left shows replay speed:
+//
+//   ./build/bench/kv_load [-H host] [-p port] [-c conns] [-P depth] [-k keys] [-s value_size] [-d seconds]
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+
+#define MAX_DEPTH 1024
+
+static struct {
+    const char *host;
+    int port;
+    int depth;
+    unsigned long keys;
+    size_t value_size;
+    int seconds;
+} load = {"127.0.0.1", 8080, 16, 100000, 32, 5};
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    uint64_t sets;
+} Worker;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(load.port)};
+    if (fd < 0 || inet_pton(AF_INET, load.host, &addr.sin_addr) != 1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fatal_error("connect");
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n <= 0) {
+            fatal_error("send");
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Read until count replies (lines) came back
+static void await_replies(int fd, int count) {
+    char buf[4096];
+    while (count > 0) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            fatal_error("recv");
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            count -= buf[i] == '\n';
+        }
+    }
+}
+
+static void *worker_thread(void *arg) {
+    Worker *worker = arg;
+    int fd = connect_server();
+    size_t line_max = 64 + load.value_size;
+    char *batch = malloc(line_max * load.depth);
+    char *value = malloc(load.value_size + 1);
+    if (batch == NULL || value == NULL) {
+        fatal_error("malloc");
+    }
+    memset(value, 'v', load.value_size);
+    value[load.value_size] = '\0';
+
+    uint64_t next = (uint64_t)worker->id * 7919, deadline = now_ns() + (uint64_t)load.seconds * 1000000000ull;
+    while (now_ns() < deadline) {
+        size_t len = 0;
+        for (int i = 0; i < load.depth; i++, next++) {
+            len += (size_t)sprintf(batch + len, "SET key%lu %s\n", (unsigned long)(next % load.keys), value);
+        }
+        send_all(fd, batch, len);
+        await_replies(fd, load.depth);
+        worker->sets += (uint64_t)load.depth;
+    }
+    close(fd);
+    free(batch);
+    free(value);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-H host] [-p port] [-c conns] [-P depth] [-k keys] [-s value_size] [-d seconds]";
+    int conns = 4, opt;
+    while ((opt = getopt(argc, argv, "H:p:c:P:k:s:d:")) != -1) {
+        switch (opt) {
+        case 'H':
+            load.host = optarg;
+            break;
+        case 'p':
+            load.port = atoi(optarg);
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'P':
+            load.depth = atoi(optarg);
+            break;
+        case 'k':
+            load.keys = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            load.value_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            load.seconds = atoi(optarg);
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    if (conns <= 0 || load.depth <= 0 || load.depth > MAX_DEPTH || load.keys == 0 || load.seconds <= 0) {
+        usage_error(argv[0], usage);
+    }
+
+    Worker *workers = calloc((size_t)conns, sizeof(Worker));
+    uint64_t start = now_ns();
+    for (int i = 0; i < conns; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+            fatal_error("pthread_create");
+        }
+    }
+    uint64_t sets = 0;
+    for (int i = 0; i < conns; i++) {
+        pthread_join(workers[i].thread, NULL);
+        sets += workers[i].sets;
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+    printf("conns=%d depth=%d value_size=%zu sets=%llu sets/s=%.0f\n", conns, load.depth, load.value_size, (unsigned long long)sets, (double)sets / seconds);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Echo round trips over the shared-memory transport, with TCP for comparison
+//
+// Runs a single connection doing request/response ping-pong against a
+// server started with -s, and reports round trips per second and latency:
+//
+//   ./build/tcp_server -s /tmp/tcp_server.sock
+//   ./build/bench/shm_echo_load [-S path] [-s msg_size] [-d seconds]   # shared memory
+//   ./build/bench/shm_echo_load -t [-p port] [-s msg_size] [-d seconds] # loopback TCP
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "shm.h"
+
+#define MAX_SAMPLES (1 << 22)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-t] [-S shm_socket_path] [-p port] [-s msg_size] [-d seconds]";
+    const char *path = "/tmp/tcp_server.sock";
+    int port = 8080, seconds = 5;
+    size_t msg_size = 64;
+    bool use_tcp = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "tS:p:s:d:")) != -1) {
+        switch (opt) {
+        case 't':
+            use_tcp = true;
+            break;
+        case 'S':
+            path = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            msg_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    if (msg_size == 0 || seconds <= 0) {
+        usage_error(argv[0], usage);
+    }
+
+    ShmChannel *ch = NULL;
+    int fd = -1;
+    if (use_tcp) {
+        struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr = {.s_addr = htonl(INADDR_LOOPBACK)}};
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            fatal_error("connect");
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    } else {
+        ch = shm_connect(path);
+        if (ch == NULL) {
+            fatal_error("shm_connect");
+        }
+    }
+
+    char *payload = malloc(msg_size);
+    char *reply = malloc(msg_size);
+    memset(payload, 'm', msg_size);
+    uint64_t *samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    size_t nsamples = 0;
+    uint64_t round_trips = 0;
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t)seconds * 1000000000ull;
+    while (now_ns() < deadline) {
+        uint64_t sent_at = now_ns();
+        ssize_t n = use_tcp ? send(fd, payload, msg_size, 0) : shm_channel_send(ch, payload, msg_size);
+        if (n != (ssize_t)msg_size) {
+            fatal_error("send");
+        }
+        size_t received = 0;
+        while (received < msg_size) {
+            n = use_tcp ? recv(fd, reply + received, msg_size - received, 0) : shm_channel_recv(ch, reply + received, msg_size - received);
+            if (n <= 0) {
+                fatal_error("recv");
+            }
+            received += n;
+        }
+        if (nsamples < MAX_SAMPLES) {
+            samples[nsamples++] = now_ns() - sent_at;
+        }
+        round_trips++;
+    }
+
+    qsort(samples, nsamples, sizeof(uint64_t), compare_u64);
+    printf("%s msg_size=%zu rtt/s=%.0f p50_us=%.1f p99_us=%.1f\n", use_tcp ? "tcp" : "shm", msg_size, round_trips / ((now_ns() - start) / 1e9),
+           samples[nsamples / 2] / 1e3, samples[nsamples * 99 / 100] / 1e3);
+
+    if (use_tcp) {
+        close(fd);
+    } else {
+        shm_channel_close(ch);
+    }
+    return 0;
+}
@@ -0,0 +1,223 @@
+// Echo handler and write-buffer benchmark on the in-memory transport
+//
+// Runs the unmodified select loop on sim_io: simulated peers each keep one
+// request outstanding and verify every echoed byte. Without the kernel in the
+// way this measures the handler and buffer logic alone, and the injected
+// partial writes, EAGAINs and latency make edge cases reproducible by seed.
+// Idle peers (-i) connect but never send, so the loop scans many more client
+// records than it services; hardware cache counters for the run are reported
+// when the kernel exposes them. -x runs the echo-specialized loop
+// (run_echo_loop) instead of the generic callback dispatch, to compare them:
+//
+//   ./build/bench/sim_bench [-c conns] [-i idle_conns] [-s msg_size] [-n requests]
+//                           [-P max_send_chunk] [-E eagain_percent] [-L latency_ns] [-S seed] [-x]
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "echo.h"
+#include "error.h"
+#include "heap.h"
+#include "server.h"
+#include "sim.h"
+
+typedef struct {
+    int id;
+    uint64_t sequence; // Requests sent so far; seeds the payload pattern
+    size_t received;   // Bytes of the current echo received
+    char *reply;       // The current echo so far
+} SimPeer;
+
+typedef struct {
+    SimPeer *peers;
+    int npeers;
+    size_t msg_size;
+    uint64_t target;
+    uint64_t completed;
+    char *request;
+} BenchState;
+
+// Hardware counters read around the loop, -1 fd when unavailable
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+} PerfCounter;
+
+static PerfCounter counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+    {"cache_refs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+    {"l1d_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1},
+};
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static void start_counters(void) {
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = counters[i].type,
+            .config = counters[i].config,
+            .disabled = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        counters[i].fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters[i].fd >= 0) {
+            ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+static void report_counters(uint64_t requests) {
+    bool any = false;
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        uint64_t value;
+        if (counters[i].fd < 0 || read(counters[i].fd, &value, sizeof(value)) != sizeof(value)) {
+            continue;
+        }
+        printf("%s%s=%llu (%.1f/req)", any ? " " : "", counters[i].name, (unsigned long long)value, (double)value / requests);
+        close(counters[i].fd);
+        any = true;
+    }
+    printf(any ? "\n" : "perf counters unavailable\n");
+}
+
+static void fill_request(char *buf, size_t len, int peer, uint64_t sequence) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (char)(peer * 31 + sequence * 7 + i);
+    }
+}
+
+static void send_next(BenchState *state, SimPeer *peer) {
+    fill_request(state->request, state->msg_size, peer->id, peer->sequence);
+    sim_peer_send(peer->id, state->request, state->msg_size);
+    peer->received = 0;
+}
+
+// Drive every peer once; stop the loop when enough round trips completed
+static bool step_peers(void *arg) {
+    BenchState *state = arg;
+    for (int i = 0; i < state->npeers; i++) {
+        SimPeer *peer = &state->peers[i];
+        ssize_t n;
+        while ((n = sim_peer_recv(peer->id, peer->reply + peer->received, state->msg_size - peer->received)) > 0) {
+            peer->received += n;
+            if (peer->received < state->msg_size) {
+                continue;
+            }
+            fill_request(state->request, state->msg_size, peer->id, peer->sequence);
+            if (memcmp(state->request, peer->reply, state->msg_size) != 0) {
+                fprintf(stderr, "Peer %d: echo mismatch on request %llu\n", peer->id, (unsigned long long)peer->sequence);
+                exit(EXIT_FAILURE);
+            }
+            state->completed++;
+            peer->sequence++;
+            send_next(state, peer);
+        }
+        if (n == 0) {
+            fprintf(stderr, "Peer %d: server closed the connection\n", peer->id);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return state->completed < state->target;
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-c conns] [-i idle_conns] [-s msg_size] [-n requests] [-P max_send_chunk] [-E eagain_percent] [-L latency_ns] [-S seed] [-x]";
+    SimConfig config = {.send_capacity = 64 * 1024, .seed = 1};
+    BenchState state = {.npeers = 64, .msg_size = 128, .target = 2000000};
+    int idle = 0;
+    bool specialized = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:i:s:n:P:E:L:S:x")) != -1) {
+        switch (opt) {
+        case 'c':
+            state.npeers = atoi(optarg);
+            break;
+        case 'i':
+            idle = atoi(optarg);
+            break;
+        case 's':
+            state.msg_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            state.target = strtoull(optarg, NULL, 10);
+            break;
+        case 'P':
+            config.max_send_chunk = strtoull(optarg, NULL, 10);
+            break;
+        case 'E':
+            config.eagain_percent = atoi(optarg);
+            break;
+        case 'L':
+            config.latency_ns = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            config.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            specialized = true;
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    if (state.npeers <= 0 || idle < 0 || state.npeers + idle > SIM_MAX_CONNS || state.msg_size == 0 || state.msg_size > server_config.max_pending_writes) {
+        usage_error(argv[0], usage);
+    }
+
+    server_config.quiet = true;
+    set_server_callbacks(&echo_callbacks);
+    heap_init(server_heap_size(), 0);
+    sim_init(&config, step_peers, &state);
+
+    state.peers = calloc(state.npeers, sizeof(SimPeer));
+    state.request = malloc(state.msg_size);
+    for (int i = 0; i < state.npeers; i++) {
+        state.peers[i].reply = malloc(state.msg_size);
+        state.peers[i].id = sim_connect();
+        send_next(&state, &state.peers[i]);
+    }
+    for (int i = 0; i < idle; i++) {
+        sim_connect();
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_counters();
+    if (specialized) {
+        run_echo_loop(&sim_io, SIM_LISTEN_FD, NULL, -1, NULL);
+    } else {
+        run_server_with_select(&sim_io, SIM_LISTEN_FD, NULL, -1, NULL);
+    }
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        if (counters[i].fd >= 0) {
+            ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    const SimStats *stats = sim_stats();
+    printf("loop=%s conns=%d idle=%d msg_size=%zu requests=%llu wall_s=%.3f req/s=%.0f sim_time_ms=%.3f partial_sends=%llu injected_eagains=%llu full_eagains=%llu\n", specialized ? "echo" : "generic", state.npeers,
+           idle, state.msg_size, (unsigned long long)state.completed, elapsed, state.completed / elapsed, sim_now() / 1e6, (unsigned long long)stats->partial_sends,
+           (unsigned long long)stats->injected_eagains, (unsigned long long)stats->full_eagains);
+    report_counters(state.completed);
+    return 0;
+}
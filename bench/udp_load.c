@@ -0,0 +1,203 @@
+// Batched UDP echo load generator
+//
+// Keeps a window of datagrams in flight against the server's UDP endpoint
+// (tcp_server -u), sending and receiving with sendmmsg/recvmmsg, and reports
+// echoed packets per second. With -g each batch goes out as a single
+// UDP_SEGMENT (GSO) send and replies are read with UDP_GRO, which pairs with
+// tcp_server -u -g:
+//
+//   ./build/bench/udp_load [-H host] [-p port] [-s size] [-b batch] [-w window] [-d seconds] [-g]
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define MAX_BATCH 64
+#define RECV_SLOT_SIZE 65536
+#define LOSS_TIMEOUT_NS 50000000ull // Give up on in-flight datagrams after 50ms of silence
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Send one batch; returns the number of datagrams that left
+static int send_batch(int fd, char *payload, size_t size, int batch, bool gso) {
+    if (gso) {
+        // One super-datagram the kernel splits into batch segments of size bytes
+        struct iovec iov = {.iov_base = payload, .iov_len = size * batch};
+        char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = IPPROTO_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso_size = (uint16_t)size;
+        memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        return sendmsg(fd, &msg, MSG_DONTWAIT) < 0 ? 0 : batch;
+    }
+
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    for (int i = 0; i < batch; i++) {
+        iovs[i] = (struct iovec){.iov_base = payload + i * size, .iov_len = size};
+        msgs[i] = (struct mmsghdr){.msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1}};
+    }
+    int sent = sendmmsg(fd, msgs, batch, MSG_DONTWAIT);
+    return sent < 0 ? 0 : sent;
+}
+
+// Receive whatever is queued; returns datagrams received (GRO segments counted individually)
+static int recv_batch(int fd, char *buffers, size_t size, bool gro) {
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    char control[MAX_BATCH][64];
+    for (int i = 0; i < MAX_BATCH; i++) {
+        iovs[i] = (struct iovec){.iov_base = buffers + (size_t)i * RECV_SLOT_SIZE, .iov_len = RECV_SLOT_SIZE};
+        msgs[i] = (struct mmsghdr){.msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1, .msg_control = gro ? control[i] : NULL, .msg_controllen = gro ? 64 : 0}};
+    }
+
+    int received = recvmmsg(fd, msgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+    if (received < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            fatal_error("recvmmsg");
+        }
+        return 0;
+    }
+
+    int datagrams = 0;
+    for (int i = 0; i < received; i++) {
+        int segments = 1;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); gro && cm != NULL; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+            if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+                int segment_size;
+                memcpy(&segment_size, CMSG_DATA(cm), sizeof(segment_size));
+                segments = (msgs[i].msg_len + segment_size - 1) / segment_size;
+            }
+        }
+        if (!gro) {
+            segments = msgs[i].msg_len >= size ? 1 : 0;
+        }
+        datagrams += segments;
+    }
+    return datagrams;
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-H host] [-p port] [-s size] [-b batch] [-w window] [-d seconds] [-g]";
+    const char *host = "127.0.0.1";
+    int port = 8080, batch = 32, window = 256, seconds = 5;
+    size_t size = 64;
+    bool gso = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:s:b:w:d:g")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            size = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'g':
+            gso = true;
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    if (size == 0 || size > 1472 || batch <= 0 || batch > MAX_BATCH || window < batch || seconds <= 0) {
+        usage_error(argv[0], usage);
+    }
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        usage_error(argv[0], usage);
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fatal_error("connect");
+    }
+    int one = 1;
+    if (gso && setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) == -1) {
+        fatal_error("setsockopt(UDP_GRO)");
+    }
+
+    char *payload = malloc(size * MAX_BATCH);
+    memset(payload, 'u', size * MAX_BATCH);
+    char *buffers = malloc((size_t)MAX_BATCH * RECV_SLOT_SIZE);
+
+    uint64_t sent = 0, received = 0, lost = 0;
+    int inflight = 0;
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t)seconds * 1000000000ull;
+    uint64_t last_progress = start;
+
+    while (now_ns() < deadline) {
+        while (inflight + batch <= window) {
+            int n = send_batch(fd, payload, size, batch, gso);
+            if (n == 0) {
+                break;
+            }
+            sent += n;
+            inflight += n;
+        }
+
+        int n = recv_batch(fd, buffers, size, gso);
+        if (n > 0) {
+            received += n;
+            inflight = inflight > n ? inflight - n : 0;
+            last_progress = now_ns();
+            continue;
+        }
+
+        if (now_ns() - last_progress > LOSS_TIMEOUT_NS) {
+            lost += inflight;
+            inflight = 0;
+            last_progress = now_ns();
+            continue;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        poll(&pfd, 1, 1);
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("size=%zu batch=%d window=%d%s pps=%.0f MB/s=%.1f sent=%llu received=%llu lost=%llu\n", size, batch, window, gso ? " gso" : "", received / elapsed,
+           received * size / elapsed / 1e6, (unsigned long long)sent, (unsigned long long)received, (unsigned long long)lost);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Measure each io_uring feature of the server separately with echo_load.
+#
+#   make all bench && ./bench/uring_features.sh [conns] [msg_size] [seconds]
+#
+# Runs the select loop as a reference, plain io_uring, each feature on its own
+# and all of them together, on an otherwise idle loopback.
+
+BUILD_DIR=${BUILD_DIR:-build}
+PORT=${PORT:-9080}
+CONNS=${1:-64}
+MSG_SIZE=${2:-64}
+SECONDS_PER_RUN=${3:-5}
+
+run() {
+    label=$1
+    shift
+    "$BUILD_DIR/tcp_server" -p "$PORT" -c 4096 -q "$@" >/dev/null 2>&1 &
+    server=$!
+    sleep 0.5
+    printf '%-34s ' "$label"
+    "$BUILD_DIR/bench/echo_load" -p "$PORT" -c "$CONNS" -s "$MSG_SIZE" -d "$SECONDS_PER_RUN"
+    kill "$server"
+    wait "$server" 2>/dev/null
+    # io_uring tears down asynchronously; let it release the listening port
+    sleep 1
+}
+
+run "select" -m select
+run "uring" -m uring
+run "uring fixed_bufs" -m uring -U fixed_bufs
+run "uring fixed_files" -m uring -U fixed_files
+run "uring sqpoll" -m uring -U sqpoll
+run "uring fixed_bufs,fixed_files,sqpoll" -m uring -U fixed_bufs,fixed_files,sqpoll
@@ -0,0 +1,245 @@
+// Copy vs MSG_ZEROCOPY send throughput across message sizes
+//
+// Streams a fixed volume of data over a TCP connection once with plain send()
+// and once with MSG_ZEROCOPY for each message size, and reports throughput and
+// sender CPU time so the size where zerocopy starts winning can be read off
+// directly. By default the data goes to an in-process sink on loopback; note
+// that loopback makes the kernel copy anyway (reported in the "copied" column),
+// so point it at a sink on another host for real NIC numbers:
+//
+//   remote$ ./build/bench/zerocopy_bench -s        # run as sink on port 9100
+//   local$  ./build/bench/zerocopy_bench -H remote
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define SINK_PORT 9100
+#define SINK_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    uint64_t sent;      // Zerocopy sends issued
+    uint64_t completed; // Zerocopy sends released by the kernel
+    uint64_t copied;    // Completions the kernel flagged as copied anyway
+} ZerocopyState;
+
+static double now_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Drain a single connection until EOF
+static void *sink_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *buffer = malloc(SINK_BUFFER_SIZE);
+    while (recv(fd, buffer, SINK_BUFFER_SIZE, 0) > 0) {
+    }
+    free(buffer);
+    close(fd);
+    return NULL;
+}
+
+// Accept connections forever, draining each on its own thread
+static void *sink_accept_loop(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return NULL;
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, sink_connection, (void *)(intptr_t)fd);
+        pthread_detach(thread);
+    }
+}
+
+static int create_sink(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fatal_error("socket");
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = {.s_addr = htonl(INADDR_ANY)},
+        .sin_port = htons(port),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        fatal_error("Failed to set up sink socket");
+    }
+    return fd;
+}
+
+static int connect_to(const char *host, int port) {
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *res;
+    if (getaddrinfo(host, port_str, &hints, &res) != 0) {
+        fatal_error("getaddrinfo");
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        fatal_error("connect");
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Collect zerocopy completions; blocks until at least one arrives if wait is set
+static void reap_completions(int fd, ZerocopyState *zc, bool wait) {
+    while (zc->completed < zc->sent) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fatal_error("recvmsg(MSG_ERRQUEUE)");
+            }
+            if (!wait) {
+                return;
+            }
+            struct pollfd pfd = {.fd = fd, .events = 0};
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            uint32_t count = serr->ee_data - serr->ee_info + 1;
+            zc->completed += count;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied += count;
+            }
+        }
+        wait = false;
+    }
+}
+
+// Send total_bytes in msg_size chunks; returns wall seconds, fills cpu seconds
+static double run_stream(const char *host, int port, size_t msg_size, size_t total_bytes, bool zerocopy, double *cpu, ZerocopyState *zc) {
+    int fd = connect_to(host, port);
+    if (zerocopy) {
+        int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+            fatal_error("setsockopt(SO_ZEROCOPY)");
+        }
+    }
+
+    // Payload is never modified, so in-flight zerocopy sends can share it
+    char *payload = malloc(msg_size);
+    memset(payload, 'z', msg_size);
+    *zc = (ZerocopyState){0};
+
+    double cpu_start = now_seconds(CLOCK_THREAD_CPUTIME_ID);
+    double start = now_seconds(CLOCK_MONOTONIC);
+
+    size_t remaining = total_bytes;
+    while (remaining > 0) {
+        size_t len = remaining < msg_size ? remaining : msg_size;
+        ssize_t sent = send(fd, payload, len, zerocopy ? MSG_ZEROCOPY : 0);
+        if (sent < 0) {
+            if (errno == ENOBUFS && zerocopy) {
+                // Notification backlog exceeded optmem; wait for the kernel
+                reap_completions(fd, zc, true);
+                continue;
+            }
+            fatal_error("send");
+        }
+        if (zerocopy) {
+            zc->sent++;
+            reap_completions(fd, zc, false);
+        }
+        remaining -= sent;
+    }
+    if (zerocopy) {
+        reap_completions(fd, zc, true);
+    }
+
+    double elapsed = now_seconds(CLOCK_MONOTONIC) - start;
+    *cpu = now_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    close(fd);
+    free(payload);
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-s] [-H host] [-p port] [-t total_mb]";
+    const char *host = NULL;
+    int port = SINK_PORT;
+    size_t total_mb = 512;
+    bool sink_only = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "sH:p:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            sink_only = true;
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            total_mb = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+
+    if (sink_only || host == NULL) {
+        int listen_fd = create_sink(port);
+        if (sink_only) {
+            printf("Sink listening on port %d\n", port);
+            sink_accept_loop((void *)(intptr_t)listen_fd);
+            return 0;
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, sink_accept_loop, (void *)(intptr_t)listen_fd);
+        pthread_detach(thread);
+        host = "127.0.0.1";
+    }
+
+    size_t total_bytes = total_mb << 20;
+    printf("%10s %12s %12s %12s %12s %9s\n", "msg_size", "copy_MB/s", "zc_MB/s", "copy_cpu_s", "zc_cpu_s", "copied%");
+    for (size_t msg_size = 4096; msg_size <= (4u << 20); msg_size *= 2) {
+        ZerocopyState zc;
+        double copy_cpu, zc_cpu;
+        double copy_time = run_stream(host, port, msg_size, total_bytes, false, &copy_cpu, &zc);
+        double zc_time = run_stream(host, port, msg_size, total_bytes, true, &zc_cpu, &zc);
+        double copied = zc.completed ? 100.0 * zc.copied / zc.completed : 0.0;
+        printf("%10zu %12.0f %12.0f %12.3f %12.3f %8.1f%%\n", msg_size, total_mb / copy_time, total_mb / zc_time, copy_cpu, zc_cpu, copied);
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+// Handler plugin: echo with ASCII letters uppercased
+//
+//   make plugins && ./build/tcp_server -H build/plugins/upper.so
+
+#define _GNU_SOURCE
+#include <ctype.h>
+
+#include "tcpserver.h"
+
+static void upper_data(Connection *conn, const char *data, size_t len) {
+    char *reply = conn_reserve(conn, len);
+    if (reply == NULL) {
+        conn_close(conn);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        reply[i] = (char)toupper((unsigned char)data[i]);
+    }
+    conn_commit(conn, len);
+}
+
+const HandlerPlugin tcp_server_handler = {
+    .abi_version = HANDLER_ABI_VERSION,
+    .name = "upper",
+    .callbacks = {.on_data = upper_data},
+};
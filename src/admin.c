@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admin.h"
+#include "error.h"
+#include "heap.h"
+#include "metrics.h"
+#include "profiler.h"
+
+#define ADMIN_MAX_COMMANDS 32
+
+typedef struct {
+    const char *name;
+    const char *help;
+    AdminHandler handler;
+} AdminCommand;
+
+static AdminCommand commands[ADMIN_MAX_COMMANDS];
+static int ncommands;
+
+void admin_register(const char *name, const char *help, AdminHandler handler) {
+    if (ncommands == ADMIN_MAX_COMMANDS) {
+        fprintf(stderr, "Too many admin commands, ignoring %s\n", name);
+        return;
+    }
+    commands[ncommands++] = (AdminCommand){.name = name, .help = help, .handler = handler};
+}
+
+static void admin_help(FILE *out, const char *args) {
+    (void)args;
+    for (int i = 0; i < ncommands; i++) {
+        fprintf(out, "%-12s %s\n", commands[i].name, commands[i].help);
+    }
+}
+
+static void admin_stats(FILE *out, const char *args) {
+    (void)args;
+    write_metrics(out);
+}
+
+static void admin_heap(FILE *out, const char *args) {
+    (void)args;
+    write_heap_stats(out);
+}
+
+static void admin_profile(FILE *out, const char *args) {
+    unsigned seconds = PROFILE_DEFAULT_SECONDS, hz = PROFILE_DEFAULT_HZ;
+    sscanf(args, "%u %u", &seconds, &hz);
+    if (seconds == 0 || seconds > PROFILE_MAX_SECONDS || hz == 0 || hz > PROFILE_MAX_HZ) {
+        fprintf(out, "usage: profile [seconds (1-%d) [hz (1-%d)]]\n", PROFILE_MAX_SECONDS, PROFILE_MAX_HZ);
+        return;
+    }
+    if (!profile_cpu(seconds, hz, out)) {
+        fprintf(out, "a profile is already running\n");
+    }
+}
+
+// Run one command line
+static void dispatch(FILE *out, char *line) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *args = line + strcspn(line, " ");
+    if (*args != '\0') {
+        *args++ = '\0';
+    }
+    if (*line == '\0') {
+        return;
+    }
+    for (int i = 0; i < ncommands; i++) {
+        if (strcmp(commands[i].name, line) == 0) {
+            commands[i].handler(out, args);
+            fprintf(out, ".\n");
+            return;
+        }
+    }
+    fprintf(out, "unknown command %s, try help\n.\n", line);
+}
+
+// Serve admin connections one at a time
+static void *admin_thread(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    pthread_setname_np(pthread_self(), "admin");
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            perror("admin accept");
+            continue;
+        }
+        FILE *conn = fdopen(fd, "r+");
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        char *line = NULL;
+        size_t cap = 0;
+        while (getline(&line, &cap, conn) > 0) {
+            if (strncmp(line, "quit", 4) == 0) {
+                break;
+            }
+            dispatch(conn, line);
+            fflush(conn);
+        }
+        free(line);
+        fclose(conn);
+    }
+    return NULL;
+}
+
+void start_admin_server(int port) {
+    admin_register("help", "List commands", admin_help);
+    admin_register("stats", "Print server metrics as \"name value\" lines", admin_stats);
+    admin_register("heap", "Print allocator counters per thread and size class", admin_heap);
+    admin_register("profile", "profile [seconds [hz]]: sample CPU stacks, print them collapsed for flame graphs", admin_profile);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fatal_error("Admin socket creation failed");
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = {.s_addr = htonl(INADDR_LOOPBACK)},
+        .sin_port = htons(port),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1) {
+        fatal_error("Admin bind/listen failed");
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_thread, (void *)(intptr_t)fd) != 0) {
+        fatal_error("Failed to start admin thread");
+    }
+    pthread_detach(thread);
+    printf("Admin interface listening on 127.0.0.1:%d\n", port);
+}
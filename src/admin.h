@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdio.h>
+
+// Line-based admin interface on a loopback TCP port, served by its own
+// thread so it works whichever event loop is running. Each line is a command
+// name and optional arguments; the reply ends with a line holding only ".".
+//
+//   $ printf 'stats\n' | nc 127.0.0.1 9999
+
+// Handler for one command; runs on the admin thread
+typedef void (*AdminHandler)(FILE *out, const char *args);
+
+// Add a command; call before start_admin_server
+void admin_register(const char *name, const char *help, AdminHandler handler);
+
+// Listen on 127.0.0.1:port and serve commands in a background thread
+void start_admin_server(int port);
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "error.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Fault in every page, through the kernel if it supports it
+static void prefault_range(char *base, size_t size, size_t page_size) {
+    if (madvise(base, size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+    for (size_t offset = 0; offset < size; offset += page_size) {
+        base[offset] = 0;
+    }
+}
+
+void *arena_map(size_t *size, size_t prefault, const char *name) {
+    *size = (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    prefault = prefault < *size ? (prefault + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1) : *size;
+    char faulted[48] = "";
+    if (prefault > 0) {
+        snprintf(faulted, sizeof(faulted), prefault == *size ? ", prefaulted" : ", first %zu MB prefaulted", prefault >> 20);
+    }
+
+    // MAP_HUGETLB only succeeds if enough pages are reserved in nr_hugepages;
+    // those are never swapped or split, so no prefault fallback is needed
+    int populate = prefault == *size ? MAP_POPULATE : 0;
+    char *base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    if (base != MAP_FAILED) {
+        if (prefault > 0 && !populate) {
+            prefault_range(base, prefault, HUGE_PAGE_SIZE);
+        }
+        printf("%s: %zu MB on reserved huge pages%s\n", name, *size >> 20, faulted);
+        return base;
+    }
+
+    // Transparent huge pages need 2 MB aligned addresses: over-map and trim
+    char *mapping = mmap(NULL, *size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        fatal_error("mmap(buffer arena) failed");
+    }
+    base = (char *)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (base > mapping) {
+        munmap(mapping, base - mapping);
+    }
+    munmap(base + *size, mapping + HUGE_PAGE_SIZE - base);
+    bool thp = madvise(base, *size, MADV_HUGEPAGE) == 0;
+    if (prefault > 0) {
+        prefault_range(base, prefault, thp ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE));
+    }
+    printf("%s: %zu MB on %s pages%s\n", name, *size >> 20, thp ? "transparent huge" : "normal", faulted);
+    return base;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Map a large anonymous region for a buffer pool, backed by the biggest pages
+// available: explicit huge pages (MAP_HUGETLB) if the system has them
+// reserved, else transparent huge pages (MADV_HUGEPAGE), else normal pages.
+// size is rounded up to whole huge pages. The pages of its first prefault
+// bytes (SIZE_MAX for all of it) are faulted in before returning, so the
+// first burst of traffic takes no page faults. Exits on failure.
+void *arena_map(size_t *size, size_t prefault, const char *name);
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmdlog.h"
+#include "metrics.h"
+
+// Frames every record on disk
+typedef struct {
+    uint32_t len;
+    uint32_t checksum; // Of the payload
+} RecordHeader;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} LogBuffer;
+
+struct CommandLog {
+    int fd;
+    SyncMode sync;
+    unsigned sync_ms;
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // The flusher waits here for records, or out its window
+    pthread_cond_t flushed; // Appenders wait here for buffer room
+    LogBuffer pending;      // Appended since the flusher last took the buffer
+    LogBuffer writing;      // The flusher's, while it writes
+    uint64_t appended;      // Sequence number of the last record appended
+    uint64_t durable;       // Of the last record written and, if the mode syncs, synced
+    uint64_t end;           // File length once everything appended is written
+    uint64_t written;       // File length the flusher has written out
+    bool failed;
+    bool closing;
+    void (*on_durable)(void *arg); // Called by the flusher once durable advances
+    void *on_durable_arg;
+};
+
+// FNV-1a; catches a torn or garbled tail, not tampering
+static uint32_t record_checksum(const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Length of the well-formed records at the start of map, counting them
+static size_t scan_records(const char *map, size_t size, size_t *records) {
+    size_t offset = 0;
+    *records = 0;
+    while (size - offset >= sizeof(RecordHeader)) {
+        RecordHeader header;
+        memcpy(&header, map + offset, sizeof(header));
+        if (header.len > size - offset - sizeof(header) || record_checksum(map + offset + sizeof(header), header.len) != header.checksum) {
+            break;
+        }
+        offset += sizeof(header) + header.len;
+        (*records)++;
+    }
+    return offset;
+}
+
+// Hand the log's records to replay and cut off what follows them; false if
+// the log can't be read, is shorter than the snapshot says it was, or has a
+// record the state can't take
+static bool replay_records(int fd, const char *path, const LogReplay *replay) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "Failed to stat command log %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    // The snapshot was taken against another log, or this one lost a tail
+    // the snapshot covers. Padding it out to the offset would only hide
+    // that, and appends after the padding would be dropped as a corrupt
+    // tail on the next replay.
+    if (replay->start > (uint64_t)st.st_size) {
+        fprintf(stderr, "Command log %s ends at %lld bytes, before the snapshot's position in it (%llu); refusing to start\n", path, (long long)st.st_size,
+                (unsigned long long)replay->start);
+        return false;
+    }
+    if (st.st_size == 0) {
+        return true;
+    }
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map command log %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Count first so the state is sized once, not grown record by record
+    size_t records;
+    size_t valid = replay->start + scan_records(map + replay->start, size - replay->start, &records);
+    replay->reserve(replay->arg, records);
+    for (size_t offset = replay->start; offset < valid;) {
+        RecordHeader header;
+        memcpy(&header, map + offset, sizeof(header));
+        if (!replay->apply(replay->arg, map + offset + sizeof(header), header.len)) {
+            fprintf(stderr, "Command log %s: the record at offset %zu could not be applied\n", path, offset);
+            munmap(map, size);
+            return false;
+        }
+        offset += sizeof(header) + header.len;
+    }
+    munmap(map, size);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Replayed %zu commands (%zu bytes) from %s in %.1f ms\n", records, (size_t)(valid - replay->start), path, (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+    if (valid < size) {
+        fprintf(stderr, "Command log %s: dropping %zu bytes of torn or corrupt tail\n", path, size - valid);
+        if (ftruncate(fd, (off_t)valid) == -1) {
+            fprintf(stderr, "Failed to truncate command log %s: %s\n", path, strerror(errno));
+        }
+    }
+    return true;
+}
+
+static bool buffer_reserve(LogBuffer *buf, size_t len) {
+    if (buf->len + len <= buf->capacity) {
+        return true;
+    }
+    size_t capacity = buf->capacity > 0 ? buf->capacity : 64 * 1024;
+    while (capacity < buf->len + len) {
+        capacity *= 2;
+    }
+    char *data = realloc(buf->data, capacity);
+    if (data == NULL) {
+        return false;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return true;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return true;
+}
+
+static bool sync_file(int fd) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool synced = fdatasync(fd) == 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    metric_add(log_syncs, 1);
+    metric_add(log_sync_ns, (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec);
+    return synced;
+}
+
+// Wait until there's something to write: under SYNC_ALWAYS, any record;
+// otherwise the end of the window, or a buffer grown to LOG_BUFFER_MAX
+static void wait_for_work(CommandLog *log) {
+    if (log->sync == SYNC_ALWAYS) {
+        while (log->pending.len == 0 && !log->closing) {
+            pthread_cond_wait(&log->work, &log->lock);
+        }
+        return;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += log->sync_ms / 1000;
+    deadline.tv_nsec += (long)(log->sync_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (!log->closing && log->pending.len < LOG_BUFFER_MAX && pthread_cond_timedwait(&log->work, &log->lock, &deadline) == 0) {
+    }
+}
+
+// Take whatever was appended, write it and sync once for all of it
+static void *flusher_thread(void *arg) {
+    CommandLog *log = arg;
+    pthread_setname_np(pthread_self(), "log-flush");
+    pthread_mutex_lock(&log->lock);
+    while (true) {
+        wait_for_work(log);
+        bool closing = log->closing;
+        if (log->pending.len > 0) {
+            LogBuffer batch = log->pending;
+            log->pending = log->writing;
+            log->writing = batch;
+            uint64_t seq = log->appended;
+            bool failed = log->failed;
+            pthread_mutex_unlock(&log->lock);
+
+            int error = 0;
+            if (!failed && write_all(log->fd, batch.data, batch.len)) {
+                metric_add(log_bytes, batch.len);
+                if (log->sync != SYNC_NEVER && !sync_file(log->fd)) {
+                    error = errno;
+                }
+            } else if (!failed) {
+                error = errno != 0 ? errno : EIO;
+            }
+            log->writing.len = 0;
+
+            pthread_mutex_lock(&log->lock);
+            if (!failed && error == 0) {
+                log->written += batch.len;
+            }
+            if (error != 0 && !log->failed) {
+                fprintf(stderr, "Command log write failed, no longer logging: %s\n", strerror(error));
+                log->failed = true;
+            }
+            if (!log->failed) {
+                log->durable = seq;
+            }
+            pthread_cond_broadcast(&log->flushed);
+            void (*on_durable)(void *) = log->on_durable;
+            void *on_durable_arg = log->on_durable_arg;
+            if (on_durable != NULL) {
+                pthread_mutex_unlock(&log->lock);
+                on_durable(on_durable_arg);
+                pthread_mutex_lock(&log->lock);
+            }
+        }
+        if (closing) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+CommandLog *command_log_open(const char *path, SyncMode sync, unsigned sync_ms, const LogReplay *replay) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open command log %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (!replay_records(fd, path, replay)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Shared with the flusher thread, so from malloc rather than the loop's heap
+    CommandLog *log = calloc(1, sizeof(CommandLog));
+    if (log == NULL) {
+        close(fd);
+        return NULL;
+    }
+    log->fd = fd;
+    log->end = (uint64_t)lseek(fd, 0, SEEK_END);
+    log->written = log->end;
+    log->sync = sync;
+    log->sync_ms = sync_ms > 0 ? sync_ms : 1;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->work, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&log->flushed, NULL);
+    if (pthread_create(&log->flusher, NULL, flusher_thread, log) != 0) {
+        fprintf(stderr, "Failed to start the command log flusher\n");
+        close(fd);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+uint64_t command_log_append(CommandLog *log, const void *record, size_t len) {
+    RecordHeader header = {.len = (uint32_t)len, .checksum = record_checksum(record, len)};
+    pthread_mutex_lock(&log->lock);
+    while (log->pending.len >= LOG_BUFFER_MAX && !log->failed) {
+        pthread_cond_signal(&log->work);
+        pthread_cond_wait(&log->flushed, &log->lock);
+    }
+    uint64_t seq = ++log->appended;
+    if (!log->failed) {
+        if (buffer_reserve(&log->pending, sizeof(header) + len)) {
+            memcpy(log->pending.data + log->pending.len, &header, sizeof(header));
+            memcpy(log->pending.data + log->pending.len + sizeof(header), record, len);
+            log->pending.len += sizeof(header) + len;
+            log->end += sizeof(header) + len;
+        } else {
+            fprintf(stderr, "Out of memory for the command log, no longer logging\n");
+            log->failed = true;
+        }
+    }
+    if (log->sync == SYNC_ALWAYS) {
+        pthread_cond_signal(&log->work);
+    }
+    pthread_mutex_unlock(&log->lock);
+    metric_add(log_records, 1);
+    return seq;
+}
+
+uint64_t command_log_offset(CommandLog *log) {
+    pthread_mutex_lock(&log->lock);
+    uint64_t written = log->written;
+    pthread_mutex_unlock(&log->lock);
+    return written;
+}
+
+int command_log_synced(CommandLog *log, uint64_t seq) {
+    pthread_mutex_lock(&log->lock);
+    int synced = log->failed ? -1 : log->sync != SYNC_ALWAYS || log->durable >= seq;
+    pthread_mutex_unlock(&log->lock);
+    return synced;
+}
+
+void command_log_on_durable(CommandLog *log, void (*fn)(void *arg), void *arg) {
+    pthread_mutex_lock(&log->lock);
+    log->on_durable = fn;
+    log->on_durable_arg = arg;
+    pthread_mutex_unlock(&log->lock);
+}
+
+void command_log_close(CommandLog *log) {
+    pthread_mutex_lock(&log->lock);
+    log->on_durable = NULL;
+    log->closing = true;
+    pthread_cond_signal(&log->work);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->flusher, NULL);
+    close(log->fd);
+    pthread_cond_destroy(&log->flushed);
+    pthread_cond_destroy(&log->work);
+    pthread_mutex_destroy(&log->lock);
+    free(log->pending.data);
+    free(log->writing.data);
+    free(log);
+}
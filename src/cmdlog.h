@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// Append-only log of the commands that changed in-memory state, replayed to
+// rebuild it on startup. The event loop appends records into a memory
+// buffer; a flusher thread swaps the buffer out, writes it and makes it
+// durable with group commit: one fdatasync covers everything written since
+// the last, however many commands that was. Under SYNC_ALWAYS the flusher
+// syncs as soon as there is anything new, and records appended while it
+// syncs wait for the next one; under SYNC_INTERVAL it writes and syncs once
+// per window; under SYNC_NEVER it writes once per window and leaves syncing
+// to the kernel.
+//
+// On disk every record is framed as a 4-byte length and a 4-byte checksum of
+// the payload, so replay finds where a crash tore the tail off and drops it.
+typedef struct CommandLog CommandLog;
+
+// How command_log_open hands existing records back: reserve gets their
+// count first, so the state can be sized once, then apply gets each payload
+// in order, straight from the mapped file, and returns false if it can't
+// take it (out of memory, say), which fails the open rather than leave the
+// state silently behind the log. Replay starts at offset start, skipping
+// the records a snapshot already holds (command_log_offset).
+typedef struct {
+    void (*reserve)(void *arg, size_t records);
+    bool (*apply)(void *arg, const char *record, size_t len);
+    void *arg;
+    uint64_t start;
+} LogReplay;
+
+// Open (creating) the log at path, replay it, cut off a torn tail and start
+// the flusher. NULL with a message on stderr on failure, which includes a
+// log ending before replay's start.
+CommandLog *command_log_open(const char *path, SyncMode sync, unsigned sync_ms, const LogReplay *replay);
+
+// Append a record; on the loop thread. Returns its sequence number, for
+// command_log_synced. Only blocks if the flusher is LOG_BUFFER_MAX behind.
+uint64_t command_log_append(CommandLog *log, const void *record, size_t len);
+
+// How far the flusher has written the file. Records appended since may
+// still be only in memory, so on the loop thread this marks a point the
+// state is at or past: the state holds every record before it, and maybe
+// some after. Only written, not synced; fdatasync the file before counting
+// on it.
+uint64_t command_log_offset(CommandLog *log);
+
+// Whether record seq is durable, without waiting: 1 once it is, 0 while the
+// flusher has yet to sync it. Only SYNC_ALWAYS makes callers wait; the other
+// modes answer 1 right away. -1 if the log failed (a write or sync error),
+// after which nothing more is logged.
+int command_log_synced(CommandLog *log, uint64_t seq);
+
+// Have the flusher call fn(arg) each time it has made records durable (or
+// failed to), so the loop can release what waited on them without blocking
+// in command_log_synced. fn runs on the flusher thread, so it should only
+// hand off, with loop_events_post say.
+void command_log_on_durable(CommandLog *log, void (*fn)(void *arg), void *arg);
+
+// Write and sync what's left, stop the flusher and close the file
+void command_log_close(CommandLog *log);
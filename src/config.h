@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PORT 8080
+#define BUFFER_SIZE 4096
+#define MAX_PENDING_WRITES (256 * 1024)
+#define CACHE_LINE 64
+#define SIZE_CLASS_MIN_SHIFT 9  // Smallest write buffer class, 512 B
+#define SIZE_CLASS_MAX_SHIFT 30 // Largest possible class, bounds max_pending_writes
+#define RECV_MIN_SHIFT 9        // Receive sizes adapt between 512 B...
+#define RECV_MAX_SHIFT 18       // ...and 256 KB
+#define RECV_INITIAL_SHIFT 12   // 4 KB for new connections
+#define RECV_SHRINK_AFTER 4     // Consecutive reads under a quarter full before shrinking
+#define MEMORY_SOFT_PERCENT 75 // Default soft limit, as a share of the hard limit
+#define HEAP_OBJECT_RESERVE ((size_t)64 << 20) // Heap space for records and protocol objects, on top of write buffers
+#define KV_HEAP_RESERVE ((size_t)4 << 30)      // Heap space for the key-value store's entries, with -K or -O
+#define HITTERS_DECAY_MS 1000 // Heavy-hitter counts lose an eighth this often
+#define EGRESS_MAX_CLASSES 8      // Egress classes connections can share a bucket in
+#define EGRESS_DEFAULT_BURST_MS 250 // Default burst, as time at the configured rate
+#define SCHED_QUANTUM (16 * 1024)   // Bytes a connection of weight 1 may read or flush per loop pass
+#define SCHED_MAX_QUANTUM (1 << 20)
+#define SPILL_MAX_BYTES ((uint64_t)1 << 30) // Spilled output a connection may queue
+#define SPILL_CHUNK (64 * 1024)              // Most spilled output sent per call
+#define LOG_SYNC_MS 1000                 // Default command log sync window
+#define LOG_BUFFER_MAX ((size_t)64 << 20) // Appended log bytes the flusher may fall behind by before appends wait
+
+// Event loop implementation to run
+typedef enum {
+    LOOP_SELECT,
+    LOOP_URING,
+} LoopMode;
+
+// When the command log's writes are made durable
+typedef enum {
+    SYNC_ALWAYS,   // Before a command is acknowledged
+    SYNC_INTERVAL, // Once per log_sync_ms window
+    SYNC_NEVER,    // When the kernel writes the pages back
+} SyncMode;
+
+// io_uring features, individually switchable so each can be measured
+#define URING_FIXED_BUFFERS (1u << 0) // Register the buffer pool, use WRITE_FIXED
+#define URING_FIXED_FILES (1u << 1)   // Accept straight into the registered file table
+#define URING_SQPOLL (1u << 2)        // Kernel thread polls the SQ, no submit syscalls
+
+// Runtime configuration (set from the command line)
+typedef struct {
+    int port;
+    LoopMode mode;
+    int max_clients;           // Connection slots (capped at FD_SETSIZE for select)
+    size_t max_pending_writes; // Per-connection write buffer capacity
+    bool zerocopy;             // Use MSG_ZEROCOPY for large sends
+    size_t zerocopy_threshold; // Minimum send size that goes out zerocopy
+    unsigned uring_features;   // URING_* flags
+    bool udp;                  // Serve UDP echo on the same port
+    bool udp_offload;          // UDP_GRO/UDP_SEGMENT for datagram bursts
+    const char *shm_path;      // Unix socket for shared-memory clients, or NULL
+    bool quiet;                // Suppress per-event logging
+    bool prefault;             // Fault in buffer arenas at startup
+    size_t memory_soft_limit;  // Write buffer bytes where reads pause, 0 for no limit
+    size_t memory_hard_limit;  // Write buffer bytes where connections get evicted
+    int admin_port;            // Loopback port of the admin interface, 0 for none
+    unsigned stats_interval;   // Seconds between metrics dumps to stdout, 0 for none
+    const char *handler_path;  // Shared object with the protocol handlers, NULL for echo
+    unsigned stall_ms;         // Loop stall the watchdog reports with a backtrace, 0 for no watchdog
+    const char *stats_path;    // File the stats segment is published to, or NULL
+    uint64_t egress_rate;      // Bytes/s each connection may send, 0 for unlimited
+    uint64_t egress_burst;     // Bytes a connection may send at once after idling
+    uint64_t class_rate;       // Bytes/s egress class 0 (every connection, unless moved) may send
+    uint64_t class_burst;
+    size_t sched_quantum;      // Bytes read or flushed per pass and unit of weight, 0 for no limit
+    size_t spill_threshold;    // Output queued in memory beyond which more goes to a file, 0 to never spill
+    const char *spill_dir;     // Where spill files are created
+    const char *kv_log_path;   // Command log of the key-value store, or NULL
+    const char *snapshot_path; // Snapshot of the key-value store, or NULL; with neither, the server echoes
+    SyncMode log_sync;
+    unsigned log_sync_ms;      // Sync window under SYNC_INTERVAL
+} ServerConfig;
+
+extern ServerConfig server_config;
+
+// Per-connection/per-event logging, silenced with -q when benchmarking
+#define log_event(...)                                                                                                                                                             \
+    do {                                                                                                                                                                           \
+        if (!server_config.quiet) {                                                                                                                                                \
+            printf(__VA_ARGS__);                                                                                                                                                   \
+        }                                                                                                                                                                          \
+    } while (0)
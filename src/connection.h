@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/types.h>
+
+// Write buffer storage for output that couldn't be sent right away. Kept
+// apart from the hot Client records; data is borrowed from a shared pool only
+// while output is queued.
+typedef struct {
+    char *data;
+    uint32_t capacity; // Bytes of data, charged against the memory budget
+    // MSG_ZEROCOPY sends are numbered by the kernel starting at 0 per socket.
+    // Bytes in [0, out_size) must stay untouched while zc_completed != zc_sent.
+    uint32_t zc_sent;      // Zerocopy sends issued
+    uint32_t zc_completed; // Zerocopy sends the kernel has released
+    // Output past spill_threshold goes to an unlinked file instead, and is
+    // sent from there once everything queued in memory has gone out
+    int spill_fd;          // -1 while nothing is spilled
+    uint64_t spill_offset; // Next byte of the file to send
+    uint64_t spill_size;   // Bytes written to it
+} WriteBuffer;
+
+typedef struct Transport Transport;
+
+#define CLIENT_CLOSING (1u << 0)     // Closing, kept only until zerocopy sends complete
+#define CLIENT_WANT_WRITE (1u << 1)  // Output is pending
+#define CLIENT_ZEROCOPY (1u << 2)    // SO_ZEROCOPY is enabled on the socket
+#define CLIENT_READ_PAUSED (1u << 3) // Not read from until memory pressure eases
+#define CLIENT_OUTPUT_FULL (1u << 4) // Not read from until queued output drains
+#define CLIENT_THROTTLED (1u << 5)   // Out of egress tokens, not sent to until the next refill
+#define CLIENT_PRIORITY (1u << 6)    // Served before other connections in each loop pass
+#define CLIENT_SPILLED (1u << 7)     // Output is queued in the spill file too; new output goes there
+
+// Hot client state: what the loop reads when scanning connections and on the
+// common echo path, packed so two records share a cache line
+typedef struct {
+    int fd;                     // Descriptor select() watches for readability
+    int aux_fd;                 // Extra descriptor whose readability counts as fd's, or -1
+    const Transport *transport; // How bytes move to and from the peer
+    uint32_t out_size;          // Bytes queued in the write buffer
+    uint32_t out_offset;        // How much of them we've already sent
+    uint8_t flags;              // CLIENT_*
+    uint8_t recv_shift;         // Current receive size, as a power of two
+    uint8_t small_reads;        // Consecutive reads that used little of it
+    uint8_t weight;             // Scheduling quanta earned per loop pass
+    int32_t deficit;            // Bytes it may still read, deficit round-robin style; negative while paying for flushed output
+} Client;
+
+_Static_assert(sizeof(Client) == 32, "Client records should stay 32 bytes");
+
+// Per-connection counters for introspection, in an array of their own so
+// the loop's scan of the hot records doesn't pull them in. Only the loop
+// thread touches them.
+typedef struct {
+    char peer[64];         // Printable peer address
+    uint64_t peer_key;     // Hash of the peer's host, for heavy-hitter tracking
+    uint64_t bytes_in;
+    uint64_t bytes_out;    // Handed to conn_send/conn_commit
+    uint64_t messages;     // Reads that returned data
+    uint32_t buffer_peak;  // Most output queued at once
+    uint32_t host_len;     // Of peer, without the port
+    uint64_t connected_ms; // CLOCK_MONOTONIC_COARSE
+    uint64_t active_ms;    // Last read
+    uint64_t throttled_ms; // Time spent throttled for egress, at refill resolution
+} ClientStats;
+
+// A connection's egress token bucket and the class whose shared bucket it
+// also draws from, and whether the application has stopped its reads
+typedef struct {
+    uint64_t tokens; // Bytes it may still send before the next refill
+    uint8_t egress_class;
+    bool input_held; // Not read from until the application releases it (conn_hold_input)
+} ClientPacing;
+
+// A loop's connections by slot: dense hot records, the write buffers they
+// only need once output backs up, and counters kept out of the hot records
+typedef struct {
+    Client *clients;
+    WriteBuffer *buffers;
+    void **user_data; // Application's pointer per connection
+    ClientStats *stats;
+    ClientPacing *pacing;
+    char *spill_staging; // Spill-bound replies are built here, allocated on first use
+    char *spill_chunk;   // Spilled output read back for non-socket transports, likewise
+    int capacity;
+} ClientTable;
+
+// Byte-stream operations behind a client connection. recv/send follow the
+// socket calls' conventions (-1 with errno EAGAIN when they would block, recv
+// returns 0 at end of stream), so handlers don't care which transport a
+// client uses.
+struct Transport {
+    const char *name;
+    // Accept a pending connection on listen_fd, filling in client's fd,
+    // aux_fd, transport and flags and a printable peer name. Transports keep
+    // any private state themselves, keyed by fd.
+    bool (*accept)(int listen_fd, Client *client, char *peer, size_t peer_len);
+    ssize_t (*recv)(Client *client, void *buf, size_t len);
+    ssize_t (*send)(Client *client, const void *buf, size_t len, int flags);
+    void (*close)(Client *client);
+    // Sockets report room for more output in select()'s write set.
+    // Notification-based transports wake fd for reading instead.
+    bool write_ready_via_read;
+};
+
+// Check whether select() reported a client readable. Inline: every loop
+// instantiation (see select_loop.h) runs these for each client, every pass.
+static inline bool client_readable(const Client *client, fd_set *read_set) {
+    return FD_ISSET(client->fd, read_set) || (client->aux_fd >= 0 && FD_ISSET(client->aux_fd, read_set));
+}
+
+// Check whether a client waiting to send can make progress
+static inline bool client_writable(const Client *client, fd_set *read_set, fd_set *write_set) {
+    if (!(client->flags & CLIENT_WANT_WRITE)) {
+        return false;
+    }
+    return client->transport->write_ready_via_read ? FD_ISSET(client->fd, read_set) : FD_ISSET(client->fd, write_set);
+}
+
+// What the select loop waits with, and how it accepts on its listening
+// descriptor: real sockets, or the in-memory simulation in sim.h
+typedef struct {
+    const char *name;
+    // select() without timeout: same arguments, result and errno. Failing
+    // with ECANCELED makes the loop return.
+    int (*wait)(int nfds, fd_set *read_set, fd_set *write_set);
+    const Transport *transport;
+} LoopIo;
+
+extern const Transport tcp_transport;
+extern const LoopIo socket_io;
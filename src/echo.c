@@ -0,0 +1,14 @@
+#define _GNU_SOURCE
+#include "echo.h"
+
+// Send everything straight back; what the socket won't take is queued
+static void echo_data(Connection *conn, const char *data, size_t len) { conn_send(conn, data, len); }
+
+const ServerCallbacks echo_callbacks = {
+    .on_data = echo_data,
+};
+
+// The select loop with echo_data inlined into its read handler
+#define SELECT_LOOP_NAME run_echo_loop
+#define SELECT_LOOP_CALLBACKS echo_callbacks
+#include "select_loop.h"
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "tcpserver.h"
+
+// The echo server, written against libtcpserver's callback API
+extern const ServerCallbacks echo_callbacks;
+
+// run_server_with_select specialized for echo: echo_callbacks are compiled
+// into the loop instead of called through set_server_callbacks'
+int run_echo_loop(const LoopIo *io, int server_fd, UdpEndpoint *udp, int shm_fd, LoopEvents *events);
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "events.h"
+#include "heap.h"
+
+static const int handled_signals[] = {SIGINT, SIGTERM, SIGHUP, SIGUSR1};
+
+LoopEvents *create_loop_events(void) {
+    LoopEvents *events = heap_alloc(sizeof(LoopEvents));
+    if (events == NULL) {
+        fatal_error("Failed to allocate loop events");
+    }
+    memset(events, 0, sizeof(LoopEvents));
+    pthread_mutex_init(&events->lock, NULL);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (size_t i = 0; i < sizeof(handled_signals) / sizeof(handled_signals[0]); i++) {
+        sigaddset(&mask, handled_signals[i]);
+    }
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        fatal_error("pthread_sigmask failed");
+    }
+    events->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (events->signal_fd < 0) {
+        fatal_error("signalfd failed");
+    }
+
+    events->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec tick = {
+        .it_interval = {.tv_sec = EVENTS_TICK_MS / 1000, .tv_nsec = (EVENTS_TICK_MS % 1000) * 1000000L},
+        .it_value = {.tv_sec = EVENTS_TICK_MS / 1000, .tv_nsec = (EVENTS_TICK_MS % 1000) * 1000000L},
+    };
+    if (events->timer_fd < 0 || timerfd_settime(events->timer_fd, 0, &tick, NULL) == -1) {
+        fatal_error("timerfd failed");
+    }
+
+    events->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (events->wake_fd < 0) {
+        fatal_error("eventfd failed");
+    }
+    return events;
+}
+
+void loop_events_add_timer(LoopEvents *events, unsigned interval_ms, LoopTaskFn fn, void *arg) {
+    if (events->ntimers == EVENTS_MAX_TIMERS) {
+        fprintf(stderr, "Too many loop timers, ignoring one\n");
+        return;
+    }
+    uint64_t interval = (interval_ms + EVENTS_TICK_MS - 1) / EVENTS_TICK_MS;
+    if (interval == 0) {
+        interval = 1;
+    }
+    events->timers[events->ntimers++] = (LoopTimer){.task = {fn, arg}, .interval = interval, .due = events->ticks + interval};
+}
+
+void loop_events_on_signal(LoopEvents *events, int signo, LoopTaskFn fn, void *arg) { events->on_signal[signo] = (LoopTask){fn, arg}; }
+
+bool loop_events_post(LoopEvents *events, LoopTaskFn fn, void *arg) {
+    pthread_mutex_lock(&events->lock);
+    bool queued = events->ntasks < EVENTS_MAX_TASKS;
+    if (queued) {
+        events->tasks[events->ntasks++] = (LoopTask){fn, arg};
+    }
+    pthread_mutex_unlock(&events->lock);
+    if (queued) {
+        uint64_t one = 1;
+        if (write(events->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write(eventfd)");
+        }
+    }
+    return queued;
+}
+
+// A loop_events_call in flight. Whoever finishes with it last frees it: the
+// loop once fn ran, or the loop after the caller gave up waiting.
+typedef struct {
+    LoopTask task;
+    pthread_mutex_t lock; // Held while fn runs, so a caller can't give up mid-call
+    pthread_cond_t finished;
+    bool done;
+    bool abandoned;
+} LoopCall;
+
+static void free_call(LoopCall *call) {
+    pthread_cond_destroy(&call->finished);
+    pthread_mutex_destroy(&call->lock);
+    heap_free(call);
+}
+
+static void run_call(void *arg) {
+    LoopCall *call = arg;
+    pthread_mutex_lock(&call->lock);
+    bool abandoned = call->abandoned;
+    if (!abandoned) {
+        call->task.fn(call->task.arg);
+        call->done = true;
+        pthread_cond_signal(&call->finished);
+    }
+    pthread_mutex_unlock(&call->lock);
+    if (abandoned) {
+        free_call(call);
+    }
+}
+
+bool loop_events_call(LoopEvents *events, LoopTaskFn fn, void *arg) {
+    LoopCall *call = heap_alloc(sizeof(LoopCall));
+    if (call == NULL) {
+        return false;
+    }
+    *call = (LoopCall){.task = {fn, arg}};
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&call->finished, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (!loop_events_post(events, run_call, call)) {
+        free_call(call);
+        return false;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += EVENTS_CALL_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (EVENTS_CALL_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&call->lock);
+    while (!call->done && pthread_cond_timedwait(&call->finished, &call->lock, &deadline) == 0) {
+    }
+    bool done = call->done;
+    call->abandoned = !done;
+    pthread_mutex_unlock(&call->lock);
+    if (done) {
+        free_call(call);
+    }
+    return done;
+}
+
+void loop_events_watch(LoopEvents *events, fd_set *master_read_set, int *max_fd) {
+    int fds[] = {events->signal_fd, events->timer_fd, events->wake_fd};
+    for (int i = 0; i < 3; i++) {
+        FD_SET(fds[i], master_read_set);
+        if (fds[i] > *max_fd) {
+            *max_fd = fds[i];
+        }
+    }
+}
+
+// Drain pending signals; false if one asks the loop to stop
+static bool handle_signals(LoopEvents *events) {
+    struct signalfd_siginfo info;
+    bool keep_running = true;
+    while (read(events->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        int signo = (int)info.ssi_signo;
+        if (signo == SIGINT || signo == SIGTERM) {
+            printf("Received %s, shutting down\n", strsignal(signo));
+            keep_running = false;
+        } else if (signo < EVENTS_MAX_SIGNAL && events->on_signal[signo].fn != NULL) {
+            events->on_signal[signo].fn(events->on_signal[signo].arg);
+        } else {
+            printf("Received %s, nothing to do\n", strsignal(signo));
+        }
+    }
+    return keep_running;
+}
+
+// Run the timers whose tick came; a late loop runs each at most once
+static void handle_timer(LoopEvents *events) {
+    uint64_t expirations;
+    if (read(events->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    events->ticks += expirations;
+    for (int i = 0; i < events->ntimers; i++) {
+        LoopTimer *timer = &events->timers[i];
+        if (events->ticks >= timer->due) {
+            timer->due = events->ticks + timer->interval;
+            timer->task.fn(timer->task.arg);
+        }
+    }
+}
+
+// Run the tasks other threads posted
+static void handle_wakeup(LoopEvents *events) {
+    uint64_t count;
+    if (read(events->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    LoopTask tasks[EVENTS_MAX_TASKS];
+    pthread_mutex_lock(&events->lock);
+    int ntasks = events->ntasks;
+    memcpy(tasks, events->tasks, ntasks * sizeof(LoopTask));
+    events->ntasks = 0;
+    pthread_mutex_unlock(&events->lock);
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i].fn(tasks[i].arg);
+    }
+}
+
+bool handle_loop_events(LoopEvents *events, fd_set *read_set) {
+    if (FD_ISSET(events->timer_fd, read_set)) {
+        handle_timer(events);
+    }
+    if (FD_ISSET(events->wake_fd, read_set)) {
+        handle_wakeup(events);
+    }
+    if (FD_ISSET(events->signal_fd, read_set)) {
+        return handle_signals(events);
+    }
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#define EVENTS_TICK_MS 100   // timerfd period; timers run on multiples of it
+#define EVENTS_MAX_TIMERS 8
+#define EVENTS_MAX_TASKS 64  // Posted tasks waiting for the loop
+#define EVENTS_MAX_SIGNAL 32 // Signal numbers below this can have a task
+#define EVENTS_CALL_TIMEOUT_MS 2000
+
+typedef void (*LoopTaskFn)(void *arg);
+
+typedef struct {
+    LoopTaskFn fn;
+    void *arg;
+} LoopTask;
+
+typedef struct {
+    LoopTask task;
+    uint64_t interval; // In ticks
+    uint64_t due;      // Tick it runs next
+} LoopTimer;
+
+// Signals, timers and cross-thread wakeups, delivered as descriptors the
+// select loop watches next to its sockets, so housekeeping runs on the loop
+// thread between handlers instead of in async signal handlers:
+//   signal_fd  SIGINT/SIGTERM stop the loop; SIGHUP/SIGUSR1 run their task
+//   timer_fd   ticks every EVENTS_TICK_MS and runs the timers that are due
+//   wake_fd    eventfd other threads write after posting a task
+typedef struct {
+    int signal_fd;
+    int timer_fd;
+    int wake_fd;
+    uint64_t ticks;
+    LoopTimer timers[EVENTS_MAX_TIMERS];
+    int ntimers;
+    LoopTask on_signal[EVENTS_MAX_SIGNAL];
+    pthread_mutex_t lock; // Guards tasks, which any thread may post to
+    LoopTask tasks[EVENTS_MAX_TASKS];
+    int ntasks;
+} LoopEvents;
+
+// Block the handled signals and create the descriptors. Call before starting
+// other threads so they inherit the signal mask and leave signals to the loop.
+LoopEvents *create_loop_events(void);
+
+// Run fn every interval_ms (rounded up to whole ticks) on the loop thread
+void loop_events_add_timer(LoopEvents *events, unsigned interval_ms, LoopTaskFn fn, void *arg);
+
+// Run fn on the loop thread when SIGHUP or SIGUSR1 arrives
+void loop_events_on_signal(LoopEvents *events, int signo, LoopTaskFn fn, void *arg);
+
+// Queue fn to run on the loop thread; callable from any thread. Returns
+// false if too many tasks are already waiting.
+bool loop_events_post(LoopEvents *events, LoopTaskFn fn, void *arg);
+
+// Run fn on the loop thread and wait for it to finish; from another thread.
+// Returns false without fn having run if the loop doesn't get to it within
+// EVENTS_CALL_TIMEOUT_MS (it's stalled, or too many tasks are waiting).
+bool loop_events_call(LoopEvents *events, LoopTaskFn fn, void *arg);
+
+// Add the descriptors to the loop's read set
+void loop_events_watch(LoopEvents *events, fd_set *master_read_set, int *max_fd);
+
+// Service whichever descriptors select() reported. Returns false once the
+// loop was asked to stop.
+bool handle_loop_events(LoopEvents *events, fd_set *read_set);
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "config.h"
+#include "error.h"
+#include "heap.h"
+
+#define SLAB_SIZE ((size_t)1 << HEAP_SLAB_SHIFT)
+
+_Static_assert(HUGE_PAGE_SIZE % SLAB_SIZE == 0, "arena_map aligns the arena to huge pages, so slabs must divide them");
+
+// Only the owning thread writes a heap's counters, so a relaxed load and
+// store does (no locked add); other threads may read slightly stale values
+#define stat_add(field, n) __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define stat_get(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;        // By the owning thread
+    uint64_t remote_frees; // By other threads, counted once collected
+    uint64_t slabs;        // Slabs carved into this class
+    uint64_t trimmed_bytes;
+} HeapClassStats;
+
+// Free blocks are linked through their first word. The first untrimmed
+// blocks on the list still have all their pages; the rest were trimmed.
+typedef struct {
+    void *free_list;
+    size_t untrimmed;
+    char *carve; // Next unused block of the class's current slab
+    char *carve_end;
+    HeapClassStats stats;
+} HeapClass;
+
+typedef struct {
+    _Alignas(CACHE_LINE) void *remote_free; // Pushed by other threads with CAS, taken whole by the owner
+    _Alignas(CACHE_LINE) HeapClass classes[HEAP_MAX_SHIFT + 1];
+} Heap;
+
+// Which heap and class a slab's blocks belong to. Blocks of a slab or more
+// span several slabs; only the first one's entry is set.
+typedef struct {
+    uint8_t heap;
+    uint8_t shift;
+} SlabOwner;
+
+static struct {
+    char *base;
+    size_t nslabs;
+    size_t next_slab; // Slabs carved so far, advanced with CAS
+    SlabOwner *owners;
+    int nheaps;
+    pthread_mutex_t lock; // Guards mapping the arena and claiming heaps
+} region = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static Heap heaps[HEAP_MAX_THREADS];
+static _Thread_local Heap *thread_heap;
+
+static void map_region_locked(size_t size, size_t prefault) {
+    if (region.base != NULL) {
+        return;
+    }
+    region.base = arena_map(&size, prefault, "Heap arena");
+    region.nslabs = size >> HEAP_SLAB_SHIFT;
+    region.owners = calloc(region.nslabs, sizeof(SlabOwner));
+    if (region.owners == NULL) {
+        fatal_error("Failed to allocate heap slab table");
+    }
+}
+
+void heap_init(size_t size, size_t prefault) {
+    pthread_mutex_lock(&region.lock);
+    map_region_locked(size, prefault);
+    pthread_mutex_unlock(&region.lock);
+}
+
+// First allocation on a thread: give it a heap of its own
+static Heap *claim_heap(void) {
+    pthread_mutex_lock(&region.lock);
+    map_region_locked(HEAP_DEFAULT_SIZE, 0);
+    if (region.nheaps == HEAP_MAX_THREADS) {
+        fprintf(stderr, "More than %d threads allocating\n", HEAP_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    thread_heap = &heaps[region.nheaps];
+    __atomic_store_n(&region.nheaps, region.nheaps + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&region.lock);
+    return thread_heap;
+}
+
+static SlabOwner slab_owner(const void *ptr) { return region.owners[(size_t)((const char *)ptr - region.base) >> HEAP_SLAB_SHIFT]; }
+
+// Smallest class (as a shift) holding size bytes
+static int class_shift(size_t size) {
+    if (size <= ((size_t)1 << HEAP_MIN_SHIFT)) {
+        return HEAP_MIN_SHIFT;
+    }
+    return 64 - __builtin_clzll(size - 1);
+}
+
+static void push_free(HeapClass *class, void *block) {
+    *(void **)block = class->free_list;
+    class->free_list = block;
+    class->untrimmed++;
+}
+
+static void *pop_free(HeapClass *class) {
+    void *block = class->free_list;
+    class->free_list = *(void **)block;
+    if (class->untrimmed > 0) {
+        class->untrimmed--;
+    }
+    return block;
+}
+
+// Move blocks other threads freed onto the owner's lists
+static void collect_remote_frees(Heap *heap) {
+    void *block = __atomic_exchange_n(&heap->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        void *next = *(void **)block;
+        HeapClass *class = &heap->classes[slab_owner(block).shift];
+        push_free(class, block);
+        stat_add(class->stats.remote_frees, 1);
+        block = next;
+    }
+}
+
+// Cut a fresh block from the class's slab, taking the next slabs of the
+// arena when it's used up. Blocks of a slab or more get slabs of their own.
+static void *carve_block(Heap *heap, int shift) {
+    HeapClass *class = &heap->classes[shift];
+    if (class->carve == class->carve_end) {
+        size_t nslabs = shift > HEAP_SLAB_SHIFT ? (size_t)1 << (shift - HEAP_SLAB_SHIFT) : 1;
+        size_t first = __atomic_load_n(&region.next_slab, __ATOMIC_RELAXED);
+        do {
+            if (first + nslabs > region.nslabs) {
+                return NULL;
+            }
+        } while (!__atomic_compare_exchange_n(&region.next_slab, &first, first + nslabs, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        region.owners[first] = (SlabOwner){.heap = (uint8_t)(heap - heaps), .shift = (uint8_t)shift};
+        class->carve = region.base + (first << HEAP_SLAB_SHIFT);
+        class->carve_end = class->carve + nslabs * SLAB_SIZE;
+        stat_add(class->stats.slabs, nslabs);
+    }
+    void *block = class->carve;
+    class->carve += (size_t)1 << shift;
+    return block;
+}
+
+void *heap_alloc(size_t size) {
+    if (size > ((size_t)1 << HEAP_MAX_SHIFT)) {
+        return NULL;
+    }
+    Heap *heap = thread_heap != NULL ? thread_heap : claim_heap();
+    int shift = class_shift(size);
+    HeapClass *class = &heap->classes[shift];
+
+    if (class->free_list == NULL && __atomic_load_n(&heap->remote_free, __ATOMIC_RELAXED) != NULL) {
+        collect_remote_frees(heap);
+    }
+    void *block = class->free_list != NULL ? pop_free(class) : carve_block(heap, shift);
+
+    // Arena exhausted: settle for a free block of a larger class
+    for (int s = shift + 1; block == NULL && s <= HEAP_MAX_SHIFT; s++) {
+        class = &heap->classes[s];
+        if (class->free_list != NULL) {
+            block = pop_free(class);
+        }
+    }
+    if (block != NULL) {
+        stat_add(class->stats.allocs, 1);
+    }
+    return block;
+}
+
+void heap_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    SlabOwner owner = slab_owner(ptr);
+    Heap *heap = &heaps[owner.heap];
+    if (heap == thread_heap) {
+        HeapClass *class = &heap->classes[owner.shift];
+        push_free(class, ptr);
+        stat_add(class->stats.frees, 1);
+        return;
+    }
+
+    // Hand it back to the owning thread
+    void *head = __atomic_load_n(&heap->remote_free, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&heap->remote_free, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+size_t heap_usable_size(const void *ptr) { return (size_t)1 << slab_owner(ptr).shift; }
+
+size_t heap_trim(void) {
+    Heap *heap = thread_heap;
+    if (heap == NULL) {
+        return 0;
+    }
+    if (__atomic_load_n(&heap->remote_free, __ATOMIC_RELAXED) != NULL) {
+        collect_remote_frees(heap);
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t trimmed = 0;
+    for (int shift = HEAP_MIN_SHIFT; shift <= HEAP_MAX_SHIFT; shift++) {
+        size_t size = (size_t)1 << shift;
+        HeapClass *class = &heap->classes[shift];
+        if (size < 2 * page) {
+            continue;
+        }
+        size_t released = 0;
+        char *block = class->free_list;
+        for (; class->untrimmed > 0; class->untrimmed--) {
+            if (madvise(block + page, size - page, MADV_DONTNEED) == 0) {
+                released += size - page;
+            }
+            block = *(void **)block;
+        }
+        if (released > 0) {
+            stat_add(class->stats.trimmed_bytes, released);
+            trimmed += released;
+        }
+    }
+    return trimmed;
+}
+
+void write_heap_stats(FILE *out) {
+    int nheaps = __atomic_load_n(&region.nheaps, __ATOMIC_ACQUIRE);
+    fprintf(out, "arena_bytes %zu\nslabs_carved %zu\nheaps %d\n", region.nslabs * SLAB_SIZE, __atomic_load_n(&region.next_slab, __ATOMIC_RELAXED), nheaps);
+    fprintf(out, "%-4s %12s %12s %12s %12s %10s %8s %14s\n", "heap", "class_bytes", "allocs", "frees", "remote_frees", "in_use", "slabs", "trimmed_bytes");
+    for (int i = 0; i < nheaps; i++) {
+        for (int shift = HEAP_MIN_SHIFT; shift <= HEAP_MAX_SHIFT; shift++) {
+            HeapClassStats *stats = &heaps[i].classes[shift].stats;
+            uint64_t allocs = stat_get(stats->allocs);
+            if (allocs == 0) {
+                continue;
+            }
+            // Blocks freed remotely but not collected yet still count as in use
+            uint64_t frees = stat_get(stats->frees), remote_frees = stat_get(stats->remote_frees);
+            fprintf(out, "%-4d %12zu %12llu %12llu %12llu %10lld %8llu %14llu\n", i, (size_t)1 << shift, (unsigned long long)allocs, (unsigned long long)frees,
+                    (unsigned long long)remote_frees, (long long)(allocs - frees - remote_frees), (unsigned long long)stat_get(stats->slabs),
+                    (unsigned long long)stat_get(stats->trimmed_bytes));
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define HEAP_MIN_SHIFT 4                    // Smallest size class, 16 B
+#define HEAP_MAX_SHIFT 30                   // Largest size class, 1 GB
+#define HEAP_SLAB_SHIFT 16                  // Classes are carved from 64 KB slabs, many to a huge page
+#define HEAP_MAX_THREADS 64                 // Threads that may allocate
+#define HEAP_DEFAULT_SIZE ((size_t)1 << 30) // Arena mapped when heap_init wasn't called
+
+// Size-class allocator for the server's buffers, connection records and
+// protocol objects. Sizes round up to a power of two. Each thread allocates
+// from a heap of its own without locking: a heap carves its classes from
+// slabs of one shared huge-page arena and keeps freed blocks on a list per
+// class. A block freed by another thread goes onto its owner's lock-free
+// remote-free queue, and the owner takes it back once its local list runs
+// dry. Memory stays with its class; heap_trim releases idle blocks' pages.
+// A heap outlives its thread.
+
+// Map the arena, size bytes of address space, prefaulting its first prefault
+// bytes: slabs are carved from the start, so that's where allocations land
+// first. Call before the first allocation; otherwise HEAP_DEFAULT_SIZE is
+// mapped then.
+void heap_init(size_t size, size_t prefault);
+
+// Returns NULL once the arena is exhausted and no larger free block is left
+void *heap_alloc(size_t size);
+
+// Any thread may free any block; NULL is ignored
+void heap_free(void *ptr);
+
+// Bytes usable in a block: its class size
+size_t heap_usable_size(const void *ptr);
+
+// Release the pages of blocks the calling thread's heap holds free, except
+// the first page of each (it links the free list). Returns bytes released.
+size_t heap_trim(void);
+
+// Per-heap, per-class counters, one line per class in use
+void write_heap_stats(FILE *out);
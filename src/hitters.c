@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hitters.h"
+
+// Odd multipliers giving each row its own hash of the key
+static const uint64_t row_seeds[SKETCH_DEPTH] = {0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0xd6e8feb86659fd93ull};
+
+uint64_t hitters_key(const char *name, size_t len) {
+    // FNV-1a, then a murmur finalizer so the rows' top bits are well mixed
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static void swap_hitters(Hitter *a, Hitter *b) {
+    Hitter tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Restore the min-heap below i after its count grew
+static void sift_down(HeavyHitters *hitters, int i) {
+    while (true) {
+        int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < hitters->ntop && hitters->top[left].count < hitters->top[smallest].count) {
+            smallest = left;
+        }
+        if (right < hitters->ntop && hitters->top[right].count < hitters->top[smallest].count) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        swap_hitters(&hitters->top[i], &hitters->top[smallest]);
+        i = smallest;
+    }
+}
+
+static void sift_up(HeavyHitters *hitters, int i) {
+    while (i > 0 && hitters->top[(i - 1) / 2].count > hitters->top[i].count) {
+        swap_hitters(&hitters->top[i], &hitters->top[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+}
+
+void hitters_add(HeavyHitters *hitters, uint64_t key, const char *name, size_t name_len, uint64_t n) {
+    uint64_t estimate = UINT64_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint64_t *counter = &hitters->sketch[row][(key * row_seeds[row]) >> (64 - SKETCH_WIDTH_SHIFT)];
+        *counter += n;
+        if (*counter < estimate) {
+            estimate = *counter;
+        }
+    }
+
+    // Most keys are lighter than everything in a full heap
+    if (hitters->ntop == HITTERS_K && estimate <= hitters->top[0].count) {
+        return;
+    }
+    for (int i = 0; i < hitters->ntop; i++) {
+        if (hitters->top[i].key == key) {
+            hitters->top[i].count = estimate;
+            sift_down(hitters, i);
+            return;
+        }
+    }
+    Hitter entry = {.key = key, .count = estimate};
+    snprintf(entry.name, sizeof(entry.name), "%.*s", (int)name_len, name);
+    if (hitters->ntop < HITTERS_K) {
+        hitters->top[hitters->ntop] = entry;
+        sift_up(hitters, hitters->ntop++);
+    } else {
+        hitters->top[0] = entry;
+        sift_down(hitters, 0);
+    }
+}
+
+void hitters_decay(HeavyHitters *hitters) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (size_t i = 0; i < (1u << SKETCH_WIDTH_SHIFT); i++) {
+            hitters->sketch[row][i] -= hitters->sketch[row][i] >> HITTERS_DECAY_SHIFT;
+        }
+    }
+    // Decay is monotonic, so it keeps the heap order
+    for (int i = 0; i < hitters->ntop; i++) {
+        hitters->top[i].count -= hitters->top[i].count >> HITTERS_DECAY_SHIFT;
+    }
+}
+
+static int heavier_first(const void *a, const void *b) {
+    const Hitter *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+void write_hitters(FILE *out, const HeavyHitters *hitters, double scale) {
+    Hitter sorted[HITTERS_K];
+    memcpy(sorted, hitters->top, hitters->ntop * sizeof(Hitter));
+    qsort(sorted, hitters->ntop, sizeof(Hitter), heavier_first);
+    for (int i = 0; i < hitters->ntop; i++) {
+        if (sorted[i].count > 0) {
+            fprintf(out, "%-24s %.0f\n", sorted[i].name, sorted[i].count * scale);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HITTERS_K 10          // Heaviest keys tracked
+#define SKETCH_DEPTH 4        // Independent hash rows; the estimate is their minimum
+#define SKETCH_WIDTH_SHIFT 10 // 1024 counters per row
+#define HITTERS_NAME_LEN 48
+#define HITTERS_DECAY_SHIFT 3 // hitters_decay takes 1/8 off every count
+
+// Streaming top-K: a count-min sketch estimates every key's count in fixed
+// memory (over-estimating only by collisions), and a min-heap keeps the K
+// keys with the highest estimates. An update costs SKETCH_DEPTH counter
+// increments, plus a heap scan only for keys heavier than the heap's
+// lightest. Decaying everything periodically (hitters_decay) turns counts
+// into an exponentially weighted recent rate: a key adding r per period
+// settles at r << HITTERS_DECAY_SHIFT.
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+    char name[HITTERS_NAME_LEN]; // Printable key
+} Hitter;
+
+typedef struct {
+    uint64_t sketch[SKETCH_DEPTH][1u << SKETCH_WIDTH_SHIFT];
+    Hitter top[HITTERS_K]; // Min-heap by count
+    int ntop;
+} HeavyHitters;
+
+// A well-mixed key for name, e.g. a peer's host
+uint64_t hitters_key(const char *name, size_t len);
+
+// Count n more for key; the first name_len bytes of name label it should it
+// make the top
+void hitters_add(HeavyHitters *hitters, uint64_t key, const char *name, size_t name_len, uint64_t n);
+
+// Take count >> HITTERS_DECAY_SHIFT off every count
+void hitters_decay(HeavyHitters *hitters);
+
+// The top keys, heaviest first, one "name value" line each, where value is
+// the count times scale (to print a rate, say)
+void write_hitters(FILE *out, const HeavyHitters *hitters, double scale);
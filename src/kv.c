@@ -0,0 +1,887 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmdlog.h"
+#include "config.h"
+#include "events.h"
+#include "heap.h"
+#include "kv.h"
+#include "metrics.h"
+
+typedef struct {
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t value_len;
+    char data[]; // Key, then value
+} KvEntry;
+
+// Commands as the log records them: op, key length, key, value
+enum { KV_OP_SET = 1, KV_OP_DEL = 2 };
+#define KV_RECORD_HEADER (1 + sizeof(uint32_t))
+
+#define KV_SNAPSHOT_MAGIC "TSKVSNP1"
+
+// Starts a snapshot file; the entries follow, each a key length and value
+// length (uint32_t), then the key and value
+typedef struct {
+    char magic[8];
+    uint64_t keys;
+    uint64_t log_offset; // Where replay resumes; records just past it may be in the snapshot too
+} SnapshotHeader;
+
+_Static_assert(KV_SNAPSHOT_CHUNK >= 2 * sizeof(uint32_t) + KV_MAX_LINE, "a snapshot entry must fit a chunk");
+
+// What the snapshot child sends back before exiting
+typedef struct {
+    int error; // errno of what failed, 0 if the snapshot is in place
+    uint64_t keys;
+    uint64_t bytes;
+    uint64_t duration_ns; // From fork to the file's rename
+    uint64_t cow_bytes;
+} SnapshotReport;
+
+// A command split across reads, kept until its end arrives
+typedef struct {
+    size_t len;
+    char line[KV_MAX_LINE];
+} KvPartial;
+
+// Heap bytes a connection holds on to while it waits for a sync
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} KvBuffer;
+
+// What a connection keeps in conn_data between reads
+typedef struct KvConn {
+    Connection conn;            // A copy, to release parked replies from a loop task
+    struct KvConn *prev, *next; // In store.parked, while replies are parked
+    KvPartial *partial;         // NULL unless a command is split across reads
+    KvBuffer parked;            // Replies held until record unsynced is durable
+    KvBuffer input;             // Commands not run yet, for after the parked replies
+    uint64_t unsynced;
+    bool hang_up; // Close once the parked replies have gone out
+} KvConn;
+
+// Open addressing with linear probing over entry pointers; deleting shifts
+// the entries after it back instead of leaving tombstones. Only the loop
+// thread touches it, but for release_posted.
+static struct {
+    KvEntry **slots;
+    size_t capacity; // Power of two, 0 until the first insert
+    size_t count;
+    CommandLog *log;
+    uint64_t logged;     // Sequence number of the last record logged
+    KvConn *parked;      // Connections whose replies wait for a sync
+    LoopEvents *events;  // The loop release_parked runs on
+    bool release_posted; // A release_parked task is queued; set by the flusher thread
+    const char *log_path;
+    const char *snapshot_path;
+    char snapshot_tmp[PATH_MAX]; // Where the child writes before renaming over snapshot_path
+    bool snapshotting;           // A child is writing; cleared by kv_snapshot_finish's thread
+} store;
+
+static struct {
+    char data[KV_REPLY_BUFFER];
+    size_t len;
+} replies;
+
+static uint64_t key_hash(const char *key, size_t len) {
+    // FNV-1a, then a murmur finalizer so the low bits the table indexes by are well mixed
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Slot holding key, or the empty slot where it would go
+static size_t find_slot(const char *key, size_t len, uint64_t hash) {
+    size_t mask = store.capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        KvEntry *entry = store.slots[i];
+        if (entry == NULL || (entry->hash == hash && entry->key_len == len && memcmp(entry->data, key, len) == 0)) {
+            return i;
+        }
+    }
+}
+
+// Move every entry to a table of capacity slots
+static bool store_resize(size_t capacity) {
+    KvEntry **slots = heap_alloc(capacity * sizeof(KvEntry *));
+    if (slots == NULL) {
+        return false;
+    }
+    memset(slots, 0, capacity * sizeof(KvEntry *));
+    KvEntry **old = store.slots;
+    size_t old_capacity = store.capacity;
+    store.slots = slots;
+    store.capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i] != NULL) {
+            store.slots[find_slot(old[i]->data, old[i]->key_len, old[i]->hash)] = old[i];
+        }
+    }
+    heap_free(old);
+    return true;
+}
+
+// Room for count keys at no more than 3/4 load; false if that's more slots
+// than could ever be allocated
+static bool store_reserve(size_t count) {
+    size_t capacity = store.capacity > 0 ? store.capacity : KV_MIN_CAPACITY;
+    while (count > capacity / 4 * 3) {
+        if (capacity > SIZE_MAX / 2 / sizeof(KvEntry *)) {
+            return false;
+        }
+        capacity *= 2;
+    }
+    return capacity == store.capacity || store_resize(capacity);
+}
+
+static KvEntry *new_entry(const char *key, size_t key_len, const char *value, size_t value_len) {
+    KvEntry *entry = heap_alloc(sizeof(KvEntry) + key_len + value_len);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = key_hash(key, key_len);
+    entry->key_len = (uint32_t)key_len;
+    entry->value_len = (uint32_t)value_len;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, value, value_len);
+    return entry;
+}
+
+static bool store_set(const char *key, size_t key_len, const char *value, size_t value_len) {
+    if (!store_reserve(store.count + 1)) {
+        return false;
+    }
+    KvEntry *entry = new_entry(key, key_len, value, value_len);
+    if (entry == NULL) {
+        return false;
+    }
+    size_t slot = find_slot(key, key_len, entry->hash);
+    if (store.slots[slot] != NULL) {
+        heap_free(store.slots[slot]);
+    } else {
+        store.count++;
+    }
+    store.slots[slot] = entry;
+    return true;
+}
+
+// Bulk insert of a key known to be absent, as a snapshot's keys are, into a
+// table already sized for it: the first free slot will do, with no key
+// comparisons on the way
+static bool store_insert_new(const char *key, size_t key_len, const char *value, size_t value_len) {
+    KvEntry *entry = new_entry(key, key_len, value, value_len);
+    if (entry == NULL) {
+        return false;
+    }
+    size_t mask = store.capacity - 1, i = entry->hash & mask;
+    while (store.slots[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    store.slots[i] = entry;
+    store.count++;
+    return true;
+}
+
+static const KvEntry *store_get(const char *key, size_t key_len) {
+    if (store.capacity == 0) {
+        return NULL;
+    }
+    return store.slots[find_slot(key, key_len, key_hash(key, key_len))];
+}
+
+static bool store_del(const char *key, size_t key_len) {
+    if (store.capacity == 0) {
+        return false;
+    }
+    size_t mask = store.capacity - 1;
+    size_t hole = find_slot(key, key_len, key_hash(key, key_len));
+    if (store.slots[hole] == NULL) {
+        return false;
+    }
+    heap_free(store.slots[hole]);
+    store.slots[hole] = NULL;
+    store.count--;
+
+    // Pull back entries that probed past the hole, so lookups still reach them
+    for (size_t i = (hole + 1) & mask; store.slots[i] != NULL; i = (i + 1) & mask) {
+        size_t home = store.slots[i]->hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            store.slots[hole] = store.slots[i];
+            store.slots[i] = NULL;
+            hole = i;
+        }
+    }
+    return true;
+}
+
+// Apply a logged command to the store
+static bool apply_record(const char *record, size_t len) {
+    uint32_t key_len;
+    if (len < KV_RECORD_HEADER) {
+        return false;
+    }
+    memcpy(&key_len, record + 1, sizeof(key_len));
+    if (key_len > len - KV_RECORD_HEADER) {
+        return false;
+    }
+    const char *key = record + KV_RECORD_HEADER;
+    switch (record[0]) {
+    case KV_OP_SET:
+        return store_set(key, key_len, key + key_len, len - KV_RECORD_HEADER - key_len);
+    case KV_OP_DEL:
+        store_del(key, key_len);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Log a command before its reply goes out
+static void log_command(int op, const char *key, size_t key_len, const char *value, size_t value_len) {
+    if (store.log == NULL) {
+        return;
+    }
+    char record[KV_RECORD_HEADER + KV_MAX_LINE];
+    uint32_t len32 = (uint32_t)key_len;
+    record[0] = (char)op;
+    memcpy(record + 1, &len32, sizeof(len32));
+    memcpy(record + KV_RECORD_HEADER, key, key_len);
+    memcpy(record + KV_RECORD_HEADER + key_len, value, value_len);
+    store.logged = command_log_append(store.log, record, KV_RECORD_HEADER + key_len + value_len);
+}
+
+// The connection's KvConn, made on first use; NULL if out of memory
+static KvConn *kv_conn(Connection *conn) {
+    KvConn *kc = conn_data(conn);
+    if (kc == NULL && (kc = heap_alloc(sizeof(KvConn))) != NULL) {
+        *kc = (KvConn){.conn = *conn};
+        conn_set_data(conn, kc);
+    }
+    return kc;
+}
+
+static bool buffer_append(KvBuffer *buf, const char *data, size_t len) {
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity > 0 ? buf->capacity : KV_PARKED_MIN;
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+        char *grown = heap_alloc(capacity);
+        if (grown == NULL) {
+            return false;
+        }
+        if (buf->len > 0) {
+            memcpy(grown, buf->data, buf->len);
+        }
+        heap_free(buf->data);
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+// Hand the buffer's bytes over to the caller, leaving it empty
+static char *buffer_take(KvBuffer *buf, size_t *len) {
+    char *data = buf->data;
+    *len = buf->len;
+    *buf = (KvBuffer){0};
+    return data;
+}
+
+static void unlink_parked(KvConn *kc) {
+    if (kc->prev != NULL) {
+        kc->prev->next = kc->next;
+    } else {
+        store.parked = kc->next;
+    }
+    if (kc->next != NULL) {
+        kc->next->prev = kc->prev;
+    }
+    kc->prev = kc->next = NULL;
+}
+
+// Hold the gathered replies until record seq is durable, and stop reading
+// from the connection meanwhile: the loop goes on serving the others, and
+// their commands share the sync
+static bool park_replies(Connection *conn, uint64_t seq) {
+    KvConn *kc = kv_conn(conn);
+    bool parked = kc != NULL && kc->parked.len > 0;
+    if (kc == NULL || !buffer_append(&kc->parked, replies.data, replies.len)) {
+        fprintf(stderr, "Out of memory parking replies for fd=%d, closing connection\n", conn_fd(conn));
+        replies.len = 0;
+        conn_close(conn);
+        return false;
+    }
+    replies.len = 0;
+    kc->unsynced = seq;
+    if (!parked) {
+        kc->next = store.parked;
+        if (store.parked != NULL) {
+            store.parked->prev = kc;
+        }
+        store.parked = kc;
+        conn_hold_input(conn, true);
+    }
+    return true;
+}
+
+// Keep commands that arrived behind parked replies for when they're sent
+static bool defer_input(Connection *conn, KvConn *kc, const char *data, size_t len) {
+    if (!buffer_append(&kc->input, data, len)) {
+        fprintf(stderr, "Out of memory deferring input for fd=%d, closing connection\n", conn_fd(conn));
+        conn_close(conn);
+        return false;
+    }
+    return true;
+}
+
+// Send the gathered replies once what they reflect is durable: under
+// SYNC_ALWAYS, everything logged so far, by this connection or another, as
+// a GET may return a value still waiting for its sync. Until then they're
+// parked, and behind replies already parked they always are. A log that
+// failed closes the connection rather than acknowledge writes it lost.
+static bool flush_replies(Connection *conn) {
+    if (replies.len == 0) {
+        return true;
+    }
+    const KvConn *kc = conn_data(conn);
+    int synced = store.log != NULL ? command_log_synced(store.log, store.logged) : 1;
+    if (synced == -1) {
+        replies.len = 0;
+        conn_close(conn);
+        return false;
+    }
+    if (synced == 0 || (kc != NULL && kc->parked.len > 0)) {
+        return park_replies(conn, store.logged);
+    }
+    bool sent = conn_send(conn, replies.data, replies.len);
+    replies.len = 0;
+    return sent;
+}
+
+static bool reply(Connection *conn, const char *data, size_t len) {
+    while (replies.len + len > sizeof(replies.data)) {
+        size_t take = sizeof(replies.data) - replies.len;
+        memcpy(replies.data + replies.len, data, take);
+        replies.len += take;
+        data += take;
+        len -= take;
+        if (!flush_replies(conn)) {
+            return false;
+        }
+    }
+    memcpy(replies.data + replies.len, data, len);
+    replies.len += len;
+    return true;
+}
+
+#define REPLY(conn, text) reply(conn, text, sizeof(text) - 1)
+
+// Run one command (without its line end); false once the connection closed
+static bool execute(Connection *conn, const char *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    const char *end = line + len;
+    const char *key = memchr(line, ' ', len);
+    if (key == NULL) {
+        return REPLY(conn, "ERROR\n");
+    }
+    size_t command_len = (size_t)(key - line);
+    key++;
+    const char *key_end = memchr(key, ' ', (size_t)(end - key));
+    size_t key_len = (size_t)((key_end != NULL ? key_end : end) - key);
+    if (key_len == 0) {
+        return REPLY(conn, "ERROR\n");
+    }
+
+    if (command_len == 3 && memcmp(line, "GET", 3) == 0 && key_end == NULL) {
+        const KvEntry *entry = store_get(key, key_len);
+        if (entry == NULL) {
+            return REPLY(conn, "NOT_FOUND\n");
+        }
+        return REPLY(conn, "VALUE ") && reply(conn, entry->data + entry->key_len, entry->value_len) && REPLY(conn, "\n");
+    }
+    if (command_len == 3 && memcmp(line, "SET", 3) == 0 && key_end != NULL) {
+        const char *value = key_end + 1;
+        if (!store_set(key, key_len, value, (size_t)(end - value))) {
+            return REPLY(conn, "ERROR out of memory\n");
+        }
+        metric_set(kv_keys, store.count);
+        log_command(KV_OP_SET, key, key_len, value, (size_t)(end - value));
+        return REPLY(conn, "OK\n");
+    }
+    if (command_len == 3 && memcmp(line, "DEL", 3) == 0 && key_end == NULL) {
+        if (!store_del(key, key_len)) {
+            return REPLY(conn, "NOT_FOUND\n");
+        }
+        metric_set(kv_keys, store.count);
+        log_command(KV_OP_DEL, key, key_len, NULL, 0);
+        return REPLY(conn, "DELETED\n");
+    }
+    return REPLY(conn, "ERROR\n");
+}
+
+// Too long to be a command: say so and hang up, once the replies before it
+// have gone out
+static void reject_line(Connection *conn) {
+    if (!REPLY(conn, "ERROR line too long\n") || !flush_replies(conn)) {
+        return;
+    }
+    KvConn *kc = conn_data(conn);
+    if (kc != NULL && kc->parked.len > 0) {
+        kc->hang_up = true;
+    } else {
+        conn_close(conn);
+    }
+}
+
+// Run the commands in data, keeping a partial one for the next read. Once
+// replies get parked partway through, the rest waits with them, so a
+// connection holds no more than about two reply buffers while it waits.
+static void run_commands(Connection *conn, const char *data, size_t len) {
+    const char *end = data + len;
+
+    // Finish the command the last read left partial
+    KvConn *kc = conn_data(conn);
+    KvPartial *partial = kc != NULL ? kc->partial : NULL;
+    if (partial != NULL) {
+        const char *newline = memchr(data, '\n', len);
+        size_t take = (size_t)((newline != NULL ? newline : end) - data);
+        if (partial->len + take > KV_MAX_LINE) {
+            reject_line(conn);
+            return;
+        }
+        memcpy(partial->line + partial->len, data, take);
+        partial->len += take;
+        if (newline == NULL) {
+            return;
+        }
+        kc->partial = NULL;
+        bool open = execute(conn, partial->line, partial->len);
+        heap_free(partial);
+        if (!open) {
+            return;
+        }
+        data = newline + 1;
+    }
+
+    while (data < end) {
+        kc = conn_data(conn);
+        if (kc != NULL && kc->parked.len > 0) {
+            if (flush_replies(conn)) {
+                defer_input(conn, kc, data, (size_t)(end - data));
+            }
+            return;
+        }
+        const char *newline = memchr(data, '\n', (size_t)(end - data));
+        if (newline == NULL) {
+            // Keep the start of a command for the next read
+            size_t rest = (size_t)(end - data);
+            partial = rest <= KV_MAX_LINE ? heap_alloc(sizeof(KvPartial)) : NULL;
+            if (partial == NULL || (kc = kv_conn(conn)) == NULL) {
+                heap_free(partial);
+                reject_line(conn);
+                return;
+            }
+            partial->len = rest;
+            memcpy(partial->line, data, rest);
+            kc->partial = partial;
+            break;
+        }
+        if (newline - data > KV_MAX_LINE) {
+            reject_line(conn);
+            return;
+        }
+        if (!execute(conn, data, (size_t)(newline - data))) {
+            return;
+        }
+        data = newline + 1;
+    }
+    flush_replies(conn);
+}
+
+static void kv_data(Connection *conn, const char *data, size_t len) {
+    KvConn *kc = conn_data(conn);
+    if (kc != NULL && kc->hang_up) {
+        return;
+    }
+    // Input that arrives anyway (shared memory can't be held) goes behind
+    // what was deferred
+    if (kc != NULL && kc->input.len > 0) {
+        defer_input(conn, kc, data, len);
+        return;
+    }
+    run_commands(conn, data, len);
+}
+
+static void kv_close_conn(Connection *conn) {
+    KvConn *kc = conn_data(conn);
+    if (kc == NULL) {
+        return;
+    }
+    if (kc->parked.len > 0) {
+        unlink_parked(kc);
+    }
+    heap_free(kc->parked.data);
+    heap_free(kc->input.data);
+    heap_free(kc->partial);
+    heap_free(kc);
+    conn_set_data(conn, NULL);
+}
+
+// Loop task: send the parked replies whose record is durable by now, take
+// reads from their connections again and run the commands deferred behind
+// the replies
+static void release_parked(void *arg) {
+    (void)arg;
+    __atomic_store_n(&store.release_posted, false, __ATOMIC_RELEASE);
+    KvConn *next;
+    for (KvConn *kc = store.parked; kc != NULL; kc = next) {
+        next = kc->next;
+        // Closing frees kc, so act on a copy
+        Connection conn = kc->conn;
+        int synced = command_log_synced(store.log, kc->unsynced);
+        if (synced == -1) {
+            conn_close(&conn);
+            continue;
+        }
+        if (synced == 0) {
+            continue;
+        }
+        unlink_parked(kc);
+        size_t len;
+        char *parked = buffer_take(&kc->parked, &len);
+        bool sent = conn_send(&conn, parked, len);
+        heap_free(parked);
+        if (!sent) {
+            continue;
+        }
+        if (kc->hang_up) {
+            conn_close(&conn);
+            continue;
+        }
+        conn_hold_input(&conn, false);
+        char *input = buffer_take(&kc->input, &len);
+        if (input != NULL) {
+            run_commands(&conn, input, len);
+            heap_free(input);
+        }
+    }
+}
+
+// On the flusher thread, after a sync: have the loop release what it let
+// through. One queued task at a time will do, as it releases everything
+// durable by the time it runs.
+static void post_release(void *arg) {
+    (void)arg;
+    if (!__atomic_exchange_n(&store.release_posted, true, __ATOMIC_ACQ_REL) && !loop_events_post(store.events, release_parked, NULL)) {
+        __atomic_store_n(&store.release_posted, false, __ATOMIC_RELEASE);
+    }
+}
+
+const ServerCallbacks kv_callbacks = {
+    .on_data = kv_data,
+    .on_close = kv_close_conn,
+};
+
+// Replay's bulk-load path: size the table for every record up front, so
+// nothing is rehashed along the way, and apply without logging or replying
+static void replay_reserve(void *arg, size_t records) {
+    (void)arg;
+    store_reserve(store.count + records);
+}
+
+static bool replay_apply(void *arg, const char *record, size_t len) {
+    (void)arg;
+    return apply_record(record, len);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Load a snapshot into the empty store: map it, size the table for its key
+// count and bulk insert. A missing file is an empty store.
+static bool load_snapshot(const char *path, uint64_t *log_offset) {
+    *log_offset = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        fprintf(stderr, "Failed to open snapshot %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    char *map = size >= sizeof(SnapshotHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Snapshot %s is truncated or unreadable\n", path);
+        return false;
+    }
+    uint64_t start = now_ns();
+
+    // Every entry takes at least its two lengths, which bounds the key count
+    // before the table is sized for it
+    SnapshotHeader header;
+    memcpy(&header, map, sizeof(header));
+    bool ok = memcmp(header.magic, KV_SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 && header.keys <= (size - sizeof(header)) / (2 * sizeof(uint32_t)) &&
+              store_reserve(header.keys);
+    uint64_t loaded = 0;
+    for (size_t offset = sizeof(header); ok && offset < size; loaded++) {
+        uint32_t key_len, value_len;
+        if (size - offset < 2 * sizeof(uint32_t) || loaded == header.keys) {
+            ok = false;
+            break;
+        }
+        memcpy(&key_len, map + offset, sizeof(key_len));
+        memcpy(&value_len, map + offset + sizeof(key_len), sizeof(value_len));
+        offset += 2 * sizeof(uint32_t);
+        ok = key_len <= size - offset && value_len <= size - offset - key_len && store_insert_new(map + offset, key_len, map + offset + key_len, value_len);
+        offset += (size_t)key_len + value_len;
+    }
+    munmap(map, size);
+    if (!ok || loaded != header.keys) {
+        fprintf(stderr, "Failed to load snapshot %s: corrupt, or out of memory\n", path);
+        return false;
+    }
+    *log_offset = header.log_offset;
+    printf("Loaded %llu keys (%zu bytes) from snapshot %s in %.1f ms\n", (unsigned long long)loaded, size, path, (double)(now_ns() - start) / 1e6);
+    return true;
+}
+
+bool kv_open(const char *snapshot_path, const char *log_path, SyncMode sync, unsigned sync_ms, LoopEvents *events) {
+    LogReplay replay = {.reserve = replay_reserve, .apply = replay_apply};
+    store.snapshot_path = snapshot_path;
+    if (snapshot_path != NULL) {
+        if (snprintf(store.snapshot_tmp, sizeof(store.snapshot_tmp), "%s.tmp", snapshot_path) >= (int)sizeof(store.snapshot_tmp)) {
+            fprintf(stderr, "Snapshot path too long\n");
+            return false;
+        }
+        if (!load_snapshot(snapshot_path, &replay.start)) {
+            return false;
+        }
+    }
+    if (log_path != NULL) {
+        store.log_path = log_path;
+        store.log = command_log_open(log_path, sync, sync_ms, &replay);
+        if (store.log == NULL) {
+            return false;
+        }
+        // The timer catches a release the flusher couldn't post, the loop's
+        // task queue being full
+        if (sync == SYNC_ALWAYS) {
+            store.events = events;
+            command_log_on_durable(store.log, post_release, NULL);
+            loop_events_add_timer(events, EVENTS_TICK_MS, release_parked, NULL);
+        }
+    }
+    metric_set(kv_keys, store.count);
+    return true;
+}
+
+void kv_close(void) {
+    if (store.log != NULL) {
+        command_log_close(store.log);
+        store.log = NULL;
+    }
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return true;
+}
+
+// The child's memory no longer shared with the parent: the pages either
+// side wrote since the fork, each copied on its first write
+static uint64_t private_dirty_bytes(void) {
+    char buf[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    const char *field = strstr(buf, "Private_Dirty:");
+    if (field == NULL) {
+        return 0;
+    }
+    uint64_t kb = 0;
+    for (field += strlen("Private_Dirty:"); *field == ' '; field++) {
+    }
+    for (; *field >= '0' && *field <= '9'; field++) {
+        kb = kb * 10 + (uint64_t)(*field - '0');
+    }
+    return kb * 1024;
+}
+
+// Close every descriptor the child inherited but the two it uses, moved to
+// 3 and 4: it would otherwise hold the listen socket, client sockets and the
+// loop's eventfds open for as long as it writes
+static void keep_only_fds(int *report_fd, int *fd) {
+    int report = fcntl(*report_fd, F_DUPFD, 5);
+    int file = *fd >= 0 ? fcntl(*fd, F_DUPFD, 5) : -1;
+    *report_fd = report >= 0 ? dup2(report, 3) : -1;
+    *fd = file >= 0 ? dup2(file, 4) : -1;
+    close_range(5, ~0U, 0);
+}
+
+// Make the log durable through the offset the snapshot records before the
+// snapshot replaces the last one, whatever the sync mode: a crash must not
+// leave a snapshot pointing past the end of the log that survived it
+static bool sync_log(void) {
+    if (store.log_path == NULL) {
+        return true;
+    }
+    int fd = open(store.log_path, O_RDONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && fdatasync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+// The child: write the store as it was at the fork, report and exit. Only
+// the forking thread exists here, so nothing that another thread might have
+// held locked at the fork is touched: no stdio, no heap.
+static void write_snapshot(int report_fd, uint64_t log_offset, uint64_t started) {
+    static char chunk[KV_SNAPSHOT_CHUNK];
+    SnapshotReport report = {0};
+    SnapshotHeader header = {.keys = store.count, .log_offset = log_offset};
+    memcpy(header.magic, KV_SNAPSHOT_MAGIC, sizeof(header.magic));
+    memcpy(chunk, &header, sizeof(header));
+    size_t len = sizeof(header);
+
+    int fd = open(store.snapshot_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int error = errno;
+    keep_only_fds(&report_fd, &fd);
+    errno = error;
+    bool ok = fd >= 0;
+    for (size_t i = 0; ok && i < store.capacity; i++) {
+        const KvEntry *entry = store.slots[i];
+        if (entry == NULL) {
+            continue;
+        }
+        size_t need = 2 * sizeof(uint32_t) + entry->key_len + entry->value_len;
+        if (len + need > sizeof(chunk)) {
+            ok = write_all(fd, chunk, len);
+            report.bytes += len;
+            len = 0;
+        }
+        memcpy(chunk + len, &entry->key_len, sizeof(uint32_t));
+        memcpy(chunk + len + sizeof(uint32_t), &entry->value_len, sizeof(uint32_t));
+        memcpy(chunk + len + 2 * sizeof(uint32_t), entry->data, (size_t)entry->key_len + entry->value_len);
+        len += need;
+        report.keys++;
+    }
+    ok = ok && write_all(fd, chunk, len) && fdatasync(fd) == 0;
+    report.bytes += len;
+    ok = ok && sync_log() && rename(store.snapshot_tmp, store.snapshot_path) == 0;
+    report.error = ok ? 0 : errno != 0 ? errno : EIO;
+    if (fd >= 0) {
+        close(fd);
+    }
+    report.cow_bytes = private_dirty_bytes();
+    report.duration_ns = now_ns() - started;
+    if (write(report_fd, &report, sizeof(report)) != sizeof(report)) {
+        _exit(2);
+    }
+    _exit(ok ? 0 : 1);
+}
+
+bool kv_snapshot_start(KvSnapshot *snapshot) {
+    if (store.snapshot_path == NULL || __atomic_exchange_n(&store.snapshotting, true, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        __atomic_store_n(&store.snapshotting, false, __ATOMIC_RELEASE);
+        return false;
+    }
+    // The state the child sees holds every record the log has written, and
+    // maybe more still in its buffer. Replay from here applies those again,
+    // which is harmless: repeating a run of SETs and DELs in order leaves
+    // every key as it was.
+    uint64_t log_offset = store.log != NULL ? command_log_offset(store.log) : 0;
+    uint64_t started = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        write_snapshot(fds[1], log_offset, started);
+    }
+    snapshot->fork_ns = now_ns() - started;
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        __atomic_store_n(&store.snapshotting, false, __ATOMIC_RELEASE);
+        return false;
+    }
+    snapshot->pid = pid;
+    snapshot->report_fd = fds[0];
+    metric_add(snapshot_fork_ns, snapshot->fork_ns);
+    return true;
+}
+
+bool kv_snapshot_finish(KvSnapshot *snapshot, FILE *out) {
+    SnapshotReport report;
+    ssize_t n;
+    do {
+        n = read(snapshot->report_fd, &report, sizeof(report));
+    } while (n < 0 && errno == EINTR);
+    close(snapshot->report_fd);
+    while (waitpid(snapshot->pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+    __atomic_store_n(&store.snapshotting, false, __ATOMIC_RELEASE);
+
+    if (n != sizeof(report)) {
+        fprintf(out, "snapshot failed: the writer died\n");
+        return false;
+    }
+    if (report.error != 0) {
+        fprintf(out, "snapshot failed: %s\n", strerror(report.error));
+        return false;
+    }
+    metric_add(snapshots, 1);
+    metric_set(snapshot_cow_bytes, report.cow_bytes);
+    fprintf(out, "snapshot %s: %llu keys, %llu bytes in %.1f ms; fork held the loop %.2f ms, %llu KB copied on write\n", store.snapshot_path,
+            (unsigned long long)report.keys, (unsigned long long)report.bytes, (double)report.duration_ns / 1e6, (double)snapshot->fork_ns / 1e6,
+            (unsigned long long)(report.cow_bytes >> 10));
+    return true;
+}
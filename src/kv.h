@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "events.h"
+#include "tcpserver.h"
+
+#define KV_MAX_LINE (64 * 1024 - 16)   // Longest command, so a partial one fits a 64 KB heap block
+#define KV_REPLY_BUFFER (64 * 1024)    // Replies to one read gather here before going out
+#define KV_MIN_CAPACITY 1024           // Table slots the store starts with
+#define KV_SNAPSHOT_CHUNK (256 * 1024) // Snapshot bytes written per call
+#define KV_PARKED_MIN 1024             // Smallest buffer for replies or input held while waiting for a sync
+
+// An in-memory key-value store over a line protocol, persisted to a command
+// log (cmdlog.h). Commands end in \n (\r\n too):
+//
+//   SET key value   ->  OK             value is the rest of the line
+//   GET key         ->  VALUE value  or  NOT_FOUND
+//   DEL key         ->  DELETED  or  NOT_FOUND
+//
+// anything else gets ERROR, and a command over KV_MAX_LINE closes the
+// connection. SET and DEL are logged as they're applied. Under SYNC_ALWAYS
+// the replies to a read are parked with the connection, which isn't read
+// from meanwhile, until the log has synced everything logged so far; the
+// loop goes on serving other connections, and once the flusher reports the
+// sync it sends the parked replies and resumes reading. A client that sees
+// OK can count on the write surviving a crash, and whatever all connections
+// logged while the previous sync ran shares the next one.
+extern const ServerCallbacks kv_callbacks;
+
+// Rebuild the store from the snapshot at snapshot_path, if there is one,
+// then from the command log at log_path past the snapshot's position in it,
+// and log to it from now on. Either path may be NULL: without a log, the
+// store lives in memory and snapshots are all that survives a restart.
+// After heap_init, before running the loop on events; false if either can't
+// be read.
+bool kv_open(const char *snapshot_path, const char *log_path, SyncMode sync, unsigned sync_ms, LoopEvents *events);
+
+// A snapshot being written by a child process. fork() gives the child a
+// copy-on-write view of the store frozen at that instant: it writes the
+// entries out while the loop keeps serving, and each page the loop changes
+// meanwhile is copied once, the cost reported as cow_bytes. The file
+// (header, then key and value per entry) replaces the old one only once
+// complete, and records the command log's offset, so a restart loads the
+// snapshot with mmap and bulk inserts and replays only the log after it.
+typedef struct {
+    pid_t pid;
+    int report_fd;    // Read end of the pipe the child reports on
+    uint64_t fork_ns; // How long fork() held up the loop
+} KvSnapshot;
+
+// Fork the child writing the snapshot; on the loop thread. False if there's
+// no snapshot path, another snapshot is still being written, or fork failed.
+bool kv_snapshot_start(KvSnapshot *snapshot);
+
+// Wait for the child, then report keys, size, duration and copy-on-write
+// overhead to out; from any thread. False if the snapshot failed.
+bool kv_snapshot_finish(KvSnapshot *snapshot, FILE *out);
+
+// Flush the log and close it, once the loop has stopped
+void kv_close(void);
@@ -1,353 +1,342 @@
-#include <arpa/inet.h>
-#include <errno.h>
-#include <fcntl.h>
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <unistd.h>
 
+#include "admin.h"
+#include "config.h"
+#include "echo.h"
 #include "error.h"
-
-#define PORT 8080
-#define BUFFER_SIZE 4096
-#define MAX_PENDING_WRITES 8192
-
-// Write buffer for handling non-blocking writes
-typedef struct {
-    char data[MAX_PENDING_WRITES];
-    size_t size;   // Total data in buffer
-    size_t offset; // How much we've already sent
-} WriteBuffer;
-
-// Client state
-typedef struct {
-    int fd;
-    WriteBuffer write_buf;
-} Client;
-
-// Set a file descriptor to non-blocking mode
-int set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) {
-        perror("fcntl(F_GETFL)");
-        return -1;
+#include "events.h"
+#include "heap.h"
+#include "kv.h"
+#include "metrics.h"
+#include "plugin.h"
+#include "server.h"
+#include "stats.h"
+#include "uring.h"
+#include "watchdog.h"
+
+// The select loop main runs: the generic one, or a protocol's loop with its
+// handlers compiled in when the build names one (see select_loop.h)
+#ifdef SELECT_LOOP
+#define SELECT_LOOP_SPECIALIZED true
+#else
+#define SELECT_LOOP run_server_with_select
+#define SELECT_LOOP_SPECIALIZED false
+#endif
+
+static LoopEvents *loop_events;
+
+// Parse command line options into server_config
+void parse_args(int argc, char **argv) {
+    const char *usage = "[-p port] [-m select|uring] [-U fixed_bufs,fixed_files,sqpoll] [-c max_clients]\n"
+                        "       [-w max_pending_bytes] [-z zerocopy_threshold_bytes] [-u [-g]] [-s shm_socket_path] [-P]\n"
+                        "       [-M [soft_bytes,]hard_bytes] [-a admin_port] [-T stats_interval_s] [-H handler.so] [-W stall_ms] [-S stats_file]\n"
+                        "       [-R conn_bytes_per_s[,burst]] [-B all_bytes_per_s[,burst]] [-Q sched_quantum_bytes]\n"
+                        "       [-F spill_threshold_bytes[,dir]] [-K kv_log_path [-D always|never|sync_ms]] [-O kv_snapshot_path] [-q]";
+    char *const uring_tokens[] = {"fixed_bufs", "fixed_files", "sqpoll", NULL};
+    char *subopts, *value;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:U:c:w:z:ugs:PM:a:T:H:W:S:R:B:Q:F:K:D:O:q")) != -1) {
+        switch (opt) {
+        case 'p':
+            server_config.port = atoi(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "select") == 0) {
+                server_config.mode = LOOP_SELECT;
+            } else if (strcmp(optarg, "uring") == 0) {
+                server_config.mode = LOOP_URING;
+            } else {
+                usage_error(argv[0], usage);
+            }
+            break;
+        case 'U':
+            subopts = optarg;
+            while (*subopts != '\0') {
+                int token = getsubopt(&subopts, uring_tokens, &value);
+                if (token < 0) {
+                    usage_error(argv[0], usage);
+                }
+                server_config.uring_features |= 1u << token;
+            }
+            break;
+        case 'c':
+            server_config.max_clients = atoi(optarg);
+            break;
+        case 'w':
+            server_config.max_pending_writes = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            server_config.zerocopy = true;
+            server_config.zerocopy_threshold = strtoull(optarg, NULL, 10);
+            break;
+        case 'u':
+            server_config.udp = true;
+            break;
+        case 'g':
+            server_config.udp_offload = true;
+            break;
+        case 's':
+            server_config.shm_path = optarg;
+            break;
+        case 'P':
+            server_config.prefault = true;
+            break;
+        case 'M':
+            // Soft limit defaults to a fixed share of the hard one
+            server_config.memory_hard_limit = strtoull(optarg, &value, 10);
+            if (*value == ',') {
+                server_config.memory_soft_limit = server_config.memory_hard_limit;
+                server_config.memory_hard_limit = strtoull(value + 1, NULL, 10);
+            } else {
+                server_config.memory_soft_limit = server_config.memory_hard_limit * MEMORY_SOFT_PERCENT / 100;
+            }
+            break;
+        case 'a':
+            server_config.admin_port = atoi(optarg);
+            break;
+        case 'T':
+            server_config.stats_interval = (unsigned)atoi(optarg);
+            break;
+        case 'H':
+            server_config.handler_path = optarg;
+            break;
+        case 'W':
+            server_config.stall_ms = (unsigned)atoi(optarg);
+            break;
+        case 'S':
+            server_config.stats_path = optarg;
+            break;
+        case 'R':
+            server_config.egress_rate = strtoull(optarg, &value, 10);
+            server_config.egress_burst = *value == ',' ? strtoull(value + 1, NULL, 10) : 0;
+            break;
+        case 'B':
+            server_config.class_rate = strtoull(optarg, &value, 10);
+            server_config.class_burst = *value == ',' ? strtoull(value + 1, NULL, 10) : 0;
+            break;
+        case 'Q':
+            server_config.sched_quantum = strtoull(optarg, NULL, 10);
+            break;
+        case 'F':
+            server_config.spill_threshold = strtoull(optarg, &value, 10);
+            if (*value == ',') {
+                server_config.spill_dir = value + 1;
+            }
+            break;
+        case 'K':
+            server_config.kv_log_path = optarg;
+            break;
+        case 'D':
+            if (strcmp(optarg, "always") == 0) {
+                server_config.log_sync = SYNC_ALWAYS;
+            } else if (strcmp(optarg, "never") == 0) {
+                server_config.log_sync = SYNC_NEVER;
+            } else {
+                server_config.log_sync = SYNC_INTERVAL;
+                server_config.log_sync_ms = (unsigned)atoi(optarg);
+            }
+            break;
+        case 'O':
+            server_config.snapshot_path = optarg;
+            break;
+        case 'q':
+            server_config.quiet = true;
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
     }
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl(F_SETFL)");
-        return -1;
+    // The UDP and shared-memory endpoints, the write buffer budget, egress
+    // limits, spilling, loop timers, handler plugins and the key-value store
+    // belong to the select loop (io_uring reads into a fixed-size buffer pool
+    // and echoes itself)
+    bool kv = server_config.kv_log_path != NULL || server_config.snapshot_path != NULL;
+    if ((server_config.udp || server_config.shm_path != NULL || server_config.memory_hard_limit > 0 || server_config.stats_interval > 0 ||
+         server_config.handler_path != NULL || server_config.egress_rate > 0 || server_config.class_rate > 0 || server_config.spill_threshold > 0 || kv) &&
+        server_config.mode != LOOP_SELECT) {
+        usage_error(argv[0], usage);
     }
-    return 0;
-}
-
-// Initialize write buffer
-void init_write_buffer(WriteBuffer *buf) {
-    buf->size = 0;
-    buf->offset = 0;
-}
-
-// Check if write buffer is empty
-bool write_buffer_empty(WriteBuffer *buf) { return buf->offset >= buf->size; }
-
-// Add data to write buffer
-bool write_buffer_append(WriteBuffer *buf, const char *data, size_t len) {
-    // Check if we have space
-    if (buf->size + len > MAX_PENDING_WRITES) {
-        fprintf(stderr, "Write buffer full, cannot append %zu bytes\n", len);
-        return false;
+    // Plugins and the key-value store swap the generic loop's callbacks; a
+    // specialized loop has its own compiled in
+    if ((server_config.handler_path != NULL || kv) && SELECT_LOOP_SPECIALIZED) {
+        usage_error(argv[0], usage);
     }
-
-    // If buffer was consumed, reset it
-    if (buf->offset >= buf->size) {
-        buf->size = 0;
-        buf->offset = 0;
+    if (server_config.handler_path != NULL && kv) {
+        usage_error(argv[0], usage);
     }
-
-    // Append data
-    memcpy(buf->data + buf->size, data, len);
-    buf->size += len;
-    return true;
-}
-
-// Try to send data from write buffer
-// Returns: 0 on success (all sent), -1 on error, 1 if more data remains
-int write_buffer_flush(WriteBuffer *buf, int fd) {
-    while (buf->offset < buf->size) {
-        ssize_t sent = send(fd, buf->data + buf->offset, buf->size - buf->offset, 0);
-
-        if (sent < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Socket buffer full, try again later
-                return 1; // More data remains
-            }
-            // Real error
-            perror("send");
-            return -1;
-        }
-
-        buf->offset += sent;
+    if (server_config.port <= 0 || server_config.port > 65535 || server_config.max_clients <= 0 || server_config.max_pending_writes == 0 ||
+        server_config.memory_soft_limit > server_config.memory_hard_limit || server_config.sched_quantum > SCHED_MAX_QUANTUM ||
+        server_config.spill_threshold > server_config.max_pending_writes || (server_config.log_sync == SYNC_INTERVAL && server_config.log_sync_ms == 0)) {
+        usage_error(argv[0], usage);
     }
-
-    // All data sent, reset buffer
-    buf->size = 0;
-    buf->offset = 0;
-    return 0;
 }
 
-// Helper function to close and clean up a client connection
-void close_client(Client *clients, int list_index, fd_set *master_read_set, fd_set *master_write_set) {
-    int fd = clients[list_index].fd;
-    if (fd < 0) {
-        return;
-    }
-
-    printf("Closing client fd=%d\n", fd);
-    close(fd);
-    FD_CLR(fd, master_read_set);
-    FD_CLR(fd, master_write_set);
-    clients[list_index].fd = -1;
-    init_write_buffer(&clients[list_index].write_buf);
+// Dump metrics to stdout, on the stats timer or SIGUSR1
+static void print_metrics(void *arg) {
+    (void)arg;
+    write_metrics(stdout);
+    printf("\n");
+    fflush(stdout);
 }
 
-// Create and configure server socket
-int create_server_hello_socket(int port) {
-    int server_fd;
-    struct sockaddr_in server_addr;
+static void trim_on_loop(void *arg) {
+    (void)arg;
+    write_pool_trim();
+}
 
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket");
-        fatal_error("Socket creation failed");
+// Load the -H plugin again and swap it in; on SIGHUP, so on the loop thread
+static void reload_on_loop(void *arg) {
+    (void)arg;
+    const HandlerPlugin *plugin = load_handler(server_config.handler_path, stderr);
+    if (plugin != NULL) {
+        install_handler(plugin);
     }
+}
 
-    // Set non-blocking
-    if (set_nonblocking(server_fd) < 0) {
-        close(server_fd);
-        fatal_error("Failed to set server socket non-blocking");
-    }
+static void install_on_loop(void *plugin) { install_handler(plugin); }
 
-    // Set SO_REUSEADDR to allow quick restart
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-        perror("setsockopt");
-        close(server_fd);
-        fatal_error("Failed to set SO_REUSEADDR");
+// Load on the admin thread, so the loop only stops for the swap itself
+static void admin_reload(FILE *out, const char *args) {
+    (void)args;
+    const HandlerPlugin *plugin = load_handler(server_config.handler_path, out);
+    if (plugin == NULL) {
+        fprintf(out, "kept the current handlers\n");
+        return;
     }
+    // Casting away const: the task only passes it back to install_handler
+    fprintf(out, loop_events_post(loop_events, install_on_loop, (void *)plugin) ? "%s queued\n" : "loop busy, try again\n", plugin->name);
+}
 
-    // Bind
-    server_addr = (struct sockaddr_in){
-        .sin_family = AF_INET,
-        .sin_addr = {.s_addr = htonl(INADDR_ANY)},
-        .sin_port = htons(port),
-    };
-
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        perror("bind");
-        close(server_fd);
-        fatal_error("Bind failed");
-    }
+// Heaps can only be trimmed by their own thread, so hand it to the loop
+static void admin_trim(FILE *out, const char *args) {
+    (void)args;
+    fprintf(out, loop_events_post(loop_events, trim_on_loop, NULL) ? "trim queued\n" : "loop busy, try again\n");
+}
 
-    // Listen
-    if (listen(server_fd, SOMAXCONN) == -1) {
-        perror("listen");
-        close(server_fd);
-        fatal_error("Listen failed");
+// A report written on the loop thread, which owns the data, for the admin
+// thread to pass on
+typedef struct {
+    void (*write)(FILE *out);
+    char *text;
+    size_t len;
+} LoopReport;
+
+static void report_on_loop(void *arg) {
+    LoopReport *report = arg;
+    FILE *out = open_memstream(&report->text, &report->len);
+    if (out != NULL) {
+        report->write(out);
+        fclose(out);
     }
-
-    printf("Server listening on port %d\n", port);
-    return server_fd;
 }
 
-// Handle new incoming connection
-void handle_new_connection(int server_fd, Client *clients, fd_set *master_read_set, int *max_fd) {
-    struct sockaddr_in client_addr;
-    socklen_t addr_size = sizeof(client_addr);
-
-    int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_size);
-    if (client_fd == -1) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("accept");
-        }
+static void admin_loop_report(FILE *out, void (*write)(FILE *out)) {
+    LoopReport report = {.write = write};
+    if (!loop_events_call(loop_events, report_on_loop, &report)) {
+        fprintf(out, "loop busy, try again\n");
         return;
     }
-
-    // Set client socket to non-blocking
-    if (set_nonblocking(client_fd) < 0) {
-        close(client_fd);
-        return;
+    if (report.text != NULL) {
+        fwrite(report.text, 1, report.len, out);
+        free(report.text);
     }
+}
 
-    // Add to master read set
-    FD_SET(client_fd, master_read_set);
-
-    // Update max_fd
-    if (client_fd > *max_fd) {
-        *max_fd = client_fd;
-    }
+// Leaves the snapshot's pid 0 if it didn't start
+static void snapshot_on_loop(void *snapshot) { kv_snapshot_start(snapshot); }
 
-    // Find empty slot in client list
-    bool added = false;
-    for (int i = 0; i < FD_SETSIZE; ++i) {
-        if (clients[i].fd < 0) {
-            clients[i].fd = client_fd;
-            init_write_buffer(&clients[i].write_buf);
-            added = true;
-            break;
-        }
+// Fork on the loop, then wait here for the child, so the loop only stops
+// for the fork itself
+static void admin_snapshot(FILE *out, const char *args) {
+    (void)args;
+    KvSnapshot snapshot = {0};
+    if (!loop_events_call(loop_events, snapshot_on_loop, &snapshot)) {
+        fprintf(out, "loop busy, try again\n");
+        return;
     }
-
-    if (!added) {
-        fprintf(stderr, "Too many clients, rejecting connection\n");
-        close(client_fd);
-        FD_CLR(client_fd, master_read_set);
+    if (snapshot.pid == 0) {
+        fprintf(out, "snapshot not started: one is already being written, or fork failed\n");
         return;
     }
-
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    printf("New client connected: %s:%d (fd=%d)\n", client_ip, ntohs(client_addr.sin_port), client_fd);
+    kv_snapshot_finish(&snapshot, out);
 }
 
-// Handle client data (echo server)
-void handle_client_read(Client *clients, int list_index, fd_set *master_read_set, fd_set *master_write_set) {
-    int fd = clients[list_index].fd;
-    char buffer[BUFFER_SIZE];
+static void admin_conns(FILE *out, const char *args) {
+    (void)args;
+    admin_loop_report(out, write_connections);
+}
 
-    // Read data from client
-    ssize_t bytes_received = recv(fd, buffer, sizeof(buffer), 0);
+static void admin_top(FILE *out, const char *args) {
+    (void)args;
+    admin_loop_report(out, write_heavy_hitters);
+}
 
-    if (bytes_received < 0) {
-        // Error during recv
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // No data available right now (shouldn't happen with select, but safe to check)
-            return;
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    set_server_callbacks(&echo_callbacks);
+    if (server_config.handler_path != NULL) {
+        const HandlerPlugin *plugin = load_handler(server_config.handler_path, stderr);
+        if (plugin == NULL) {
+            fatal_error("Failed to load handlers");
         }
-        // Real error
-        perror("recv");
-        close_client(clients, list_index, master_read_set, master_write_set);
-        return;
+        install_handler(plugin);
     }
-
-    if (bytes_received == 0) {
-        // Client closed connection
-        printf("Client disconnected (fd=%d)\n", fd);
-        close_client(clients, list_index, master_read_set, master_write_set);
-        return;
+    // io_uring reads into its own registered pool, so only select needs heap room for write buffers
+    if (server_config.mode == LOOP_SELECT) {
+        heap_init(server_heap_size(), server_heap_prefault());
+    } else {
+        heap_init(HEAP_OBJECT_RESERVE, server_config.prefault ? SIZE_MAX : 0);
     }
-
-    printf("Received %zd bytes from client (fd=%d)\n", bytes_received, fd);
-
-    // Add data to write buffer
-    if (!write_buffer_append(&clients[list_index].write_buf, buffer, bytes_received)) {
-        fprintf(stderr, "Write buffer overflow for fd=%d, closing connection\n", fd);
-        close_client(clients, list_index, master_read_set, master_write_set);
-        return;
+    int server_fd = create_server_hello_socket(server_config.port);
+
+    // Before any other thread starts, so signals are left to the loop
+    if (server_config.mode == LOOP_SELECT) {
+        loop_events = create_loop_events();
+        loop_events_on_signal(loop_events, SIGUSR1, print_metrics, NULL);
+        if (server_config.handler_path != NULL) {
+            loop_events_on_signal(loop_events, SIGHUP, reload_on_loop, NULL);
+        }
+        if (server_config.stats_interval > 0) {
+            loop_events_add_timer(loop_events, server_config.stats_interval * 1000, print_metrics, NULL);
+        }
     }
-
-    // Add to write set since we have data to send
-    FD_SET(fd, master_write_set);
-}
-
-// Handle client write (flush write buffer)
-void handle_client_write(Client *clients, int list_index, fd_set *master_read_set, fd_set *master_write_set) {
-    int fd = clients[list_index].fd;
-    WriteBuffer *buf = &clients[list_index].write_buf;
-
-    int result = write_buffer_flush(buf, fd);
-
-    if (result == -1) {
-        // Error occurred
-        close_client(clients, list_index, master_read_set, master_write_set);
-        return;
+    // Replays the log; connections wait in the listen backlog meanwhile
+    if (server_config.kv_log_path != NULL || server_config.snapshot_path != NULL) {
+        set_server_callbacks(&kv_callbacks);
+        if (!kv_open(server_config.snapshot_path, server_config.kv_log_path, server_config.log_sync, server_config.log_sync_ms, loop_events)) {
+            fatal_error("Failed to load the key-value store");
+        }
     }
-
-    if (result == 0) {
-        // All data sent, remove from write set
-        FD_CLR(fd, master_write_set);
-        printf("Finished sending data to client (fd=%d)\n", fd);
+    if (server_config.stall_ms > 0) {
+        start_watchdog(server_config.stall_ms);
     }
-    // If result == 1, more data remains, keep in write set
-}
-
-// Main server loop using select()
-int run_server_with_select(int server_fd) {
-    // Why do we need master sets
-    //   After select returns:
-    //      read_set now ONLY contains the fds that are ready!
-
-    fd_set master_read_set, master_write_set; // PERSISTENT - never modified by select()
-    fd_set read_set, write_set;               // WORKING COPIES - modified by select()
-
-    int max_fd = server_fd;
-
-    // Initialize master sets
-    FD_ZERO(&master_read_set);
-    FD_ZERO(&master_write_set);
-
-    FD_SET(server_fd, &master_read_set);
-
-    // Track all client connections
-    Client clients[FD_SETSIZE];
-    for (int i = 0; i < FD_SETSIZE; ++i) {
-        clients[i].fd = -1;
-        init_write_buffer(&clients[i].write_buf);
+    if (server_config.stats_path != NULL) {
+        start_stats_publisher(server_config.stats_path);
     }
-
-    printf("Server ready, waiting for connections...\n");
-
-    // Main event loop
-    while (true) {
-        // Copy master sets (select modifies them)
-        read_set = master_read_set;
-        write_set = master_write_set;
-
-        // Wait for activity on any socket
-        int activity = select(max_fd + 1, &read_set, &write_set, NULL, NULL);
-
-        if (activity < 0) {
-            if (errno == EINTR) {
-                // Interrupted by signal, continue
-                continue;
-            }
-            perror("select");
-            return -1;
-        }
-
-        // Check if server socket has a new connection
-        if (FD_ISSET(server_fd, &read_set)) {
-            handle_new_connection(server_fd, clients, &master_read_set, &max_fd);
-        }
-
-        // Check all client sockets for activity
-        for (int i = 0; i < FD_SETSIZE; i++) {
-            int fd = clients[i].fd;
-
-            // Skip empty slots
-            if (fd < 0) {
-                continue;
-            }
-
-            // Check if this client is ready for reading
-            if (FD_ISSET(fd, &read_set)) {
-                handle_client_read(clients, i, &master_read_set, &master_write_set);
+    if (server_config.admin_port > 0) {
+        if (loop_events != NULL) {
+            admin_register("trim", "Release idle write buffer pages held by the event loop", admin_trim);
+            admin_register("conns", "Per-connection byte, message and buffer counters", admin_conns);
+            admin_register("top", "Busiest peers by bytes and messages per second", admin_top);
+            if (server_config.snapshot_path != NULL) {
+                admin_register("snapshot", "Write the key-value store to the -O file from a forked child", admin_snapshot);
             }
-
-            // Check if this client is ready for writing
-            // Only check if fd is still valid (might have been closed in read handler)
-            if (clients[i].fd >= 0 && FD_ISSET(fd, &write_set)) {
-                handle_client_write(clients, i, &master_read_set, &master_write_set);
+            if (server_config.handler_path != NULL) {
+                admin_register("reload", "Load the -H handler plugin again and swap it in", admin_reload);
             }
         }
+        start_admin_server(server_config.admin_port);
     }
-
-    return 0;
-}
-
-int main(void) {
-    int server_fd = create_server_hello_socket(PORT);
-    int result = run_server_with_select(server_fd);
+    UdpEndpoint *udp = server_config.udp ? create_udp_endpoint(server_config.port, server_config.udp_offload) : NULL;
+    int shm_fd = server_config.shm_path != NULL ? create_shm_listener(server_config.shm_path) : -1;
+    int result =
+        server_config.mode == LOOP_URING ? run_server_with_uring(server_fd) : SELECT_LOOP(&socket_io, server_fd, udp, shm_fd, loop_events);
     close(server_fd);
+    kv_close();
     return result;
 }
@@ -0,0 +1,9 @@
+#include "metrics.h"
+
+ServerMetrics server_metrics;
+
+void write_metrics(FILE *out) {
+#define METRIC_LINE(name, help) fprintf(out, "%s %llu\n", #name, (unsigned long long)metric_get(name));
+    SERVER_METRICS(METRIC_LINE)
+#undef METRIC_LINE
+}
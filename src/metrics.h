@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters and gauges the event loops export. The loop thread updates them
+// with relaxed atomics; the admin thread reads them without locking.
+#define SERVER_METRICS(X)                                                                                                                                                          \
+    X(connections, "Open client connections")                                                                                                                                      \
+    X(buffer_bytes, "Write buffer bytes lent to connections")                                                                                                                      \
+    X(buffer_bytes_peak, "Highest buffer_bytes seen")                                                                                                                              \
+    X(buffers_lent, "Write buffers lent to connections")                                                                                                                           \
+    X(memory_soft_limit, "Buffer bytes above which reads pause and the pool is trimmed, 0 if unlimited")                                                                           \
+    X(memory_hard_limit, "Buffer bytes above which the largest consumers are evicted, 0 if unlimited")                                                                             \
+    X(paused_clients, "Connections whose reads are paused for memory")                                                                                                             \
+    X(read_pauses, "Times a connection's reads were paused for memory")                                                                                                            \
+    X(pool_trims, "Times idle pool buffers were released to the kernel")                                                                                                           \
+    X(pool_trimmed_bytes, "Idle pool bytes released to the kernel")                                                                                                                \
+    X(evictions, "Connections closed to get back under the hard limit")                                                                                                            \
+    X(evicted_bytes, "Queued bytes dropped with evicted connections")                                                                                                              \
+    X(loop_stalls, "Times the watchdog found an event loop stuck in a handler")                                                                                                    \
+    X(throttled_clients, "Connections waiting for egress tokens")                                                                                                                  \
+    X(throttles, "Times a connection ran out of egress tokens")                                                                                                                    \
+    X(throttled_ms, "Milliseconds connections spent throttled, summed over connections")                                                                                           \
+    X(spill_files, "Open spill files holding output for slow readers")                                                                                                             \
+    X(spills, "Spill files created")                                                                                                                                               \
+    X(spilled_bytes, "Output bytes written to spill files")                                                                                                                        \
+    X(spill_write_ns, "Time spent writing spill files")                                                                                                                            \
+    X(spill_send_ns, "Time spent sending from spill files")                                                                                                                        \
+    X(kv_keys, "Keys in the key-value store")                                                                                                                                      \
+    X(log_records, "Commands appended to the command log")                                                                                                                         \
+    X(log_bytes, "Bytes written to the command log")                                                                                                                               \
+    X(log_syncs, "fdatasync calls on the command log, each covering every write before it")                                                                                        \
+    X(log_sync_ns, "Time spent in command log fdatasync")                                                                                                                          \
+    X(snapshots, "Key-value store snapshots written")                                                                                                                              \
+    X(snapshot_fork_ns, "Time the event loop spent in fork() for snapshots")                                                                                                       \
+    X(snapshot_cow_bytes, "Pages copied on write while the last snapshot was written")
+
+typedef struct {
+#define METRIC_FIELD(name, help) uint64_t name;
+    SERVER_METRICS(METRIC_FIELD)
+#undef METRIC_FIELD
+} ServerMetrics;
+
+extern ServerMetrics server_metrics;
+
+#define metric_add(name, n) __atomic_fetch_add(&server_metrics.name, (n), __ATOMIC_RELAXED)
+#define metric_sub(name, n) __atomic_fetch_sub(&server_metrics.name, (n), __ATOMIC_RELAXED)
+#define metric_set(name, v) __atomic_store_n(&server_metrics.name, (v), __ATOMIC_RELAXED)
+#define metric_get(name) __atomic_load_n(&server_metrics.name, __ATOMIC_RELAXED)
+
+// Write every metric as "name value" lines
+void write_metrics(FILE *out);
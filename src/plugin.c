@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "plugin.h"
+
+// Copy the file at path into a memfd. dlopen hands back the object already
+// loaded under a name instead of reading the file again, and the memfd stays
+// open, so every copy gets a name of its own.
+static int copy_to_memfd(const char *path, FILE *err) {
+    int src = open(path, O_RDONLY | O_CLOEXEC);
+    if (src == -1) {
+        fprintf(err, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int copy = memfd_create("handler", MFD_CLOEXEC);
+    if (copy == -1) {
+        fprintf(err, "memfd_create: %s\n", strerror(errno));
+        close(src);
+        return -1;
+    }
+    ssize_t n;
+    while ((n = sendfile(copy, src, NULL, 1 << 20)) > 0) {
+    }
+    if (n == -1) {
+        fprintf(err, "%s: copy failed: %s\n", path, strerror(errno));
+        close(copy);
+        copy = -1;
+    }
+    close(src);
+    return copy;
+}
+
+const HandlerPlugin *load_handler(const char *path, FILE *err) {
+    int copy = copy_to_memfd(path, err);
+    if (copy == -1) {
+        return NULL;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/proc/self/fd/%d", copy);
+    void *lib = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        fprintf(err, "%s: %s\n", path, dlerror());
+        close(copy);
+        return NULL;
+    }
+
+    const HandlerPlugin *plugin = dlsym(lib, HANDLER_SYMBOL);
+    if (plugin == NULL) {
+        fprintf(err, "%s: no %s symbol\n", path, HANDLER_SYMBOL);
+    } else if (plugin->abi_version != HANDLER_ABI_VERSION) {
+        fprintf(err, "%s: built for handler ABI %u, the server has %u\n", path, plugin->abi_version, HANDLER_ABI_VERSION);
+        plugin = NULL;
+    }
+    if (plugin == NULL) {
+        dlclose(lib);
+        close(copy);
+    }
+    return plugin;
+}
+
+void install_handler(const HandlerPlugin *plugin) {
+    set_server_callbacks(&plugin->callbacks);
+    printf("Handlers %s installed\n", plugin->name);
+    fflush(stdout);
+}
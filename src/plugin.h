@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "tcpserver.h"
+
+// Load the HandlerPlugin exported by the shared object at path. Returns NULL
+// after printing why to err when it can't be loaded or was built against
+// another HANDLER_ABI_VERSION. Each call loads a fresh copy, so a plugin
+// rebuilt in place is picked up; earlier copies stay mapped, since
+// connections may still hold data they allocated. Callable from any thread.
+const HandlerPlugin *load_handler(const char *path, FILE *err);
+
+// Make plugin's callbacks the loop's; on the loop thread, between handlers
+void install_handler(const HandlerPlugin *plugin);
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profiler.h"
+
+// backtrace() from the handler starts with the handler and the signal
+// trampoline
+#define HANDLER_FRAMES 2
+
+typedef struct {
+    pid_t tid;
+    int nframes;
+    void *frames[PROFILE_DEPTH];
+} ProfileSample;
+
+static struct {
+    bool running;     // A session is in progress; guards the rest
+    bool active;      // The handler records samples
+    unsigned writers; // Handlers inside the sample buffer
+    size_t next;      // Samples claimed, including dropped ones
+    ProfileSample *samples;
+    bool handler_installed;
+} session;
+
+// SIGPROF handler: claim a slot and record the interrupted thread's stack
+static void record_sample(int signo) {
+    (void)signo;
+    int saved_errno = errno;
+    __atomic_add_fetch(&session.writers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&session.active, __ATOMIC_SEQ_CST)) {
+        size_t i = __atomic_fetch_add(&session.next, 1, __ATOMIC_RELAXED);
+        if (i < PROFILE_MAX_SAMPLES) {
+            ProfileSample *sample = &session.samples[i];
+            sample->nframes = backtrace(sample->frames, PROFILE_DEPTH);
+            sample->tid = (pid_t)syscall(SYS_gettid);
+        }
+    }
+    __atomic_sub_fetch(&session.writers, 1, __ATOMIC_SEQ_CST);
+    errno = saved_errno;
+}
+
+static void set_timer(unsigned hz) {
+    struct itimerval timer = {0};
+    if (hz > 0) {
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+    }
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Sleep until the session's end; the timer's signals cut nanosleep short
+static void sleep_until(const struct timespec *deadline) {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR) {
+    }
+}
+
+// Order samples by thread, then stack, so identical ones end up adjacent
+static int compare_samples(const void *a, const void *b) {
+    const ProfileSample *x = a, *y = b;
+    if (x->tid != y->tid) {
+        return x->tid < y->tid ? -1 : 1;
+    }
+    if (x->nframes != y->nframes) {
+        return x->nframes < y->nframes ? -1 : 1;
+    }
+    return memcmp(x->frames, y->frames, x->nframes * sizeof(void *));
+}
+
+static void write_thread_name(FILE *out, pid_t tid) {
+    char path[64], name[32] = "";
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", (int)tid);
+    FILE *comm = fopen(path, "r");
+    if (comm != NULL) {
+        if (fgets(name, sizeof(name), comm) != NULL) {
+            name[strcspn(name, "\n")] = '\0';
+        }
+        fclose(comm);
+    }
+    fprintf(out, "%s-%d", name[0] != '\0' ? name : "thread", (int)tid);
+}
+
+// Symbol name, or module+offset when the symbol isn't exported. Return
+// addresses point past the call, so look up the byte before them.
+static void write_frame(FILE *out, void *frame, bool return_address) {
+    uintptr_t pc = (uintptr_t)frame - (return_address ? 1 : 0);
+    Dl_info info;
+    if (dladdr((void *)pc, &info) == 0 || info.dli_fname == NULL) {
+        fprintf(out, ";0x%lx", (unsigned long)pc);
+    } else if (info.dli_sname != NULL) {
+        fprintf(out, ";%s", info.dli_sname);
+    } else {
+        const char *module = strrchr(info.dli_fname, '/');
+        fprintf(out, ";%s+0x%lx", module != NULL ? module + 1 : info.dli_fname, (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+    }
+}
+
+static void write_collapsed(FILE *out, ProfileSample *samples, size_t nsamples) {
+    qsort(samples, nsamples, sizeof(ProfileSample), compare_samples);
+    for (size_t i = 0; i < nsamples;) {
+        size_t count = 1;
+        while (i + count < nsamples && compare_samples(&samples[i], &samples[i + count]) == 0) {
+            count++;
+        }
+        ProfileSample *sample = &samples[i];
+        write_thread_name(out, sample->tid);
+        for (int f = sample->nframes - 1; f >= HANDLER_FRAMES; f--) {
+            write_frame(out, sample->frames[f], f > HANDLER_FRAMES);
+        }
+        fprintf(out, " %zu\n", count);
+        i += count;
+    }
+}
+
+bool profile_cpu(unsigned seconds, unsigned hz, FILE *out) {
+    if (__atomic_exchange_n(&session.running, true, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    session.samples = calloc(PROFILE_MAX_SAMPLES, sizeof(ProfileSample));
+    if (session.samples == NULL) {
+        fprintf(out, "profile: out of memory\n");
+        __atomic_store_n(&session.running, false, __ATOMIC_RELEASE);
+        return true;
+    }
+    session.next = 0;
+
+    // The handler stays installed: a SIGPROF still pending after the timer
+    // stops would otherwise kill the process. The first backtrace() loads
+    // the unwinder, which the handler can't safely do.
+    if (!session.handler_installed) {
+        void *frame;
+        backtrace(&frame, 1);
+        struct sigaction action = {.sa_handler = record_sample, .sa_flags = SA_RESTART};
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, NULL);
+        session.handler_installed = true;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += seconds;
+    __atomic_store_n(&session.active, true, __ATOMIC_SEQ_CST);
+    set_timer(hz);
+    sleep_until(&deadline);
+    set_timer(0);
+
+    // Wait out handlers still writing before reading the buffer
+    __atomic_store_n(&session.active, false, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&session.writers, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+
+    size_t taken = session.next;
+    size_t nsamples = taken < PROFILE_MAX_SAMPLES ? taken : PROFILE_MAX_SAMPLES;
+    write_collapsed(out, session.samples, nsamples);
+    printf("Profiled %u s at %u Hz: %zu samples, %zu dropped\n", seconds, hz, nsamples, taken - nsamples);
+    fflush(stdout);
+
+    free(session.samples);
+    session.samples = NULL;
+    __atomic_store_n(&session.running, false, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define PROFILE_DEFAULT_SECONDS 10
+#define PROFILE_MAX_SECONDS 60
+#define PROFILE_DEFAULT_HZ 99
+#define PROFILE_MAX_HZ 1000
+#define PROFILE_DEPTH 32           // Frames kept per sample, leaf first
+#define PROFILE_MAX_SAMPLES 65536 // Per session; later ones are counted as dropped
+
+// In-process CPU sampling profiler. ITIMER_PROF sends SIGPROF hz times per
+// CPU second the process uses, and the kernel delivers it to the thread that
+// is running, so each thread is sampled in proportion to its CPU time and
+// idle threads cost nothing. The handler records the thread and its
+// backtrace. Frames are symbolized afterwards with dladdr: functions the
+// executable exports (-rdynamic) by name, others as module+offset for
+// addr2line.
+
+// Sample for seconds, blocking the caller, then write one collapsed stack
+// per line, "thread;outermost;...;innermost count", as flamegraph.pl and
+// similar tools read it. Returns false without sampling if another session
+// is running.
+bool profile_cpu(unsigned seconds, unsigned hz, FILE *out);
@@ -0,0 +1,257 @@
+// Select loop template, included once per instantiation (no include guard).
+// The includer names the loop and the callbacks it dispatches to:
+//
+//   #define SELECT_LOOP_NAME run_echo_loop
+//   #define SELECT_LOOP_CALLBACKS echo_callbacks
+//   #include "select_loop.h"
+//
+// defines int run_echo_loop(io, server_fd, udp, shm_fd, events), behaving
+// like run_server_with_select. When SELECT_LOOP_CALLBACKS names a const
+// ServerCallbacks defined in the including file, the compiler sees which
+// functions on_data and on_writable are, so the handlers become direct calls
+// it can inline into the loop, and callbacks left NULL compile away. The
+// generic loop in server.c is the same template over the mutable callbacks
+// set_server_callbacks installs. Accept and close are cold and still go
+// through those. Reads and sends test for the TCP transport and call it
+// directly (see transport_recv in server.c) in every loop, specialized or
+// not; other transports go through their function pointers. Inlining needs
+// an optimizing build (-O2).
+
+#ifndef SELECT_LOOP_NAME
+#error "Define SELECT_LOOP_NAME before including select_loop.h"
+#endif
+#ifndef SELECT_LOOP_CALLBACKS
+#error "Define SELECT_LOOP_CALLBACKS before including select_loop.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "heap.h"
+#include "server.h"
+#include "stats.h"
+#include "tcpserver.h"
+#include "watchdog.h"
+
+#define SELECT_LOOP_PASTE(name, suffix) name##_##suffix
+#define SELECT_LOOP_EXPAND(name, suffix) SELECT_LOOP_PASTE(name, suffix)
+#define SELECT_LOOP_FN(suffix) SELECT_LOOP_EXPAND(SELECT_LOOP_NAME, suffix)
+
+// Handle client data: read it and hand it to the on_data callback. Returns
+// the bytes read.
+static inline size_t SELECT_LOOP_FN(read)(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set) {
+    const char *data;
+    size_t len = receive_from_client(table, slot, master_read_set, master_write_set, &data);
+    if (len > 0 && SELECT_LOOP_CALLBACKS.on_data != NULL) {
+        Connection conn = {table, slot, master_read_set, master_write_set};
+        SELECT_LOOP_CALLBACKS.on_data(&conn, data, len);
+    }
+    return len;
+}
+
+// Handle client write: flush the write buffer, then tell on_writable once
+// it's empty
+static inline void SELECT_LOOP_FN(write)(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set) {
+    if (flush_client(table, slot, master_read_set, master_write_set) && SELECT_LOOP_CALLBACKS.on_writable != NULL) {
+        Connection conn = {table, slot, master_read_set, master_write_set};
+        SELECT_LOOP_CALLBACKS.on_writable(&conn);
+    }
+}
+
+// Serve a client select() reported ready: read, then write. Returns false if
+// it wasn't ready, or was closed while it waited its turn.
+static inline bool SELECT_LOOP_FN(serve)(ClientTable *table, int slot, fd_set *read_set, fd_set *write_set, fd_set *master_read_set, fd_set *master_write_set,
+                                         LoopHeartbeat *heartbeat, LoopStats *stats) {
+    Client *client = &table->clients[slot];
+    int fd = client->fd;
+    bool served = false;
+    if (fd < 0) {
+        return false;
+    }
+
+    // Check if this client is ready for reading
+    if (client_readable(client, read_set)) {
+        heartbeat_beat(heartbeat, fd);
+        size_t received = SELECT_LOOP_FN(read)(table, slot, master_read_set, master_write_set);
+        if (received > 0) {
+            loop_stat_add(stats->reads, 1);
+            loop_stat_add(stats->bytes_in, received);
+        }
+        served = true;
+    }
+
+    // Check if this client is ready for writing
+    // Only check if fd is still valid (might have been closed in read handler)
+    if (client->fd >= 0 && client_writable(client, read_set, write_set)) {
+        heartbeat_beat(heartbeat, fd);
+        SELECT_LOOP_FN(write)(table, slot, master_read_set, master_write_set);
+        served = true;
+    }
+    return served;
+}
+
+// Main server loop using select()
+// io supplies the wait and the transport for server_fd; udp and events may
+// be NULL and shm_fd -1 when those are disabled
+int SELECT_LOOP_NAME(const LoopIo *io, int server_fd, UdpEndpoint *udp, int shm_fd, LoopEvents *events) {
+    // Why do we need master sets
+    //   After select returns:
+    //      read_set now ONLY contains the fds that are ready!
+
+    fd_set master_read_set, master_write_set; // PERSISTENT - never modified by select()
+    fd_set read_set, write_set;               // WORKING COPIES - modified by select()
+
+    int max_fd = server_fd;
+
+    // Initialize master sets
+    FD_ZERO(&master_read_set);
+    FD_ZERO(&master_write_set);
+
+    FD_SET(server_fd, &master_read_set);
+
+    if (shm_fd >= 0) {
+        FD_SET(shm_fd, &master_read_set);
+        if (shm_fd > max_fd) {
+            max_fd = shm_fd;
+        }
+    }
+
+    if (udp != NULL) {
+        FD_SET(udp->fd, &master_read_set);
+        if (udp->fd > max_fd) {
+            max_fd = udp->fd;
+        }
+    }
+
+    if (events != NULL) {
+        loop_events_watch(events, &master_read_set, &max_fd);
+    }
+
+    // Track all client connections: the loop scans the dense hot records,
+    // write buffers and counters are only touched by the handlers
+    ClientTable table;
+    client_table_init(&table, FD_SETSIZE);
+    Client *clients = table.clients;
+    write_pool_init();
+    LoopClients loop_clients = {&table, &master_read_set, &master_write_set};
+    if (events != NULL) {
+        loop_events_add_timer(events, HITTERS_DECAY_MS, decay_heavy_hitters, NULL);
+        loop_events_add_timer(events, EVENTS_TICK_MS, refill_egress, &loop_clients);
+    }
+
+    LoopHeartbeat heartbeat = {0};
+    watchdog_watch(&heartbeat);
+    LoopStats stats = {0};
+    stats_watch_loop(&stats, io->name);
+
+    int sched_start = 0;      // Slot the next pass starts serving from
+    int deferred[FD_SETSIZE]; // Ready slots waiting for the priority ones
+
+    printf("Server ready, waiting for connections...\n");
+
+    // Main event loop
+    while (true) {
+        // Copy master sets (select modifies them)
+        read_set = master_read_set;
+        write_set = master_write_set;
+
+        // Wait for activity on any socket
+        heartbeat_beat(&heartbeat, HEARTBEAT_WAITING);
+        int activity = io->wait(max_fd + 1, &read_set, &write_set);
+        heartbeat_beat(&heartbeat, HEARTBEAT_LOOP);
+        uint64_t pass_start = loop_stats_start();
+        client_stats_pass();
+
+        if (activity < 0) {
+            if (errno == EINTR) {
+                // Interrupted by a signal not taken through loop events
+                continue;
+            }
+            if (errno == ECANCELED) {
+                // The I/O layer asked the loop to stop
+                break;
+            }
+            perror("select");
+            client_table_free(&table);
+            stats_unwatch_loop(&stats);
+            watchdog_unwatch(&heartbeat);
+            return -1;
+        }
+
+        // Signals, timer ticks and posted tasks run before client I/O
+        if (events != NULL && !handle_loop_events(events, &read_set)) {
+            break;
+        }
+
+        // Check if server socket has a new connection
+        if (FD_ISSET(server_fd, &read_set)) {
+            handle_new_connection(server_fd, io->transport, &table, &master_read_set, &master_write_set, &max_fd);
+        }
+
+        // Shared-memory clients negotiate over the Unix socket
+        if (shm_fd >= 0 && FD_ISSET(shm_fd, &read_set)) {
+            handle_new_connection(shm_fd, &shm_transport, &table, &master_read_set, &master_write_set, &max_fd);
+        }
+
+        // Service datagrams; keep the UDP socket in the write set only while
+        // replies are waiting for socket buffer space
+        if (udp != NULL && (FD_ISSET(udp->fd, &read_set) || FD_ISSET(udp->fd, &write_set))) {
+            int result = FD_ISSET(udp->fd, &read_set) ? handle_udp_read(udp) : handle_udp_write(udp);
+            if (result == 1) {
+                FD_SET(udp->fd, &master_write_set);
+            } else {
+                FD_CLR(udp->fd, &master_write_set);
+            }
+        }
+
+        // Serve ready clients, starting after the one served first last pass
+        // so no slot always goes first. While there are priority clients,
+        // the rest wait until the scan has served those.
+        int first = -1, ndeferred = 0;
+        bool defer = priority_clients > 0;
+        for (int n = 0; n < FD_SETSIZE; n++) {
+            int i = sched_start + n < FD_SETSIZE ? sched_start + n : sched_start + n - FD_SETSIZE;
+
+            // Skip empty slots
+            if (clients[i].fd < 0) {
+                continue;
+            }
+            if (defer && !(clients[i].flags & CLIENT_PRIORITY)) {
+                if (client_readable(&clients[i], &read_set) || client_writable(&clients[i], &read_set, &write_set)) {
+                    deferred[ndeferred++] = i;
+                }
+                continue;
+            }
+            if (SELECT_LOOP_FN(serve)(&table, i, &read_set, &write_set, &master_read_set, &master_write_set, &heartbeat, &stats) && first < 0) {
+                first = i;
+            }
+        }
+        for (int n = 0; n < ndeferred; n++) {
+            if (SELECT_LOOP_FN(serve)(&table, deferred[n], &read_set, &write_set, &master_read_set, &master_write_set, &heartbeat, &stats) && first < 0) {
+                first = deferred[n];
+            }
+        }
+        if (first >= 0) {
+            sched_start = first + 1 < FD_SETSIZE ? first + 1 : 0;
+        }
+
+        heartbeat_beat(&heartbeat, HEARTBEAT_LOOP);
+        enforce_memory_budget(&table, &master_read_set, &master_write_set);
+        loop_stats_pass(&stats, pass_start);
+    }
+    stats_unwatch_loop(&stats);
+    watchdog_unwatch(&heartbeat);
+
+    for (int i = 0; i < FD_SETSIZE; i++) {
+        close_client(&table, i, &master_read_set, &master_write_set);
+    }
+    client_table_free(&table);
+    return 0;
+}
+
+#undef SELECT_LOOP_FN
+#undef SELECT_LOOP_EXPAND
+#undef SELECT_LOOP_PASTE
+#undef SELECT_LOOP_CALLBACKS
+#undef SELECT_LOOP_NAME
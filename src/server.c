@@ -0,0 +1,1432 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "connection.h"
+#include "error.h"
+#include "heap.h"
+#include "hitters.h"
+#include "metrics.h"
+#include "server.h"
+#include "tcpserver.h"
+#include "udp.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+ServerConfig server_config = {
+    .port = PORT,
+    .mode = LOOP_SELECT,
+    .max_clients = FD_SETSIZE,
+    .max_pending_writes = MAX_PENDING_WRITES,
+    .zerocopy = false,
+    .zerocopy_threshold = 64 * 1024,
+    .uring_features = 0,
+    .udp = false,
+    .udp_offload = false,
+    .shm_path = NULL,
+    .quiet = false,
+    .prefault = false,
+    .memory_soft_limit = 0,
+    .memory_hard_limit = 0,
+    .admin_port = 0,
+    .stats_interval = 0,
+    .handler_path = NULL,
+    .stall_ms = 0,
+    .stats_path = NULL,
+    .egress_rate = 0,
+    .egress_burst = 0,
+    .class_rate = 0,
+    .class_burst = 0,
+    .sched_quantum = SCHED_QUANTUM,
+    .spill_threshold = 0,
+    .spill_dir = "/tmp",
+    .kv_log_path = NULL,
+    .snapshot_path = NULL,
+    .log_sync = SYNC_INTERVAL,
+    .log_sync_ms = LOG_SYNC_MS,
+};
+
+static int select_wait(int nfds, fd_set *read_set, fd_set *write_set) { return select(nfds, read_set, write_set, NULL, NULL); }
+
+static ServerCallbacks server_callbacks;
+
+void set_server_callbacks(const ServerCallbacks *callbacks) { server_callbacks = *callbacks; }
+
+const LoopIo socket_io = {
+    .name = "sockets",
+    .wait = select_wait,
+    .transport = &tcp_transport,
+};
+
+// Set a file descriptor to non-blocking mode
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        perror("fcntl(F_GETFL)");
+        return -1;
+    }
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl(F_SETFL)");
+        return -1;
+    }
+    return 0;
+}
+
+// Plain socket transport
+static bool tcp_accept(int listen_fd, Client *client, char *peer, size_t peer_len) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_size = sizeof(client_addr);
+
+    int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &addr_size, SOCK_NONBLOCK);
+    if (client_fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
+        return false;
+    }
+
+    // Enable zerocopy transmit if configured; fall back to copying if the
+    // kernel or socket type doesn't support it
+    if (server_config.zerocopy) {
+        int one = 1;
+        if (setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+            perror("setsockopt(SO_ZEROCOPY)");
+        } else {
+            client->flags |= CLIENT_ZEROCOPY;
+        }
+    }
+
+    client->fd = client_fd;
+    client->transport = &tcp_transport;
+
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    snprintf(peer, peer_len, "%s:%d", client_ip, ntohs(client_addr.sin_port));
+    return true;
+}
+
+static ssize_t tcp_recv(Client *client, void *buf, size_t len) { return recv(client->fd, buf, len, 0); }
+
+static ssize_t tcp_send(Client *client, const void *buf, size_t len, int flags) { return send(client->fd, buf, len, flags); }
+
+static void tcp_close(Client *client) { close(client->fd); }
+
+const Transport tcp_transport = {
+    .name = "tcp",
+    .accept = tcp_accept,
+    .recv = tcp_recv,
+    .send = tcp_send,
+    .close = tcp_close,
+    .write_ready_via_read = false,
+};
+
+// Move bytes through a client's transport. Nearly every client is plain TCP,
+// so that case is tested for and called directly, where the compiler can
+// inline it, and only the others go through the function pointer.
+static inline ssize_t transport_recv(Client *client, void *buf, size_t len) {
+    return client->transport == &tcp_transport ? tcp_recv(client, buf, len) : client->transport->recv(client, buf, len);
+}
+
+static inline ssize_t transport_send(Client *client, const void *buf, size_t len, int flags) {
+    return client->transport == &tcp_transport ? tcp_send(client, buf, len, flags) : client->transport->send(client, buf, len, flags);
+}
+
+// Initialize write buffer
+void init_write_buffer(WriteBuffer *buf) {
+    buf->data = NULL;
+    buf->capacity = 0;
+    buf->zc_sent = 0;
+    buf->zc_completed = 0;
+    buf->spill_fd = -1;
+    buf->spill_offset = 0;
+    buf->spill_size = 0;
+}
+
+// Check if a client's write buffer is empty; spilled output isn't in it
+bool write_buffer_empty(const Client *client) { return client->out_offset >= client->out_size; }
+
+// Output queued and not sent yet, in memory and spilled
+static uint64_t write_buffer_queued(const Client *client, const WriteBuffer *buf) {
+    uint64_t queued = client->out_size - client->out_offset;
+    if (client->flags & CLIENT_SPILLED) {
+        queued += buf->spill_size - buf->spill_offset;
+    }
+    return queued;
+}
+
+// Most output a connection may have queued: with spilling, what the spill
+// file may hold
+static uint64_t write_buffer_limit(void) { return server_config.spill_threshold > 0 ? SPILL_MAX_BYTES : server_config.max_pending_writes; }
+
+// Check if the kernel still references buffer memory through zerocopy sends.
+// Clients without SO_ZEROCOPY never touch their WriteBuffer here.
+bool write_buffer_zerocopy_pending(const Client *client, const WriteBuffer *buf) {
+    return (client->flags & CLIENT_ZEROCOPY) && buf->zc_completed != buf->zc_sent;
+}
+
+// Write buffers come from the heap in power-of-two size classes, from
+// SIZE_CLASS_MIN_SHIFT up to the class holding max_pending_writes. The pool
+// only accounts for what is lent out, which the memory budget is checked
+// against.
+static struct {
+    int max_shift;
+    size_t lent_bytes;
+} write_pool;
+
+// Smallest size class (as a shift) holding size bytes
+int size_class_shift(size_t size) {
+    int shift = SIZE_CLASS_MIN_SHIFT;
+    while (shift < SIZE_CLASS_MAX_SHIFT && ((size_t)1 << shift) < size) {
+        shift++;
+    }
+    return shift;
+}
+
+// Heap the loop itself uses: room for every select client to hold a largest
+// write buffer twice over, so buffers left free in smaller classes don't
+// starve larger ones, plus connection records and protocol objects
+static size_t loop_heap_size(void) { return ((size_t)2 * FD_SETSIZE << size_class_shift(server_config.max_pending_writes)) + HEAP_OBJECT_RESERVE; }
+
+// The loop's share, and the key-value store's if there is one
+size_t server_heap_size(void) {
+    size_t store = server_config.kv_log_path != NULL || server_config.snapshot_path != NULL ? KV_HEAP_RESERVE : 0;
+    return loop_heap_size() + store;
+}
+
+size_t server_heap_prefault(void) { return server_config.prefault ? loop_heap_size() : 0; }
+
+void write_pool_init(void) {
+    write_pool.max_shift = size_class_shift(server_config.max_pending_writes);
+    write_pool.lent_bytes = 0;
+    metric_set(memory_soft_limit, server_config.memory_soft_limit);
+    metric_set(memory_hard_limit, server_config.memory_hard_limit);
+}
+
+// Release the pages of idle buffers not released yet. Only the loop thread's
+// heap is trimmed, so call it there.
+void write_pool_trim(void) {
+    size_t trimmed = heap_trim();
+    if (trimmed > 0) {
+        metric_add(pool_trims, 1);
+        metric_add(pool_trimmed_bytes, trimmed);
+    }
+}
+
+// Take a buffer of the given class, or a larger one if the heap is short
+static char *write_pool_take(int *shift) {
+    char *data = heap_alloc((size_t)1 << *shift);
+    if (data != NULL) {
+        *shift = size_class_shift(heap_usable_size(data));
+    }
+    return data;
+}
+
+static void write_pool_put(char *data, size_t capacity) {
+    heap_free(data);
+    write_pool.lent_bytes -= capacity;
+    metric_set(buffer_bytes, write_pool.lent_bytes);
+    metric_sub(buffers_lent, 1);
+}
+
+// Make sure a client's write buffer can hold size bytes, borrowing one from
+// the pool or moving queued output into a larger class
+bool write_buffer_reserve(Client *client, WriteBuffer *buf, size_t size) {
+    if (buf->data != NULL && size <= buf->capacity) {
+        return true;
+    }
+    // The kernel may still read the current buffer, and zerocopy only pays
+    // off for large sends anyway: such clients get the largest class
+    int shift = (client->flags & CLIENT_ZEROCOPY) ? write_pool.max_shift : size_class_shift(size);
+    char *data = write_pool_take(&shift);
+    if (data == NULL) {
+        fprintf(stderr, "Write buffer pool exhausted\n");
+        return false;
+    }
+    size_t capacity = (size_t)1 << shift;
+
+    if (buf->data != NULL) {
+        memcpy(data, buf->data + client->out_offset, client->out_size - client->out_offset);
+        client->out_size -= client->out_offset;
+        client->out_offset = 0;
+        write_pool_put(buf->data, buf->capacity);
+    } else {
+        client->out_size = 0;
+        client->out_offset = 0;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+
+    write_pool.lent_bytes += capacity;
+    metric_set(buffer_bytes, write_pool.lent_bytes);
+    metric_add(buffers_lent, 1);
+    if (write_pool.lent_bytes > metric_get(buffer_bytes_peak)) {
+        metric_set(buffer_bytes_peak, write_pool.lent_bytes);
+    }
+    return true;
+}
+
+// Hand a drained write buffer's storage back to the pool. Storage the kernel
+// may still read through zerocopy sends is kept.
+void write_buffer_return(Client *client, WriteBuffer *buf) {
+    if (!write_buffer_empty(client) || write_buffer_zerocopy_pending(client, buf)) {
+        return;
+    }
+    client->out_size = 0;
+    client->out_offset = 0;
+    if (buf->data == NULL) {
+        return;
+    }
+    write_pool_put(buf->data, buf->capacity);
+    buf->data = NULL;
+    buf->capacity = 0;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ull + now.tv_nsec - start->tv_nsec;
+}
+
+// Create the unlinked file a connection's output spills to
+static bool spill_open(WriteBuffer *buf) {
+    int fd = open(server_config.spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+        // No O_TMPFILE on this filesystem: unlink a named file right away
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/tcp_server_spill.XXXXXX", server_config.spill_dir);
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd >= 0) {
+            unlink(path);
+        }
+    }
+    if (fd < 0) {
+        perror("open(spill file)");
+        return false;
+    }
+    buf->spill_fd = fd;
+    buf->spill_offset = 0;
+    buf->spill_size = 0;
+    metric_add(spill_files, 1);
+    metric_add(spills, 1);
+    return true;
+}
+
+static void spill_close(Client *client, WriteBuffer *buf) {
+    if (buf->spill_fd >= 0) {
+        close(buf->spill_fd);
+        metric_sub(spill_files, 1);
+    }
+    buf->spill_fd = -1;
+    buf->spill_offset = 0;
+    buf->spill_size = 0;
+    client->flags &= ~CLIENT_SPILLED;
+}
+
+// Whether len more bytes of output go to the spill file: once some did,
+// everything does until it's drained, to keep the output in order
+static bool write_buffer_spills(const Client *client, size_t len) {
+    return (client->flags & CLIENT_SPILLED) || (server_config.spill_threshold > 0 && client->out_size - client->out_offset + len > server_config.spill_threshold);
+}
+
+// Append output to the connection's spill file, creating it first
+static bool spill_append(Client *client, WriteBuffer *buf, const char *data, size_t len) {
+    if (buf->spill_fd < 0 && !spill_open(buf)) {
+        return false;
+    }
+    client->flags |= CLIENT_SPILLED;
+    if (buf->spill_size - buf->spill_offset + len > SPILL_MAX_BYTES) {
+        fprintf(stderr, "Spill file full, cannot append %zu bytes\n", len);
+        return false;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (len > 0) {
+        ssize_t written = pwrite(buf->spill_fd, data, len, (off_t)buf->spill_size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite(spill file)");
+            return false;
+        }
+        data += written;
+        len -= written;
+        buf->spill_size += written;
+        metric_add(spilled_bytes, written);
+    }
+    metric_add(spill_write_ns, elapsed_ns(&start));
+    return true;
+}
+
+// Send spilled output, no more than *budget of it as in write_buffer_flush.
+// TCP sockets take it with sendfile, straight from the page cache; other
+// transports get it read back into the table's chunk a piece at a time. The
+// file is closed once it's drained.
+// Returns: 0 once it's all sent, -1 on error, 1 if more remains
+static int spill_flush(ClientTable *table, int slot, size_t *budget) {
+    Client *client = &table->clients[slot];
+    WriteBuffer *buf = &table->buffers[slot];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = 0;
+    while (buf->spill_offset < buf->spill_size) {
+        size_t len = buf->spill_size - buf->spill_offset < SPILL_CHUNK ? (size_t)(buf->spill_size - buf->spill_offset) : SPILL_CHUNK;
+        if (len > *budget) {
+            len = *budget;
+        }
+        if (len == 0) {
+            result = 1; // Out of budget
+            break;
+        }
+        ssize_t sent;
+        const char *call = "sendfile(spill file)";
+        if (client->transport == &tcp_transport) {
+            off_t offset = (off_t)buf->spill_offset;
+            sent = sendfile(client->fd, buf->spill_fd, &offset, len);
+        } else {
+            if (table->spill_chunk == NULL && (table->spill_chunk = heap_alloc(SPILL_CHUNK)) == NULL) {
+                fprintf(stderr, "Out of memory reading back spilled output\n");
+                result = -1;
+                break;
+            }
+            ssize_t got = pread(buf->spill_fd, table->spill_chunk, len, (off_t)buf->spill_offset);
+            if (got <= 0) {
+                sent = -1;
+                call = "pread(spill file)";
+                if (got == 0) {
+                    errno = EIO; // The file is shorter than what was written to it
+                }
+            } else {
+                sent = client->transport->send(client, table->spill_chunk, got, 0);
+                call = "send";
+            }
+        }
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                result = 1;
+                break;
+            }
+            perror(call);
+            result = -1;
+            break;
+        }
+        buf->spill_offset += sent;
+        *budget -= sent;
+    }
+    metric_add(spill_send_ns, elapsed_ns(&start));
+    if (result == 0) {
+        spill_close(client, buf);
+    }
+    return result;
+}
+
+// Release write buffer storage, dropping anything still queued
+void free_write_buffer(Client *client, WriteBuffer *buf) {
+    client->out_offset = client->out_size;
+    buf->zc_completed = buf->zc_sent;
+    write_buffer_return(client, buf);
+    spill_close(client, buf);
+    init_write_buffer(buf);
+}
+
+// Make room for len more bytes of output; returns where they go, or NULL
+static char *write_buffer_claim(Client *client, WriteBuffer *buf, size_t len) {
+    // If buffer was consumed, reset it (unless the kernel is still reading it)
+    if (write_buffer_empty(client) && !write_buffer_zerocopy_pending(client, buf)) {
+        client->out_size = 0;
+        client->out_offset = 0;
+    }
+
+    // Check if we have space
+    size_t queued = client->out_size - client->out_offset;
+    if (queued + len > server_config.max_pending_writes) {
+        fprintf(stderr, "Write buffer full, cannot append %zu bytes\n", len);
+        return NULL;
+    }
+
+    // Make room by dropping sent bytes before moving to a larger class;
+    // neither is possible while the kernel may still read the buffer
+    if (buf->data != NULL && client->out_size + len > buf->capacity) {
+        if (write_buffer_zerocopy_pending(client, buf)) {
+            fprintf(stderr, "Write buffer full, cannot append %zu bytes\n", len);
+            return NULL;
+        }
+        memmove(buf->data, buf->data + client->out_offset, queued);
+        client->out_size = queued;
+        client->out_offset = 0;
+    }
+    if (!write_buffer_reserve(client, buf, client->out_size + len)) {
+        return NULL;
+    }
+    return buf->data + client->out_size;
+}
+
+// Add data to write buffer
+bool write_buffer_append(Client *client, WriteBuffer *buf, const char *data, size_t len) {
+    if (write_buffer_spills(client, len)) {
+        return spill_append(client, buf, data, len);
+    }
+    char *dest = write_buffer_claim(client, buf, len);
+    if (dest == NULL) {
+        return false;
+    }
+    memcpy(dest, data, len);
+    client->out_size += len;
+    return true;
+}
+
+// Drain MSG_ZEROCOPY completion notifications from the socket error queue
+// Returns: 0 when no zerocopy sends remain in flight, 1 if some do, -1 on error
+int write_buffer_reap_zerocopy(Client *client, WriteBuffer *buf) {
+    while (write_buffer_zerocopy_pending(client, buf)) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        if (recvmsg(client->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1; // Kernel still holds some of our pages
+            }
+            perror("recvmsg(MSG_ERRQUEUE)");
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            bool is_recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!is_recverr) {
+                continue;
+            }
+
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+
+            // Notifications cover the inclusive id range [ee_info, ee_data]
+            buf->zc_completed += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+
+    // Kernel is done with our pages; a fully sent buffer goes back to the pool
+    write_buffer_return(client, buf);
+    return 0;
+}
+
+// Try to send data from write buffer, no more than *budget bytes of it;
+// *budget is reduced by what went out
+// Returns: 0 on success (all sent), -1 on error, 1 if more data remains
+int write_buffer_flush(ClientTable *table, int slot, size_t *budget) {
+    Client *client = &table->clients[slot];
+    WriteBuffer *buf = &table->buffers[slot];
+    while (client->out_offset < client->out_size && *budget > 0) {
+        size_t len = client->out_size - client->out_offset;
+        if (len > *budget) {
+            len = *budget;
+        }
+        int flags = 0;
+        if ((client->flags & CLIENT_ZEROCOPY) && len >= server_config.zerocopy_threshold) {
+            flags |= MSG_ZEROCOPY;
+        }
+
+        ssize_t sent = transport_send(client, buf->data + client->out_offset, len, flags);
+
+        if (sent < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            // Out of optmem for completion notifications, copy this one instead
+            sent = transport_send(client, buf->data + client->out_offset, len, 0);
+            flags = 0;
+        }
+
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Socket buffer full, try again later
+                return 1; // More data remains
+            }
+            // Real error
+            perror("send");
+            return -1;
+        }
+
+        if (flags & MSG_ZEROCOPY) {
+            buf->zc_sent++;
+        }
+        client->out_offset += sent;
+        *budget -= sent;
+    }
+    if (client->out_offset < client->out_size) {
+        return 1; // Out of budget
+    }
+
+    // All data sent, return the buffer once the kernel has released it
+    write_buffer_return(client, buf);
+    return (client->flags & CLIENT_SPILLED) ? spill_flush(table, slot, budget) : 0;
+}
+
+// Send data straight from the caller's memory when nothing is queued ahead of
+// it, and queue only what the socket (or *budget, as in write_buffer_flush)
+// doesn't take. These sends always copy: the caller reuses its memory as
+// soon as this returns.
+// Returns: 0 if everything was sent, 1 if some is queued, -1 on error
+int write_buffer_send(Client *client, WriteBuffer *buf, const char *data, size_t len, size_t *budget) {
+    while (write_buffer_empty(client) && !(client->flags & CLIENT_SPILLED) && len > 0 && *budget > 0) {
+        ssize_t sent = transport_send(client, data, len < *budget ? len : *budget, 0);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("send");
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+        *budget -= sent;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    return write_buffer_append(client, buf, data, len) ? 1 : -1;
+}
+
+// Start or stop waiting for room to send more to a client
+void client_watch_writable(Client *client, fd_set *master_write_set, bool enable) {
+    if (enable) {
+        client->flags |= CLIENT_WANT_WRITE;
+    } else {
+        client->flags &= ~CLIENT_WANT_WRITE;
+    }
+    if (client->transport->write_ready_via_read) {
+        return; // The transport wakes client->fd for reading instead
+    }
+    if (enable) {
+        FD_SET(client->fd, master_write_set);
+    } else {
+        FD_CLR(client->fd, master_write_set);
+    }
+}
+
+// Reset a client slot to unused
+void init_client(Client *client) {
+    client->fd = -1;
+    client->aux_fd = -1;
+    client->transport = &tcp_transport;
+    client->out_size = 0;
+    client->out_offset = 0;
+    client->flags = 0;
+    client->recv_shift = RECV_INITIAL_SHIFT;
+    client->small_reads = 0;
+    client->weight = 1;
+    client->deficit = 0;
+}
+
+int priority_clients;
+
+// Find an unused client slot; -1 if none. Write buffers are only borrowed
+// once output backs up.
+int claim_client_slot(ClientTable *table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        if (table->clients[i].fd < 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void egress_init(void);
+
+// The running select loop's table, for the admin reports
+static ClientTable *live_table;
+
+void client_table_init(ClientTable *table, int capacity) {
+    *table = (ClientTable){
+        .clients = heap_alloc(capacity * sizeof(Client)),
+        .buffers = heap_alloc(capacity * sizeof(WriteBuffer)),
+        .user_data = heap_alloc(capacity * sizeof(void *)),
+        .stats = heap_alloc(capacity * sizeof(ClientStats)),
+        .pacing = heap_alloc(capacity * sizeof(ClientPacing)),
+        .capacity = capacity,
+    };
+    if (table->clients == NULL || table->buffers == NULL || table->user_data == NULL || table->stats == NULL || table->pacing == NULL) {
+        fatal_error("Failed to allocate client table");
+    }
+    for (int i = 0; i < capacity; ++i) {
+        init_client(&table->clients[i]);
+        init_write_buffer(&table->buffers[i]);
+    }
+    egress_init();
+    live_table = table;
+}
+
+void client_table_free(ClientTable *table) {
+    if (live_table == table) {
+        live_table = NULL;
+    }
+    heap_free(table->clients);
+    heap_free(table->buffers);
+    heap_free(table->user_data);
+    heap_free(table->stats);
+    heap_free(table->pacing);
+    heap_free(table->spill_staging);
+    heap_free(table->spill_chunk);
+}
+
+// Helper function to close and clean up a client connection
+void close_client(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set) {
+    Client *client = &table->clients[slot];
+    int fd = client->fd;
+    if (fd < 0) {
+        return;
+    }
+
+    // The application sees the connection one last time; it can't send or
+    // close it again from there
+    bool already_closing = client->flags & CLIENT_CLOSING;
+    client->flags |= CLIENT_CLOSING;
+    if (!already_closing && server_callbacks.on_close != NULL) {
+        Connection conn = {table, slot, master_read_set, master_write_set};
+        server_callbacks.on_close(&conn);
+    }
+
+    // The kernel may still be transmitting straight from our buffer; keep the
+    // socket open (watching only its error queue) until it lets go. Reads may
+    // have been paused, so watch it again: completions only arrive that way.
+    WriteBuffer *buf = &table->buffers[slot];
+    if (write_buffer_reap_zerocopy(client, buf) == 1) {
+        if (!already_closing) {
+            log_event("Deferring close of fd=%d until zerocopy sends complete\n", fd);
+            client_watch_writable(client, master_write_set, false);
+            FD_SET(fd, master_read_set);
+        }
+        return;
+    }
+
+    log_event("Closing %s client fd=%d\n", client->transport->name, fd);
+    FD_CLR(fd, master_read_set);
+    FD_CLR(fd, master_write_set);
+    if (client->aux_fd >= 0) {
+        FD_CLR(client->aux_fd, master_read_set);
+    }
+    client->transport->close(client);
+    free_write_buffer(client, buf);
+    if (client->flags & CLIENT_READ_PAUSED) {
+        metric_sub(paused_clients, 1);
+    }
+    if (client->flags & CLIENT_THROTTLED) {
+        metric_sub(throttled_clients, 1);
+    }
+    if (client->flags & CLIENT_PRIORITY) {
+        priority_clients--;
+    }
+    init_client(client);
+    metric_sub(connections, 1);
+}
+
+// Stop or resume reading from a client while memory is tight
+static void client_pause_reads(Client *client, const ClientPacing *pacing, fd_set *master_read_set, bool pause) {
+    if (pause) {
+        client->flags |= CLIENT_READ_PAUSED;
+        FD_CLR(client->fd, master_read_set);
+        metric_add(paused_clients, 1);
+        metric_add(read_pauses, 1);
+    } else {
+        client->flags &= ~CLIENT_READ_PAUSED;
+        if (!(client->flags & CLIENT_OUTPUT_FULL) && !pacing->input_held) {
+            FD_SET(client->fd, master_read_set);
+        }
+        metric_sub(paused_clients, 1);
+    }
+}
+
+// Keep write buffer memory within the configured limits. Above the soft
+// limit, clients holding a buffer stop reading (their peer isn't keeping up,
+// and each read could queue more) and idle pool buffers are released to the
+// kernel. Above the hard limit, the clients with the most queued output are
+// closed. Paused clients resume once their buffer drains or memory is back
+// under the soft limit.
+void enforce_memory_budget(ClientTable *table, fd_set *master_read_set, fd_set *master_write_set) {
+    if (server_config.memory_hard_limit == 0) {
+        return;
+    }
+    bool over_soft = write_pool.lent_bytes >= server_config.memory_soft_limit;
+    if (!over_soft && metric_get(paused_clients) == 0) {
+        return;
+    }
+
+    for (int i = 0; i < table->capacity; i++) {
+        Client *client = &table->clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        bool holds_buffer = table->buffers[i].data != NULL;
+        bool paused = client->flags & CLIENT_READ_PAUSED;
+        // Transports that signal writability through reads can't be paused,
+        // nor can closing clients, which only reads tell their completions
+        if (!paused && over_soft && holds_buffer && !client->transport->write_ready_via_read && !(client->flags & CLIENT_CLOSING)) {
+            client_pause_reads(client, &table->pacing[i], master_read_set, true);
+        } else if (paused && (!over_soft || !holds_buffer)) {
+            client_pause_reads(client, &table->pacing[i], master_read_set, false);
+        }
+    }
+    if (!over_soft) {
+        return;
+    }
+    write_pool_trim();
+
+    while (write_pool.lent_bytes > server_config.memory_hard_limit) {
+        int largest = -1;
+        uint32_t largest_queued = 0;
+        for (int i = 0; i < table->capacity; i++) {
+            Client *client = &table->clients[i];
+            uint32_t queued = client->out_size - client->out_offset;
+            if (client->fd >= 0 && table->buffers[i].data != NULL && !(client->flags & CLIENT_CLOSING) && (largest < 0 || queued > largest_queued)) {
+                largest = i;
+                largest_queued = queued;
+            }
+        }
+        if (largest < 0) {
+            break; // Only zerocopy closes in flight; their buffers come back soon
+        }
+        fprintf(stderr, "Memory hard limit reached, evicting fd=%d with %u bytes queued\n", table->clients[largest].fd, largest_queued);
+        metric_add(evictions, 1);
+        metric_add(evicted_bytes, largest_queued);
+        close_client(table, largest, master_read_set, master_write_set);
+    }
+}
+
+// Egress limits: each connection has a token bucket, and draws from its
+// class's shared bucket too. Sends take tokens from both, and a connection
+// that finds either empty stops waiting for writability until the refill
+// timer tops the buckets up. Buckets start full.
+typedef struct {
+    uint64_t rate; // Bytes per second, 0 for unlimited
+    uint64_t burst;
+    uint64_t tokens;
+} EgressBucket;
+
+static EgressBucket egress_classes[EGRESS_MAX_CLASSES];
+static bool egress_paced; // Some limit is set; otherwise sends skip the buckets
+
+// A bucket must hold at least one refill, or the rate couldn't be reached
+static uint64_t egress_burst(uint64_t rate, uint64_t burst) {
+    uint64_t refill = rate * EVENTS_TICK_MS / 1000;
+    if (burst == 0) {
+        burst = rate * EGRESS_DEFAULT_BURST_MS / 1000;
+    }
+    return burst > refill ? burst : refill;
+}
+
+void set_egress_class(int egress_class, uint64_t rate, uint64_t burst) {
+    if (egress_class < 0 || egress_class >= EGRESS_MAX_CLASSES) {
+        return;
+    }
+    burst = egress_burst(rate, burst);
+    egress_classes[egress_class] = (EgressBucket){.rate = rate, .burst = burst, .tokens = burst};
+    egress_paced |= rate > 0;
+}
+
+// Limits from server_config; the per-connection burst is normalized in place
+static void egress_init(void) {
+    server_config.egress_burst = egress_burst(server_config.egress_rate, server_config.egress_burst);
+    if (server_config.class_rate > 0) {
+        set_egress_class(0, server_config.class_rate, server_config.class_burst);
+    }
+    egress_paced |= server_config.egress_rate > 0;
+}
+
+// Bytes the connection may send before the next refill
+static size_t egress_allowance(const ClientTable *table, int slot) {
+    if (!egress_paced) {
+        return SIZE_MAX;
+    }
+    const ClientPacing *pacing = &table->pacing[slot];
+    uint64_t allowance = server_config.egress_rate > 0 ? pacing->tokens : UINT64_MAX;
+    const EgressBucket *bucket = &egress_classes[pacing->egress_class];
+    if (bucket->rate > 0 && bucket->tokens < allowance) {
+        allowance = bucket->tokens;
+    }
+    return allowance < SIZE_MAX ? (size_t)allowance : SIZE_MAX;
+}
+
+static void egress_charge(ClientTable *table, int slot, size_t sent) {
+    if (!egress_paced) {
+        return;
+    }
+    ClientPacing *pacing = &table->pacing[slot];
+    EgressBucket *bucket = &egress_classes[pacing->egress_class];
+    pacing->tokens -= sent < pacing->tokens ? sent : pacing->tokens;
+    bucket->tokens -= sent < bucket->tokens ? sent : bucket->tokens;
+}
+
+// Deficit round-robin counts queued output flushed as well as input read:
+// a connection whose backlog goes out takes that from its deficit, running
+// into debt if need be, and isn't read from again until its grants have
+// paid for it. Replies sent straight from on_data aren't charged; a read
+// already bounds them, up to a socket buffer's worth.
+static void sched_charge(Client *client, size_t sent) {
+    if (server_config.sched_quantum == 0) {
+        return;
+    }
+    int64_t deficit = (int64_t)client->deficit - (int64_t)(sent < INT32_MAX ? sent : INT32_MAX);
+    client->deficit = (int32_t)(deficit > INT32_MIN ? deficit : INT32_MIN);
+}
+
+// Out of tokens: stop waiting for writability until the refill
+static void egress_throttle(Client *client, fd_set *master_write_set) {
+    if (!(client->flags & CLIENT_THROTTLED)) {
+        client->flags |= CLIENT_THROTTLED;
+        metric_add(throttled_clients, 1);
+        metric_add(throttles, 1);
+    }
+    client_watch_writable(client, master_write_set, false);
+}
+
+void refill_egress(void *loop_clients) {
+    if (!egress_paced) {
+        return;
+    }
+    LoopClients *loop = loop_clients;
+    ClientTable *table = loop->table;
+    for (int i = 0; i < EGRESS_MAX_CLASSES; i++) {
+        EgressBucket *bucket = &egress_classes[i];
+        bucket->tokens += bucket->rate * EVENTS_TICK_MS / 1000;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+    }
+    uint64_t refill = server_config.egress_rate * EVENTS_TICK_MS / 1000;
+    for (int i = 0; i < table->capacity; i++) {
+        Client *client = &table->clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        ClientPacing *pacing = &table->pacing[i];
+        pacing->tokens += refill;
+        if (pacing->tokens > server_config.egress_burst) {
+            pacing->tokens = server_config.egress_burst;
+        }
+        if (!(client->flags & CLIENT_THROTTLED)) {
+            continue;
+        }
+        table->stats[i].throttled_ms += EVENTS_TICK_MS;
+        metric_add(throttled_ms, EVENTS_TICK_MS);
+        if (egress_allowance(table, i) > 0 && !(client->flags & CLIENT_CLOSING)) {
+            client->flags &= ~CLIENT_THROTTLED;
+            metric_sub(throttled_clients, 1);
+            client_watch_writable(client, loop->master_write_set, true);
+        }
+    }
+}
+
+// Output was left queued: wait for writability (or the egress refill, when
+// the connection ran out of tokens), and under memory pressure don't let the
+// connection queue more before the budget is next enforced
+static void conn_output_queued(Connection *conn, bool out_of_tokens) {
+    Client *client = &conn->table->clients[conn->slot];
+    ClientStats *stats = &conn->table->stats[conn->slot];
+    if (client->out_size - client->out_offset > stats->buffer_peak) {
+        stats->buffer_peak = client->out_size - client->out_offset;
+    }
+    if (out_of_tokens || (client->flags & CLIENT_THROTTLED)) {
+        egress_throttle(client, conn->master_write_set);
+    } else {
+        client_watch_writable(client, conn->master_write_set, true);
+    }
+    if (server_config.memory_hard_limit > 0 && write_pool.lent_bytes >= server_config.memory_soft_limit && !(client->flags & CLIENT_READ_PAUSED) &&
+        !client->transport->write_ready_via_read) {
+        client_pause_reads(client, &conn->table->pacing[conn->slot], conn->master_read_set, true);
+    }
+}
+
+// Connections the application can still write to
+static bool conn_open(const Connection *conn) {
+    const Client *client = &conn->table->clients[conn->slot];
+    return client->fd >= 0 && !(client->flags & CLIENT_CLOSING);
+}
+
+bool conn_send(Connection *conn, const void *data, size_t len) {
+    if (!conn_open(conn)) {
+        return false;
+    }
+    Client *client = &conn->table->clients[conn->slot];
+    conn->table->stats[conn->slot].bytes_out += len;
+    size_t allowance = egress_allowance(conn->table, conn->slot), budget = allowance;
+    int result = write_buffer_send(client, &conn->table->buffers[conn->slot], data, len, &budget);
+    if (result == -1) {
+        fprintf(stderr, "Failed to send or buffer %zu bytes for fd=%d, closing connection\n", len, client->fd);
+        conn_close(conn);
+        return false;
+    }
+    egress_charge(conn->table, conn->slot, allowance - budget);
+    if (result == 1) {
+        conn_output_queued(conn, budget == 0);
+    }
+    return true;
+}
+
+// Where replies headed for the spill file are built before conn_commit
+// writes them out, as large as a write buffer may get
+static char *spill_staging(ClientTable *table, size_t len) {
+    if (len > server_config.max_pending_writes) {
+        return NULL;
+    }
+    if (table->spill_staging == NULL) {
+        table->spill_staging = heap_alloc(server_config.max_pending_writes);
+    }
+    return table->spill_staging;
+}
+
+char *conn_reserve(Connection *conn, size_t len) {
+    if (!conn_open(conn)) {
+        return NULL;
+    }
+    Client *client = &conn->table->clients[conn->slot];
+    WriteBuffer *buf = &conn->table->buffers[conn->slot];
+    if (write_buffer_spills(client, len)) {
+        // Only mark the connection spilled once the reply has somewhere to go
+        char *staging = spill_staging(conn->table, len);
+        if (staging == NULL || (buf->spill_fd < 0 && !spill_open(buf))) {
+            return NULL;
+        }
+        client->flags |= CLIENT_SPILLED;
+        return staging;
+    }
+    return write_buffer_claim(client, buf, len);
+}
+
+bool conn_commit(Connection *conn, size_t len) {
+    if (!conn_open(conn)) {
+        return false;
+    }
+    Client *client = &conn->table->clients[conn->slot];
+    if (!(client->flags & CLIENT_SPILLED)) {
+        client->out_size += len;
+    } else if (!spill_append(client, &conn->table->buffers[conn->slot], spill_staging(conn->table, len), len)) {
+        conn_close(conn);
+        return false;
+    }
+    conn->table->stats[conn->slot].bytes_out += len;
+    size_t allowance = egress_allowance(conn->table, conn->slot), budget = allowance;
+    int result = write_buffer_flush(conn->table, conn->slot, &budget);
+    if (result == -1) {
+        conn_close(conn);
+        return false;
+    }
+    egress_charge(conn->table, conn->slot, allowance - budget);
+    if (result == 1) {
+        conn_output_queued(conn, budget == 0);
+    }
+    return true;
+}
+
+size_t conn_queued(const Connection *conn) {
+    return write_buffer_queued(&conn->table->clients[conn->slot], &conn->table->buffers[conn->slot]);
+}
+
+void conn_close(Connection *conn) { close_client(conn->table, conn->slot, conn->master_read_set, conn->master_write_set); }
+
+int conn_fd(const Connection *conn) { return conn->table->clients[conn->slot].fd; }
+
+void conn_set_egress_class(Connection *conn, int egress_class) {
+    if (egress_class >= 0 && egress_class < EGRESS_MAX_CLASSES) {
+        conn->table->pacing[conn->slot].egress_class = (uint8_t)egress_class;
+    }
+}
+
+void conn_set_schedule(Connection *conn, bool priority, unsigned weight) {
+    Client *client = &conn->table->clients[conn->slot];
+    if (priority != !!(client->flags & CLIENT_PRIORITY)) {
+        client->flags ^= CLIENT_PRIORITY;
+        priority_clients += priority ? 1 : -1;
+    }
+    client->weight = weight < 1 ? 1 : weight > UINT8_MAX ? UINT8_MAX : (uint8_t)weight;
+}
+
+void conn_hold_input(Connection *conn, bool hold) {
+    Client *client = &conn->table->clients[conn->slot];
+    if (!conn_open(conn) || client->transport->write_ready_via_read) {
+        return;
+    }
+    conn->table->pacing[conn->slot].input_held = hold;
+    if (hold) {
+        FD_CLR(client->fd, conn->master_read_set);
+    } else if (!(client->flags & (CLIENT_READ_PAUSED | CLIENT_OUTPUT_FULL))) {
+        FD_SET(client->fd, conn->master_read_set);
+    }
+}
+
+void conn_set_data(Connection *conn, void *data) { conn->table->user_data[conn->slot] = data; }
+
+void *conn_data(const Connection *conn) { return conn->table->user_data[conn->slot]; }
+
+// Create and configure server socket
+int create_server_hello_socket(int port) {
+    int server_fd;
+    struct sockaddr_in server_addr;
+
+    // Create socket
+    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        fatal_error("Socket creation failed");
+    }
+
+    // Set non-blocking
+    if (set_nonblocking(server_fd) < 0) {
+        close(server_fd);
+        fatal_error("Failed to set server socket non-blocking");
+    }
+
+    // Set SO_REUSEADDR to allow quick restart
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt");
+        close(server_fd);
+        fatal_error("Failed to set SO_REUSEADDR");
+    }
+
+    // Bind
+    server_addr = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_addr = {.s_addr = htonl(INADDR_ANY)},
+        .sin_port = htons(port),
+    };
+
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("bind");
+        close(server_fd);
+        fatal_error("Bind failed");
+    }
+
+    // Listen
+    if (listen(server_fd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(server_fd);
+        fatal_error("Listen failed");
+    }
+
+    printf("Server listening on port %d\n", port);
+    return server_fd;
+}
+
+// Milliseconds on the coarse monotonic clock
+static uint64_t coarse_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Fresh counters for a connection from peer ("host:port"); heavy hitters
+// are tracked per host, so a client's connections add up
+static void init_client_stats(ClientStats *stats, const char *peer) {
+    *stats = (ClientStats){0};
+    snprintf(stats->peer, sizeof(stats->peer), "%s", peer);
+    const char *port = strrchr(stats->peer, ':');
+    stats->host_len = port != NULL ? (uint32_t)(port - stats->peer) : (uint32_t)strlen(stats->peer);
+    stats->peer_key = hitters_key(stats->peer, stats->host_len);
+    stats->connected_ms = stats->active_ms = coarse_ms();
+}
+
+// Handle new incoming connection on listen_fd, accepted through transport
+void handle_new_connection(int listen_fd, const Transport *transport, ClientTable *table, fd_set *master_read_set, fd_set *master_write_set, int *max_fd) {
+    Client accepted;
+    char peer[64];
+    init_client(&accepted);
+    if (!transport->accept(listen_fd, &accepted, peer, sizeof(peer))) {
+        return;
+    }
+
+    // select() can't watch descriptors beyond FD_SETSIZE
+    if (accepted.fd >= FD_SETSIZE || accepted.aux_fd >= FD_SETSIZE) {
+        fprintf(stderr, "fd=%d exceeds FD_SETSIZE, rejecting connection\n", accepted.fd);
+        accepted.transport->close(&accepted);
+        return;
+    }
+
+    // Find empty slot in client list
+    int slot = claim_client_slot(table);
+    if (slot < 0) {
+        fprintf(stderr, "Too many clients, rejecting connection\n");
+        accepted.transport->close(&accepted);
+        return;
+    }
+
+    table->clients[slot] = accepted;
+    init_write_buffer(&table->buffers[slot]);
+    table->user_data[slot] = NULL;
+    init_client_stats(&table->stats[slot], peer);
+    table->pacing[slot] = (ClientPacing){.tokens = server_config.egress_burst};
+    // The kernel spreads each burst out too (TCP pacing, or the fq qdisc)
+    if (server_config.egress_rate > 0 && accepted.transport == &tcp_transport) {
+        unsigned rate = server_config.egress_rate < UINT32_MAX ? (unsigned)server_config.egress_rate : UINT32_MAX - 1;
+        if (setsockopt(accepted.fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == -1) {
+            perror("setsockopt(SO_MAX_PACING_RATE)");
+        }
+    }
+
+    // Add to master read set
+    FD_SET(accepted.fd, master_read_set);
+    if (accepted.aux_fd >= 0) {
+        FD_SET(accepted.aux_fd, master_read_set);
+    }
+
+    // Update max_fd
+    if (accepted.fd > *max_fd) {
+        *max_fd = accepted.fd;
+    }
+    if (accepted.aux_fd > *max_fd) {
+        *max_fd = accepted.aux_fd;
+    }
+
+    metric_add(connections, 1);
+    log_event("New %s client connected: %s (fd=%d)\n", accepted.transport->name, peer, accepted.fd);
+    if (server_callbacks.on_accept != NULL) {
+        Connection conn = {table, slot, master_read_set, master_write_set};
+        server_callbacks.on_accept(&conn, peer);
+    }
+}
+
+// Grow the receive size after reads that filled it, shrink it after a run
+// of reads that used little of it
+static void adapt_receive_size(Client *client, size_t len, size_t received) {
+    size_t size = (size_t)1 << client->recv_shift;
+    if (received == len && len == size) {
+        if (client->recv_shift < RECV_MAX_SHIFT) {
+            client->recv_shift++;
+        }
+        client->small_reads = 0;
+    } else if (received == len) {
+        // Capped below the receive size and filled: says nothing about it
+        client->small_reads = 0;
+    } else if (received <= size / 4) {
+        if (++client->small_reads >= RECV_SHRINK_AFTER && client->recv_shift > RECV_MIN_SHIFT) {
+            client->recv_shift--;
+            client->small_reads = 0;
+        }
+    } else {
+        client->small_reads = 0;
+    }
+}
+
+// Busiest peers of the select loop, by bytes and by messages received
+static HeavyHitters by_bytes, by_messages;
+
+// The coarse clock as of the loop's current pass, so reads don't each take
+// the time
+static uint64_t pass_ms;
+
+void client_stats_pass(void) { pass_ms = coarse_ms(); }
+
+// Count a read against the connection and its peer's host
+static void count_receive(ClientStats *stats, size_t len) {
+    stats->bytes_in += len;
+    stats->messages++;
+    stats->active_ms = pass_ms;
+    hitters_add(&by_bytes, stats->peer_key, stats->peer, stats->host_len, len);
+    hitters_add(&by_messages, stats->peer_key, stats->peer, stats->host_len, 1);
+}
+
+void decay_heavy_hitters(void *arg) {
+    (void)arg;
+    hitters_decay(&by_bytes);
+    hitters_decay(&by_messages);
+}
+
+void write_heavy_hitters(FILE *out) {
+    // A peer steadily adding r per decay period settles at r << HITTERS_DECAY_SHIFT
+    double per_second = 1000.0 / ((double)HITTERS_DECAY_MS * (1u << HITTERS_DECAY_SHIFT));
+    fprintf(out, "top peers by bytes/s received\n");
+    write_hitters(out, &by_bytes, per_second);
+    fprintf(out, "top peers by messages/s\n");
+    write_hitters(out, &by_messages, per_second);
+}
+
+void write_connections(FILE *out) {
+    ClientTable *table = live_table;
+    if (table == NULL) {
+        fprintf(out, "no select loop running\n");
+        return;
+    }
+    uint64_t now = coarse_ms();
+    fprintf(out, "%-5s %-22s %12s %12s %10s %10s %8s %8s %10s %12s\n", "fd", "peer", "bytes_in", "bytes_out", "messages", "buf_peak", "queued", "age_s", "idle_ms",
+            "throttled_ms");
+    for (int i = 0; i < table->capacity; i++) {
+        const Client *client = &table->clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        const ClientStats *stats = &table->stats[i];
+        fprintf(out, "%-5d %-22s %12llu %12llu %10llu %10u %8zu %8llu %10llu %12llu\n", client->fd, stats->peer, (unsigned long long)stats->bytes_in,
+                (unsigned long long)stats->bytes_out, (unsigned long long)stats->messages, stats->buffer_peak, (size_t)write_buffer_queued(client, &table->buffers[i]),
+                (unsigned long long)(now - stats->connected_ms) / 1000, (unsigned long long)(now - stats->active_ms), (unsigned long long)stats->throttled_ms);
+    }
+}
+
+// Scratch for reads; each connection only touches as much of it as its
+// receive size, so small-message clients stay within a few cache lines
+static char recv_scratch[1 << RECV_MAX_SHIFT];
+
+// Read a readable client's data into the scratch buffer; see server.h
+size_t receive_from_client(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set, const char **data) {
+    Client *client = &table->clients[slot];
+    WriteBuffer *buf = &table->buffers[slot];
+    int fd = client->fd;
+
+    // Readability also signals zerocopy completions on the error queue
+    if (write_buffer_reap_zerocopy(client, buf) == -1) {
+        close_client(table, slot, master_read_set, master_write_set);
+        return 0;
+    }
+
+    // A closing client is only kept around to collect completions
+    if (client->flags & CLIENT_CLOSING) {
+        close_client(table, slot, master_read_set, master_write_set);
+        return 0;
+    }
+
+    // Read up to the client's receive size, but no more than its write
+    // buffer (or spill file) could take should a reply not go out right away
+    size_t len = (size_t)1 << client->recv_shift;
+    uint64_t queued = write_buffer_queued(client, buf);
+    size_t room = queued < write_buffer_limit() ? write_buffer_limit() - queued : 0;
+    if (len > room) {
+        len = room;
+    }
+    // Under a memory budget, read no more than could still be buffered
+    if (server_config.memory_hard_limit > 0) {
+        size_t budget_room = write_pool.lent_bytes < server_config.memory_hard_limit ? server_config.memory_hard_limit - write_pool.lent_bytes : 0;
+        if (budget_room < (1u << RECV_MIN_SHIFT)) {
+            budget_room = 1u << RECV_MIN_SHIFT;
+        }
+        if (len > budget_room) {
+            len = budget_room;
+        }
+    }
+    // Deficit round-robin: each pass it's read from, a connection earns its
+    // weight in quanta, carrying at most one pass's worth over, and reads no
+    // more than it has. A bulk sender then gets through its backlog over
+    // several passes instead of holding up everyone behind it in this one.
+    // Flushing queued output is charged too (see flush_client), so a
+    // connection still in debt for it skips its read this pass.
+    if (server_config.sched_quantum > 0) {
+        int64_t grant = (int64_t)client->weight * (int64_t)server_config.sched_quantum;
+        int64_t deficit = client->deficit + grant;
+        client->deficit = (int32_t)(deficit < 2 * grant ? deficit : 2 * grant);
+        if (client->deficit <= 0) {
+            return 0;
+        }
+        if (len > (size_t)client->deficit) {
+            len = (size_t)client->deficit;
+        }
+    }
+    if (len == 0) {
+        // Stop reading until the peer takes some output. Transports that
+        // report writability through reads have to stay in the read set.
+        if (!client->transport->write_ready_via_read) {
+            client->flags |= CLIENT_OUTPUT_FULL;
+            FD_CLR(fd, master_read_set);
+        }
+        return 0;
+    }
+
+    // Read data from client
+    ssize_t bytes_received = transport_recv(client, recv_scratch, len);
+
+    if (bytes_received <= 0) {
+        client->deficit = 0;
+    }
+    if (bytes_received < 0) {
+        // Error during recv
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // No data available right now (shouldn't happen with select, but safe to check)
+            return 0;
+        }
+        // Real error
+        perror("recv");
+        close_client(table, slot, master_read_set, master_write_set);
+        return 0;
+    }
+
+    if (bytes_received == 0) {
+        // Client closed connection
+        log_event("Client disconnected (fd=%d)\n", fd);
+        close_client(table, slot, master_read_set, master_write_set);
+        return 0;
+    }
+
+    log_event("Received %zd bytes from client (fd=%d)\n", bytes_received, fd);
+    adapt_receive_size(client, len, bytes_received);
+    // A short read drained the socket; like an empty DRR queue, it keeps no credit
+    client->deficit = (size_t)bytes_received < len ? 0 : client->deficit - (int32_t)bytes_received;
+    count_receive(&table->stats[slot], bytes_received);
+    *data = recv_scratch;
+    return bytes_received;
+}
+
+// Flush a writable client's write buffer; see server.h
+bool flush_client(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set) {
+    Client *client = &table->clients[slot];
+    int fd = client->fd;
+
+    if (client->flags & CLIENT_CLOSING) {
+        return false;
+    }
+
+    size_t allowance = egress_allowance(table, slot), budget = allowance;
+    int result = write_buffer_flush(table, slot, &budget);
+
+    if (result == -1) {
+        // Error occurred
+        close_client(table, slot, master_read_set, master_write_set);
+        return false;
+    }
+    egress_charge(table, slot, allowance - budget);
+    sched_charge(client, allowance - budget);
+
+    // Output drained a bit, so reads can be taken again
+    if ((client->flags & CLIENT_OUTPUT_FULL) && write_buffer_queued(client, &table->buffers[slot]) < write_buffer_limit()) {
+        client->flags &= ~CLIENT_OUTPUT_FULL;
+        if (!(client->flags & CLIENT_READ_PAUSED) && !table->pacing[slot].input_held) {
+            FD_SET(fd, master_read_set);
+        }
+    }
+
+    if (result == 0) {
+        // All data sent, remove from write set
+        client_watch_writable(client, master_write_set, false);
+        log_event("Finished sending data to client (fd=%d)\n", fd);
+        return true;
+    }
+    // If result == 1, more data remains: keep in write set, unless it's
+    // waiting for egress tokens rather than socket buffer space
+    if (budget == 0) {
+        egress_throttle(client, master_write_set);
+    }
+    return false;
+}
+
+// The generic loop: callbacks are whatever set_server_callbacks installed
+#define SELECT_LOOP_NAME run_server_with_select
+#define SELECT_LOOP_CALLBACKS server_callbacks
+#include "select_loop.h"
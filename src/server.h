@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdio.h>
+#include <sys/select.h>
+
+#include "connection.h"
+#include "events.h"
+#include "shm.h"
+#include "udp.h"
+
+// Address space the heap needs for the select loop (see heap.h)
+size_t server_heap_size(void);
+
+// How much of it to prefault: none without -P, and never the key-value
+// store's reserve, which is room to grow into rather than memory in use
+size_t server_heap_prefault(void);
+
+// Create and configure server socket
+int create_server_hello_socket(int port);
+
+// Handle new incoming connection on listen_fd, accepted through transport
+void handle_new_connection(int listen_fd, const Transport *transport, ClientTable *table, fd_set *master_read_set, fd_set *master_write_set, int *max_fd);
+
+// Read what a readable client sent, up to its receive size. Returns the
+// byte count with *data pointing at them (valid until the next read), or 0
+// when there's nothing to hand over: nothing arrived, reads are paused, or
+// the client was closed.
+size_t receive_from_client(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set, const char **data);
+
+// Flush a writable client's write buffer. Returns true once it's empty.
+bool flush_client(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set);
+
+// Close a client and reset its slot; an unused slot is left alone
+void close_client(ClientTable *table, int slot, fd_set *master_read_set, fd_set *master_write_set);
+
+// A loop's connections, as loop timers that act on them get them
+typedef struct {
+    ClientTable *table;
+    fd_set *master_read_set;
+    fd_set *master_write_set;
+} LoopClients;
+
+// Connections marked priority with conn_set_schedule; while there are any,
+// loops serve them first in each pass
+extern int priority_clients;
+
+// Allocate a table of capacity unused slots, and make it the one
+// write_connections reports on
+void client_table_init(ClientTable *table, int capacity);
+
+// Free the table's arrays; close its clients first
+void client_table_free(ClientTable *table);
+
+// Note the time for the connection counters; once per loop pass
+void client_stats_pass(void);
+
+// One line of counters per open connection of the running select loop
+void write_connections(FILE *out);
+
+// The busiest peer hosts by bytes and by messages per second
+void write_heavy_hitters(FILE *out);
+
+// Age the heavy-hitter counts; a loop timer every HITTERS_DECAY_MS
+void decay_heavy_hitters(void *arg);
+
+// Top up the egress token buckets and let throttled connections that have
+// tokens again send; a loop timer every EVENTS_TICK_MS, given LoopClients
+void refill_egress(void *loop_clients);
+
+// Reset a client slot to unused
+void init_client(Client *client);
+
+void init_write_buffer(WriteBuffer *buf);
+
+// Size the write pool for server_config; before the loop starts
+void write_pool_init(void);
+
+// Pause, trim and evict to keep write buffers within the memory budget
+void enforce_memory_budget(ClientTable *table, fd_set *master_read_set, fd_set *master_write_set);
+
+// Release idle write buffer pages to the kernel; call on the loop thread
+void write_pool_trim(void);
+
+// Main server loop using select(), dispatching to the callbacks installed
+// with set_server_callbacks; select_loop.h builds loops with a protocol's
+// callbacks compiled in. io supplies the wait and the transport for server_fd; udp and events may
+// be NULL and shm_fd -1 when those are disabled
+int run_server_with_select(const LoopIo *io, int server_fd, UdpEndpoint *udp, int shm_fd, LoopEvents *events);
@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "shm.h"
+
+// Segment of each accepted client, by its eventfd (client->fd)
+static ShmSegment *segments[FD_SETSIZE];
+
+static size_t ring_used(ShmRing *ring) { return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE); }
+
+// Copy up to len bytes into the ring; returns how many fit
+static size_t ring_write(ShmRing *ring, const void *buf, size_t len) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    size_t free_bytes = SHM_RING_SIZE - (tail - head);
+    size_t n = len < free_bytes ? len : free_bytes;
+
+    size_t start = tail & (SHM_RING_SIZE - 1);
+    size_t first = n < SHM_RING_SIZE - start ? n : SHM_RING_SIZE - start;
+    memcpy(ring->data + start, buf, first);
+    memcpy(ring->data, (const char *)buf + first, n - first);
+
+    __atomic_store_n(&ring->tail, tail + (uint32_t)n, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Copy up to len bytes out of the ring; returns how many were available
+static size_t ring_read(ShmRing *ring, void *buf, size_t len) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = ring->head;
+    size_t used = tail - head;
+    size_t n = len < used ? len : used;
+
+    size_t start = head & (SHM_RING_SIZE - 1);
+    size_t first = n < SHM_RING_SIZE - start ? n : SHM_RING_SIZE - start;
+    memcpy(buf, ring->data + start, first);
+    memcpy((char *)buf + first, ring->data, n - first);
+
+    __atomic_store_n(&ring->head, head + (uint32_t)n, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Claim a peer's wakeup request; true if the peer is (about to be) asleep
+static bool take_waiter(uint32_t *flag) {
+    // Pairs with the sleeper's flag store and ring re-check
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(flag, __ATOMIC_RELAXED) && __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST);
+}
+
+static void futex_wait(uint32_t *addr, uint32_t expected) { syscall(SYS_futex, addr, FUTEX_WAIT, expected, NULL, NULL, 0); }
+
+static void futex_wake(uint32_t *addr) { syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0); }
+
+static void wake_fd(int fd) {
+    if (eventfd_write(fd, 1) == -1 && errno != EAGAIN) {
+        perror("eventfd_write");
+    }
+}
+
+// Client went away without saying so: its end of the Unix socket is closed
+static bool peer_hung_up(int sock_fd) {
+    char byte;
+    return recv(sock_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+static ssize_t shm_recv(Client *client, void *buf, size_t len) {
+    ShmSegment *seg = segments[client->fd];
+    eventfd_t count;
+    eventfd_read(client->fd, &count); // Reset the wakeup, EAGAIN is fine
+
+    size_t n = ring_read(&seg->to_server, buf, len);
+    if (n > 0 && take_waiter(&seg->to_server.producer_waiting)) {
+        futex_wake(&seg->to_server.producer_waiting);
+    }
+
+    if (ring_used(&seg->to_server) > 0) {
+        // More than fit in buf: come back on the next loop iteration
+        wake_fd(client->fd);
+    } else {
+        // Drained, so from now on the client has to wake us
+        __atomic_store_n(&seg->to_server.consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (ring_used(&seg->to_server) > 0 && __atomic_exchange_n(&seg->to_server.consumer_waiting, 0, __ATOMIC_SEQ_CST)) {
+            wake_fd(client->fd);
+        }
+    }
+
+    if (n > 0) {
+        return n;
+    }
+    if (__atomic_load_n(&seg->client_closed, __ATOMIC_ACQUIRE) || peer_hung_up(client->aux_fd)) {
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t shm_send(Client *client, const void *buf, size_t len, int flags) {
+    (void)flags;
+    ShmSegment *seg = segments[client->fd];
+    if (__atomic_load_n(&seg->client_closed, __ATOMIC_ACQUIRE)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    size_t n = ring_write(&seg->to_client, buf, len);
+    if (n == 0) {
+        // Ring full: have the client wake us once it has made room
+        __atomic_store_n(&seg->to_client.producer_waiting, 1, __ATOMIC_SEQ_CST);
+        n = ring_write(&seg->to_client, buf, len);
+        if (n == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        __atomic_store_n(&seg->to_client.producer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    if (take_waiter(&seg->to_client.consumer_waiting)) {
+        futex_wake(&seg->to_client.consumer_waiting);
+    }
+    return n;
+}
+
+static void shm_close(Client *client) {
+    ShmSegment *seg = segments[client->fd];
+    __atomic_store_n(&seg->server_closed, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&seg->to_client.consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&seg->to_server.producer_waiting, 0, __ATOMIC_SEQ_CST);
+    futex_wake(&seg->to_client.consumer_waiting);
+    futex_wake(&seg->to_server.producer_waiting);
+
+    munmap(seg, sizeof(ShmSegment));
+    segments[client->fd] = NULL;
+    close(client->fd);
+    close(client->aux_fd);
+}
+
+int create_shm_listener(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        fatal_error("Shared-memory socket path too long");
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        fatal_error("Unix socket creation failed");
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        fatal_error("Unix socket bind failed");
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(fd);
+        fatal_error("Unix socket listen failed");
+    }
+
+    printf("Shared-memory transport listening on %s\n", path);
+    return fd;
+}
+
+// Accept a client and set up its channel; client->fd becomes the eventfd the
+// client wakes us through and client->aux_fd the Unix socket (readable when
+// the client goes away)
+static bool shm_accept(int listen_fd, Client *client, char *peer, size_t peer_len) {
+    int sock_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock_fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
+        return false;
+    }
+
+    int mem_fd = memfd_create("tcp_server-shm", MFD_CLOEXEC);
+    if (mem_fd == -1 || ftruncate(mem_fd, sizeof(ShmSegment)) == -1) {
+        perror("memfd_create");
+        goto fail_sock;
+    }
+
+    ShmSegment *seg = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (seg == MAP_FAILED) {
+        perror("mmap");
+        goto fail_mem;
+    }
+    seg->magic = SHM_MAGIC;
+    seg->version = SHM_VERSION;
+    seg->to_server.consumer_waiting = 1; // Nothing read yet, wake us on first data
+
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        perror("eventfd");
+        goto fail_map;
+    }
+    if (event_fd >= FD_SETSIZE) {
+        fprintf(stderr, "fd=%d exceeds FD_SETSIZE, rejecting connection\n", event_fd);
+        close(event_fd);
+        goto fail_map;
+    }
+
+    // Hand the segment and our wakeup eventfd to the client
+    int fds[2] = {mem_fd, event_fd};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    char byte = 'S';
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(sock_fd, &msg, MSG_NOSIGNAL) != 1) {
+        perror("sendmsg(SCM_RIGHTS)");
+        close(event_fd);
+        goto fail_map;
+    }
+    close(mem_fd);
+
+    client->fd = event_fd;
+    client->aux_fd = sock_fd;
+    client->transport = &shm_transport;
+    segments[event_fd] = seg;
+    snprintf(peer, peer_len, "unix:%d", sock_fd);
+    return true;
+
+fail_map:
+    munmap(seg, sizeof(ShmSegment));
+fail_mem:
+    if (mem_fd != -1) {
+        close(mem_fd);
+    }
+fail_sock:
+    close(sock_fd);
+    return false;
+}
+
+const Transport shm_transport = {
+    .name = "shm",
+    .accept = shm_accept,
+    .recv = shm_recv,
+    .send = shm_send,
+    .close = shm_close,
+    .write_ready_via_read = true,
+};
+
+ShmChannel *shm_connect(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0 || connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (sock_fd >= 0) {
+            close(sock_fd);
+        }
+        return NULL;
+    }
+
+    int fds[2];
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cm;
+    if (recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC) != 1 || (cm = CMSG_FIRSTHDR(&msg)) == NULL || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        close(sock_fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    ShmSegment *seg = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (seg == MAP_FAILED || seg->magic != SHM_MAGIC || seg->version != SHM_VERSION) {
+        if (seg != MAP_FAILED) {
+            munmap(seg, sizeof(ShmSegment));
+        }
+        close(fds[1]);
+        close(sock_fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    ShmChannel *ch = malloc(sizeof(ShmChannel));
+    ch->sock_fd = sock_fd;
+    ch->wake_fd = fds[1];
+    ch->seg = seg;
+    return ch;
+}
+
+ssize_t shm_channel_send(ShmChannel *ch, const void *buf, size_t len) {
+    ShmRing *ring = &ch->seg->to_server;
+    size_t done = 0;
+    while (done < len) {
+        if (__atomic_load_n(&ch->seg->server_closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        size_t n = ring_write(ring, (const char *)buf + done, len - done);
+        if (n > 0) {
+            done += n;
+            if (take_waiter(&ring->consumer_waiting)) {
+                wake_fd(ch->wake_fd);
+            }
+            continue;
+        }
+
+        // Ring full: sleep until the server frees space
+        __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (ring_used(ring) == SHM_RING_SIZE && !__atomic_load_n(&ch->seg->server_closed, __ATOMIC_ACQUIRE)) {
+            futex_wait(&ring->producer_waiting, 1);
+        }
+        __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return done;
+}
+
+ssize_t shm_channel_recv(ShmChannel *ch, void *buf, size_t len) {
+    ShmRing *ring = &ch->seg->to_client;
+    while (true) {
+        size_t n = ring_read(ring, buf, len);
+        if (n > 0) {
+            if (take_waiter(&ring->producer_waiting)) {
+                wake_fd(ch->wake_fd);
+            }
+            return n;
+        }
+        if (__atomic_load_n(&ch->seg->server_closed, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+
+        // Ring empty: sleep until the server produces
+        __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (ring_used(ring) == 0 && !__atomic_load_n(&ch->seg->server_closed, __ATOMIC_ACQUIRE)) {
+            futex_wait(&ring->consumer_waiting, 1);
+        }
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+void shm_channel_close(ShmChannel *ch) {
+    __atomic_store_n(&ch->seg->client_closed, 1, __ATOMIC_RELEASE);
+    wake_fd(ch->wake_fd);
+    munmap(ch->seg, sizeof(ShmSegment));
+    close(ch->wake_fd);
+    close(ch->sock_fd);
+    free(ch);
+}
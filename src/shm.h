@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "connection.h"
+
+#define SHM_RING_SIZE (256 * 1024) // Bytes per direction, power of two
+#define SHM_MAGIC 0x53484d31u      // "SHM1"
+#define SHM_VERSION 1
+
+// Single-producer single-consumer byte ring living in shared memory.
+// head/tail are free-running byte counters; each side only writes its own.
+// A side that is about to sleep sets its *_waiting flag and re-checks the
+// ring, and the other side only issues a wakeup when it sees the flag set.
+typedef struct {
+    _Alignas(CACHE_LINE) uint32_t head; // Consumer position
+    uint32_t consumer_waiting;          // Consumer sleeps until data arrives
+    _Alignas(CACHE_LINE) uint32_t tail; // Producer position
+    uint32_t producer_waiting;          // Producer sleeps until space frees up
+    _Alignas(CACHE_LINE) char data[SHM_RING_SIZE];
+} ShmRing;
+
+// Layout of the memfd handed to a client
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t client_closed;
+    uint32_t server_closed;
+    ShmRing to_server;
+    ShmRing to_client;
+} ShmSegment;
+
+// Server side: the transport used by shared-memory clients
+extern const Transport shm_transport;
+
+// Create the Unix socket clients negotiate shared-memory channels over
+int create_shm_listener(const char *path);
+
+// Client side: a connected shared-memory channel
+typedef struct {
+    int sock_fd;
+    int wake_fd; // Server's eventfd
+    ShmSegment *seg;
+} ShmChannel;
+
+ShmChannel *shm_connect(const char *path);
+
+// Blocking send/recv with the same return conventions as the socket calls
+ssize_t shm_channel_send(ShmChannel *ch, const void *buf, size_t len);
+ssize_t shm_channel_recv(ShmChannel *ch, void *buf, size_t len);
+
+void shm_channel_close(ShmChannel *ch);
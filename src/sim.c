@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "sim.h"
+
+#define SIM_PIPE_INITIAL 4096
+
+// A send's end offset and the simulated time it becomes readable
+typedef struct {
+    uint64_t end;
+    uint64_t ready_at;
+} SimMark;
+
+// Bytes in flight in one direction. Positions are absolute stream offsets;
+// data holds [read, written) and marks record when each send becomes visible.
+typedef struct {
+    char *data;
+    size_t capacity;
+    uint64_t read;
+    uint64_t written;
+    uint64_t visible; // Bytes before this offset have arrived
+    SimMark *marks; // Ring of marks_capacity entries
+    size_t marks_head, marks_count, marks_capacity;
+} SimPipe;
+
+typedef struct {
+    bool in_use;
+    bool peer_closed;
+    bool server_closed;
+    SimPipe to_server;
+    SimPipe to_peer;
+} SimConn;
+
+static struct {
+    SimConfig config;
+    SimStats stats;
+    SimStepFn step;
+    void *step_arg;
+    uint64_t now;
+    uint32_t rng;
+    SimConn conns[SIM_MAX_CONNS];
+    int pending[SIM_MAX_CONNS]; // Connected but not yet accepted, FIFO
+    int pending_head, pending_count;
+    uint64_t progress; // Bumped by every state change, to detect stalls
+} sim;
+
+static uint32_t sim_random(void) {
+    // xorshift32
+    uint32_t x = sim.rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim.rng = x;
+    return x;
+}
+
+static bool inject_eagain(void) {
+    if (sim.config.eagain_percent == 0 || sim_random() % 100 >= sim.config.eagain_percent) {
+        return false;
+    }
+    sim.stats.injected_eagains++;
+    errno = EAGAIN;
+    return true;
+}
+
+static void pipe_reset(SimPipe *pipe) {
+    free(pipe->data);
+    free(pipe->marks);
+    memset(pipe, 0, sizeof(*pipe));
+}
+
+// Make the pipe's pending bytes visible up to the current simulated time
+static void pipe_settle(SimPipe *pipe) {
+    while (pipe->marks_count > 0 && pipe->marks[pipe->marks_head].ready_at <= sim.now) {
+        pipe->visible = pipe->marks[pipe->marks_head].end;
+        pipe->marks_head = (pipe->marks_head + 1) % pipe->marks_capacity;
+        pipe->marks_count--;
+    }
+}
+
+static void pipe_write(SimPipe *pipe, const void *buf, size_t len) {
+    size_t queued = pipe->written - pipe->read;
+    if (queued + len > pipe->capacity) {
+        size_t capacity = pipe->capacity ? pipe->capacity : SIM_PIPE_INITIAL;
+        while (capacity < queued + len) {
+            capacity *= 2;
+        }
+        pipe->data = realloc(pipe->data, capacity);
+        if (pipe->data == NULL) {
+            fatal_error("Failed to grow simulated pipe");
+        }
+        pipe->capacity = capacity;
+    }
+    memcpy(pipe->data + queued, buf, len);
+    pipe->written += len;
+
+    if (sim.config.latency_ns == 0) {
+        pipe->visible = pipe->written;
+        return;
+    }
+    if (pipe->marks_count == pipe->marks_capacity) {
+        size_t capacity = pipe->marks_capacity ? pipe->marks_capacity * 2 : 16;
+        SimMark *marks = malloc(capacity * sizeof(SimMark));
+        if (marks == NULL) {
+            fatal_error("Failed to grow simulated pipe");
+        }
+        for (size_t i = 0; i < pipe->marks_count; i++) {
+            marks[i] = pipe->marks[(pipe->marks_head + i) % pipe->marks_capacity];
+        }
+        free(pipe->marks);
+        pipe->marks = marks;
+        pipe->marks_head = 0;
+        pipe->marks_capacity = capacity;
+    }
+    size_t tail = (pipe->marks_head + pipe->marks_count) % pipe->marks_capacity;
+    pipe->marks[tail].end = pipe->written;
+    pipe->marks[tail].ready_at = sim.now + sim.config.latency_ns;
+    pipe->marks_count++;
+}
+
+static size_t pipe_read(SimPipe *pipe, void *buf, size_t len) {
+    pipe_settle(pipe);
+    size_t avail = pipe->visible - pipe->read;
+    size_t n = len < avail ? len : avail;
+    memcpy(buf, pipe->data, n);
+    memmove(pipe->data, pipe->data + n, pipe->written - pipe->read - n);
+    pipe->read += n;
+    return n;
+}
+
+static bool pipe_readable(SimPipe *pipe) {
+    pipe_settle(pipe);
+    return pipe->visible > pipe->read;
+}
+
+static void release_if_done(SimConn *conn) {
+    if (conn->peer_closed && conn->server_closed) {
+        pipe_reset(&conn->to_server);
+        pipe_reset(&conn->to_peer);
+        conn->in_use = false;
+    }
+}
+
+static SimConn *conn_for_fd(int fd) { return &sim.conns[fd - SIM_FIRST_FD]; }
+
+static bool sim_accept(int listen_fd, Client *client, char *peer, size_t peer_len) {
+    (void)listen_fd;
+    if (sim.pending_count == 0) {
+        errno = EAGAIN;
+        return false;
+    }
+    int id = sim.pending[sim.pending_head];
+    sim.pending_head = (sim.pending_head + 1) % SIM_MAX_CONNS;
+    sim.pending_count--;
+    sim.progress++;
+
+    client->fd = SIM_FIRST_FD + id;
+    client->transport = &sim_transport;
+    snprintf(peer, peer_len, "sim#%d", id);
+    return true;
+}
+
+static ssize_t sim_recv(Client *client, void *buf, size_t len) {
+    SimConn *conn = conn_for_fd(client->fd);
+    if (inject_eagain()) {
+        return -1;
+    }
+    size_t n = pipe_read(&conn->to_server, buf, len);
+    if (n > 0) {
+        sim.progress++;
+        return n;
+    }
+    if (conn->peer_closed && conn->to_server.read == conn->to_server.written) {
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t sim_send(Client *client, const void *buf, size_t len, int flags) {
+    (void)flags;
+    SimConn *conn = conn_for_fd(client->fd);
+    if (conn->peer_closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (inject_eagain()) {
+        return -1;
+    }
+
+    size_t queued = conn->to_peer.written - conn->to_peer.read;
+    size_t space = sim.config.send_capacity > queued ? sim.config.send_capacity - queued : 0;
+    size_t n = len < space ? len : space;
+    if (sim.config.max_send_chunk > 0 && n > sim.config.max_send_chunk) {
+        n = sim.config.max_send_chunk;
+    }
+    if (n == 0) {
+        sim.stats.full_eagains++;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (n < len) {
+        sim.stats.partial_sends++;
+    }
+    pipe_write(&conn->to_peer, buf, n);
+    sim.progress++;
+    return n;
+}
+
+static void sim_close(Client *client) {
+    SimConn *conn = conn_for_fd(client->fd);
+    conn->server_closed = true;
+    sim.progress++;
+    release_if_done(conn);
+}
+
+const Transport sim_transport = {
+    .name = "sim",
+    .accept = sim_accept,
+    .recv = sim_recv,
+    .send = sim_send,
+    .close = sim_close,
+    .write_ready_via_read = false,
+};
+
+// Earliest time a delayed send becomes visible, or 0 if none is pending
+static uint64_t next_arrival(void) {
+    uint64_t next = 0;
+    for (int i = 0; i < SIM_MAX_CONNS; i++) {
+        SimConn *conn = &sim.conns[i];
+        if (!conn->in_use) {
+            continue;
+        }
+        SimPipe *pipes[2] = {&conn->to_server, &conn->to_peer};
+        for (int p = 0; p < 2; p++) {
+            if (pipes[p]->marks_count > 0) {
+                uint64_t at = pipes[p]->marks[pipes[p]->marks_head].ready_at;
+                if (next == 0 || at < next) {
+                    next = at;
+                }
+            }
+        }
+    }
+    return next;
+}
+
+// Keep only the descriptors in the sets that are ready; returns how many are
+static int collect_ready(int nfds, fd_set *read_set, fd_set *write_set) {
+    int ready = 0;
+    for (int fd = SIM_LISTEN_FD; fd < nfds; fd++) {
+        bool want_read = FD_ISSET(fd, read_set);
+        bool want_write = FD_ISSET(fd, write_set);
+        bool can_read = false, can_write = false;
+
+        if (fd == SIM_LISTEN_FD) {
+            can_read = sim.pending_count > 0;
+        } else if (want_read || want_write) {
+            SimConn *conn = conn_for_fd(fd);
+            can_read = pipe_readable(&conn->to_server) || conn->peer_closed;
+            can_write = conn->peer_closed || conn->to_peer.written - conn->to_peer.read < sim.config.send_capacity;
+        }
+
+        if (want_read && !can_read) {
+            FD_CLR(fd, read_set);
+        }
+        if (want_write && !can_write) {
+            FD_CLR(fd, write_set);
+        }
+        ready += (want_read && can_read) + (want_write && can_write);
+    }
+    return ready;
+}
+
+static int sim_wait(int nfds, fd_set *read_set, fd_set *write_set) {
+    fd_set wanted_read = *read_set, wanted_write = *write_set;
+    while (true) {
+        uint64_t progress = sim.progress;
+        if (!sim.step(sim.step_arg)) {
+            errno = ECANCELED;
+            return -1;
+        }
+
+        *read_set = wanted_read;
+        *write_set = wanted_write;
+        int ready = collect_ready(nfds, read_set, write_set);
+        if (ready > 0) {
+            return ready;
+        }
+
+        // Nothing to do until the next delayed send lands
+        uint64_t next = next_arrival();
+        if (next > sim.now) {
+            sim.now = next;
+        } else if (sim.progress == progress) {
+            fprintf(stderr, "Simulation stalled: no descriptor can become ready\n");
+            errno = ECANCELED;
+            return -1;
+        }
+    }
+}
+
+const LoopIo sim_io = {
+    .name = "sim",
+    .wait = sim_wait,
+    .transport = &sim_transport,
+};
+
+void sim_init(const SimConfig *config, SimStepFn step, void *arg) {
+    for (int i = 0; i < SIM_MAX_CONNS; i++) {
+        pipe_reset(&sim.conns[i].to_server);
+        pipe_reset(&sim.conns[i].to_peer);
+    }
+    memset(&sim, 0, sizeof(sim));
+    sim.config = *config;
+    if (sim.config.send_capacity == 0) {
+        sim.config.send_capacity = 64 * 1024;
+    }
+    sim.rng = config->seed ? config->seed : 1;
+    sim.step = step;
+    sim.step_arg = arg;
+}
+
+uint64_t sim_now(void) { return sim.now; }
+
+const SimStats *sim_stats(void) { return &sim.stats; }
+
+int sim_connect(void) {
+    for (int i = 0; i < SIM_MAX_CONNS; i++) {
+        if (!sim.conns[i].in_use) {
+            memset(&sim.conns[i], 0, sizeof(SimConn));
+            sim.conns[i].in_use = true;
+            sim.pending[(sim.pending_head + sim.pending_count) % SIM_MAX_CONNS] = i;
+            sim.pending_count++;
+            sim.progress++;
+            return i;
+        }
+    }
+    return -1;
+}
+
+ssize_t sim_peer_send(int peer, const void *buf, size_t len) {
+    SimConn *conn = &sim.conns[peer];
+    if (conn->server_closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    pipe_write(&conn->to_server, buf, len);
+    sim.progress++;
+    return len;
+}
+
+ssize_t sim_peer_recv(int peer, void *buf, size_t len) {
+    SimConn *conn = &sim.conns[peer];
+    size_t n = pipe_read(&conn->to_peer, buf, len);
+    if (n > 0) {
+        sim.progress++;
+        return n;
+    }
+    if (conn->server_closed && conn->to_peer.read == conn->to_peer.written) {
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+void sim_peer_close(int peer) {
+    SimConn *conn = &sim.conns[peer];
+    conn->peer_closed = true;
+    sim.progress++;
+    release_if_done(conn);
+}
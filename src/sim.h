@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "connection.h"
+
+// In-memory loopback transport for driving the select loop and its handlers
+// without the kernel. Connections are pairs of byte pipes between the server
+// (through sim_transport) and a simulated peer (through the sim_peer_*
+// calls). Time is simulated too, so a run with the same seed and the same
+// peer behaviour is exactly reproducible.
+
+#define SIM_LISTEN_FD 3
+#define SIM_FIRST_FD 4
+#define SIM_MAX_CONNS (FD_SETSIZE - SIM_FIRST_FD) // Synthetic fds must fit an fd_set
+
+// Fault and timing injection
+typedef struct {
+    size_t max_send_chunk;   // Largest send the server completes at once, 0 for no limit
+    size_t send_capacity;    // Bytes queued toward a peer before send fails with EAGAIN
+    unsigned eagain_percent; // Chance that a recv/send fails with EAGAIN regardless
+    uint64_t latency_ns;     // Simulated delay before sent bytes become readable
+    uint32_t seed;           // PRNG seed for the injected EAGAINs
+} SimConfig;
+
+// Injected events, for reporting
+typedef struct {
+    uint64_t partial_sends;
+    uint64_t injected_eagains;
+    uint64_t full_eagains; // Sends refused because send_capacity was reached
+} SimStats;
+
+// Called at the top of every wait() to let peers act. Returning false makes
+// the loop return.
+typedef bool (*SimStepFn)(void *arg);
+
+extern const Transport sim_transport;
+extern const LoopIo sim_io; // Pass SIM_LISTEN_FD as the server descriptor
+
+void sim_init(const SimConfig *config, SimStepFn step, void *arg);
+uint64_t sim_now(void);
+const SimStats *sim_stats(void);
+
+// Peer side. Returns a peer id, or -1 if all connection slots are in use.
+int sim_connect(void);
+ssize_t sim_peer_send(int peer, const void *buf, size_t len);
+// Returns 0 once the server closed and everything was read, -1 with EAGAIN
+// when nothing is readable yet
+ssize_t sim_peer_recv(int peer, void *buf, size_t len);
+void sim_peer_close(int peer);
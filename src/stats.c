@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "metrics.h"
+#include "stats.h"
+
+#define METRIC_COUNT(name, help) +1
+_Static_assert(0 SERVER_METRICS(METRIC_COUNT) <= STATS_MAX_METRICS, "StatsSegment needs room for every metric");
+#undef METRIC_COUNT
+
+typedef struct {
+    LoopStats *stats;
+    pid_t tid;
+    const char *name;
+} WatchedLoop;
+
+static struct {
+    pthread_mutex_t lock; // Guards loops against watch/unwatch
+    WatchedLoop loops[STATS_MAX_LOOPS];
+    int nloops;
+} publisher = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+bool stats_timing;
+
+void stats_watch_loop(LoopStats *stats, const char *name) {
+    pthread_mutex_lock(&publisher.lock);
+    if (publisher.nloops == STATS_MAX_LOOPS) {
+        fprintf(stderr, "Too many loops for the stats segment, ignoring one\n");
+    } else {
+        publisher.loops[publisher.nloops++] = (WatchedLoop){.stats = stats, .tid = (pid_t)syscall(SYS_gettid), .name = name};
+    }
+    pthread_mutex_unlock(&publisher.lock);
+}
+
+void stats_unwatch_loop(LoopStats *stats) {
+    pthread_mutex_lock(&publisher.lock);
+    for (int i = 0; i < publisher.nloops; i++) {
+        if (publisher.loops[i].stats == stats) {
+            publisher.loops[i] = publisher.loops[--publisher.nloops];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&publisher.lock);
+}
+
+static void copy_loop_stats(LoopStats *to, const LoopStats *from) {
+    const uint64_t *src = (const uint64_t *)from;
+    uint64_t *dst = (uint64_t *)to;
+    for (size_t i = 0; i < sizeof(LoopStats) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Write one snapshot under the seqlock
+static void publish(StatsSegment *segment) {
+    uint32_t seq = segment->seq;
+    __atomic_store_n(&segment->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    int i = 0;
+#define METRIC_VALUE(name, help) segment->metrics[i++] = metric_get(name);
+    SERVER_METRICS(METRIC_VALUE)
+#undef METRIC_VALUE
+    pthread_mutex_lock(&publisher.lock);
+    for (int l = 0; l < STATS_MAX_LOOPS; l++) {
+        StatsLoop *slot = &segment->loops[l];
+        if (l < publisher.nloops) {
+            slot->tid = publisher.loops[l].tid;
+            snprintf(slot->name, sizeof(slot->name), "%s", publisher.loops[l].name);
+            copy_loop_stats(&slot->stats, publisher.loops[l].stats);
+        } else {
+            slot->tid = 0;
+        }
+    }
+    pthread_mutex_unlock(&publisher.lock);
+    segment->updated_ns = stats_now_ns();
+
+    __atomic_store_n(&segment->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *publisher_thread(void *arg) {
+    StatsSegment *segment = arg;
+    pthread_setname_np(pthread_self(), "stats");
+    struct timespec period = {.tv_sec = STATS_PUBLISH_MS / 1000, .tv_nsec = (STATS_PUBLISH_MS % 1000) * 1000000L};
+    while (true) {
+        publish(segment);
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+void start_stats_publisher(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(StatsSegment)) == -1) {
+        fatal_error("Failed to create stats file");
+    }
+    StatsSegment *segment = mmap(NULL, sizeof(StatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fatal_error("Failed to map stats file");
+    }
+
+    int nmetrics = 0;
+#define METRIC_NAME(name, help) snprintf(segment->metric_names[nmetrics++], STATS_NAME_LEN, "%s", #name);
+    SERVER_METRICS(METRIC_NAME)
+#undef METRIC_NAME
+    segment->nmetrics = nmetrics;
+    segment->pid = getpid();
+    segment->size = sizeof(StatsSegment);
+    segment->version = STATS_VERSION;
+    publish(segment);
+    // Readers check magic last, once the header is complete
+    __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&stats_timing, true, __ATOMIC_RELAXED);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, publisher_thread, segment) != 0) {
+        fatal_error("Failed to start stats thread");
+    }
+    pthread_detach(thread);
+    printf("Publishing stats to %s\n", path);
+}
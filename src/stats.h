@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "config.h"
+
+#define STATS_MAGIC 0x54415453u // "STAT"
+#define STATS_VERSION 1         // Bumped with any layout change
+#define STATS_MAX_METRICS 32
+#define STATS_NAME_LEN 32
+#define STATS_MAX_LOOPS 8
+#define STATS_LATENCY_BUCKETS 24 // Bucket 0: under 1 us; bucket b: [2^(b-1), 2^b) us
+#define STATS_PUBLISH_MS 100
+
+// A loop's own counters. Only the loop thread writes them, with relaxed
+// stores; the publisher reads them with relaxed loads.
+typedef struct {
+    uint64_t passes;  // Loop iterations that handled something
+    uint64_t reads;   // Client reads that returned data
+    uint64_t bytes_in;
+    uint64_t busy_ns; // Time spent handling, not waiting; timed passes only
+    uint64_t pass_ns[STATS_LATENCY_BUCKETS];
+} LoopStats;
+
+typedef struct {
+    int32_t tid; // 0 for an unused slot
+    char name[16];
+    LoopStats stats;
+} StatsLoop;
+
+// Layout of the stats file. The header is written once before readers can
+// map it; the rest is republished every STATS_PUBLISH_MS under the seqlock:
+// seq is odd while the publisher writes, so a reader copies the body
+// between two equal, even reads of seq.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; // sizeof(StatsSegment)
+    uint32_t nmetrics;
+    int32_t pid;
+    char metric_names[STATS_MAX_METRICS][STATS_NAME_LEN];
+    _Alignas(CACHE_LINE) uint32_t seq;
+    uint64_t updated_ns; // CLOCK_MONOTONIC time of the last publish
+    uint64_t metrics[STATS_MAX_METRICS];
+    StatsLoop loops[STATS_MAX_LOOPS];
+} StatsSegment;
+
+#define loop_stat_add(field, n) __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+// Set once a publisher runs. Loops only time their passes then: two clock
+// reads per pass are a measurable share of a short one.
+extern bool stats_timing;
+
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// When a pass starts handling, for loop_stats_pass; 0 if not timing
+static inline uint64_t loop_stats_start(void) { return stats_timing ? stats_now_ns() : 0; }
+
+// Count a loop pass that started handling at start_ns
+static inline void loop_stats_pass(LoopStats *stats, uint64_t start_ns) {
+    if (start_ns == 0) {
+        loop_stat_add(stats->passes, 1);
+        return;
+    }
+    uint64_t ns = stats_now_ns() - start_ns;
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= STATS_LATENCY_BUCKETS) {
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    }
+    loop_stat_add(stats->passes, 1);
+    loop_stat_add(stats->busy_ns, ns);
+    loop_stat_add(stats->pass_ns[bucket], 1);
+}
+
+// Have the calling thread's loop published under name until
+// stats_unwatch_loop. Fine without a publisher running.
+void stats_watch_loop(LoopStats *stats, const char *name);
+void stats_unwatch_loop(LoopStats *stats);
+
+// Create the stats file at path and start a thread publishing server_metrics
+// and the watched loops' stats into it. Readers map it read-only and never
+// talk to the server.
+void start_stats_publisher(const char *path);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "connection.h"
+#include "events.h"
+#include "server.h"
+
+// Public interface of libtcpserver: the select loop, connection management
+// and write buffers, driven by application callbacks. Like the library, it
+// needs _GNU_SOURCE defined before any system header. An application fills
+// in server_config, registers its callbacks and runs the loop:
+//
+//   set_server_callbacks(&my_callbacks);
+//   int fd = create_server_hello_socket(port);
+//   run_server_with_select(&socket_io, fd, NULL, -1, create_loop_events());
+//
+// Reads stop while a connection's queued output is at max_pending_writes,
+// and each read is no larger than the room left, so a protocol that replies
+// with no more than it received never overruns its buffer. Egress limits
+// (set_egress_class, the -R and -B options) hold output back the same way:
+// it queues until tokens come in, and reads stop once the queue is full.
+// With a spill threshold (-F), output queued beyond it goes to an unlinked
+// file instead of memory, and reads only stop at SPILL_MAX_BYTES.
+
+// A connection as the callbacks see it. Its fields stay good until on_close,
+// so a copy can act on the connection later, on the loop thread (a loop task).
+typedef struct {
+    ClientTable *table;
+    int slot;
+    fd_set *master_read_set;
+    fd_set *master_write_set;
+} Connection;
+
+// Every callback is optional; without on_data, input is discarded
+typedef struct {
+    // A connection was accepted; peer is printable
+    void (*on_accept)(Connection *conn, const char *peer);
+    // Bytes arrived. data is only valid during the call.
+    void (*on_data)(Connection *conn, const char *data, size_t len);
+    // All queued output went out
+    void (*on_writable)(Connection *conn);
+    // The connection is about to close, by either side
+    void (*on_close)(Connection *conn);
+} ServerCallbacks;
+
+// Install the callbacks the select loop calls; before running it, or on the
+// loop thread between handlers (a loop task), which is how plugins swap in
+void set_server_callbacks(const ServerCallbacks *callbacks);
+
+// Bumped whenever ServerCallbacks, Connection or the conn_* functions change
+// incompatibly
+#define HANDLER_ABI_VERSION 1
+
+// Handlers built as a shared object export a HandlerPlugin under this name,
+// and the server loads it with load_handler (plugin.h):
+//
+//   const HandlerPlugin tcp_server_handler = {
+//       .abi_version = HANDLER_ABI_VERSION,
+//       .name = "upper",
+//       .callbacks = {.on_data = upper_data},
+//   };
+//
+// The conn_* functions resolve against the server executable. Connections
+// outlive a swap: the new handlers get their next events, and conn_data
+// still holds what the previous handlers stored there.
+#define HANDLER_SYMBOL "tcp_server_handler"
+
+typedef struct {
+    uint32_t abi_version; // HANDLER_ABI_VERSION the plugin was built against
+    const char *name;
+    ServerCallbacks callbacks;
+} HandlerPlugin;
+
+// Send data, queueing whatever the socket doesn't take right away. On
+// failure (queue full, or the send failed) the connection is closed and
+// false returned.
+bool conn_send(Connection *conn, const void *data, size_t len);
+
+// Room for len bytes at the end of the connection's queued output, to build
+// a reply in place; NULL if that would exceed max_pending_writes
+char *conn_reserve(Connection *conn, size_t len);
+
+// Queue len bytes written to conn_reserve's memory and start sending them.
+// Same failure handling as conn_send.
+bool conn_commit(Connection *conn, size_t len);
+
+// Bytes queued and not sent yet
+size_t conn_queued(const Connection *conn);
+
+// Close the connection; on_close runs first
+void conn_close(Connection *conn);
+
+int conn_fd(const Connection *conn);
+
+// Move the connection to egress class egress_class (below
+// EGRESS_MAX_CLASSES); it then shares that class's bucket. Connections start
+// in class 0, which -B limits.
+void conn_set_egress_class(Connection *conn, int egress_class);
+
+// Limit an egress class to rate bytes/s across its connections, in bursts of
+// up to burst bytes (0 for EGRESS_DEFAULT_BURST_MS worth); a rate of 0 lifts
+// the limit. Before running the loop, or on the loop thread.
+void set_egress_class(int egress_class, uint64_t rate, uint64_t burst);
+
+// How the loop shares a pass between ready connections: priority ones (say,
+// control traffic) are served first, and every connection reads, and
+// flushes queued output, at most weight * sched_quantum bytes per pass on
+// average, deficit round-robin style. Connections start as weight 1, not
+// priority.
+void conn_set_schedule(Connection *conn, bool priority, unsigned weight);
+
+// Stop reading from the connection, say while its replies wait on something
+// else, and take reads again once released; input meanwhile waits in the
+// socket. Transports that report writability through reads (shared memory)
+// can't be held and keep delivering input.
+void conn_hold_input(Connection *conn, bool hold);
+
+// One pointer per connection for the application, NULL after accept
+void conn_set_data(Connection *conn, void *data);
+void *conn_data(const Connection *conn);
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "heap.h"
+#include "udp.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Receive work done per readiness notification, so TCP clients aren't starved
+#define UDP_MAX_BATCHES_PER_EVENT (UDP_RING_SLOTS / UDP_BATCH)
+
+// Point a ring slot's header at its buffer, ready to receive
+static void udp_prepare_recv(UdpEndpoint *udp, unsigned slot) {
+    udp->iovs[slot] = (struct iovec){.iov_base = udp->buffers + (size_t)slot * udp->slot_size, .iov_len = udp->slot_size};
+    udp->msgs[slot].msg_hdr = (struct msghdr){
+        .msg_name = &udp->addrs[slot],
+        .msg_namelen = sizeof(udp->addrs[slot]),
+        .msg_iov = &udp->iovs[slot],
+        .msg_iovlen = 1,
+        .msg_control = udp->offload ? udp->control[slot] : NULL,
+        .msg_controllen = udp->offload ? sizeof(udp->control[slot]) : 0,
+    };
+    udp->msgs[slot].msg_len = 0;
+}
+
+// Turn a received slot into its reply: same payload, back to the sender.
+// A GRO-coalesced receive goes back out as one UDP_SEGMENT send.
+static void udp_prepare_reply(UdpEndpoint *udp, unsigned slot) {
+    struct msghdr *hdr = &udp->msgs[slot].msg_hdr;
+    unsigned len = udp->msgs[slot].msg_len;
+    int segment_size = 0;
+
+    if (udp->offload) {
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(hdr); cm != NULL; cm = CMSG_NXTHDR(hdr, cm)) {
+            if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+                memcpy(&segment_size, CMSG_DATA(cm), sizeof(segment_size));
+            }
+        }
+    }
+
+    udp->iovs[slot].iov_len = len;
+    hdr->msg_flags = 0;
+    if (segment_size > 0 && (unsigned)segment_size < len) {
+        hdr->msg_control = udp->control[slot];
+        hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+        cm->cmsg_level = IPPROTO_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso_size = (uint16_t)segment_size;
+        memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+    } else {
+        hdr->msg_control = NULL;
+        hdr->msg_controllen = 0;
+    }
+}
+
+UdpEndpoint *create_udp_endpoint(int port, bool offload) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        fatal_error("UDP socket creation failed");
+    }
+
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt");
+        close(fd);
+        fatal_error("Failed to set SO_REUSEADDR");
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = {.s_addr = htonl(INADDR_ANY)},
+        .sin_port = htons(port),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        fatal_error("UDP bind failed");
+    }
+
+    // GRO hands us coalesced bursts; fall back to plain datagrams without it
+    if (offload && setsockopt(fd, IPPROTO_UDP, UDP_GRO, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt(UDP_GRO)");
+        offload = false;
+    }
+
+    UdpEndpoint *udp = heap_alloc(sizeof(UdpEndpoint));
+    if (udp == NULL) {
+        fatal_error("Failed to allocate UDP endpoint");
+    }
+    memset(udp, 0, sizeof(UdpEndpoint));
+    udp->fd = fd;
+    udp->offload = offload;
+    udp->slot_size = offload ? UDP_GRO_SLOT_SIZE : UDP_SLOT_SIZE;
+    udp->buffers = heap_alloc(UDP_RING_SLOTS * udp->slot_size);
+    if (udp->buffers == NULL) {
+        fatal_error("Failed to allocate UDP message ring");
+    }
+
+    printf("UDP listening on port %d%s\n", port, offload ? " (GRO/GSO)" : "");
+    return udp;
+}
+
+int handle_udp_write(UdpEndpoint *udp) {
+    while (udp->count > 0) {
+        unsigned batch = udp->count;
+        if (batch > UDP_RING_SLOTS - udp->tail) {
+            batch = UDP_RING_SLOTS - udp->tail;
+        }
+        if (batch > UDP_BATCH) {
+            batch = UDP_BATCH;
+        }
+
+        int sent = sendmmsg(udp->fd, &udp->msgs[udp->tail], batch, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1; // Socket buffer full, try again when writable
+            }
+            // Only the first message failed; drop it so the rest can go out
+            perror("sendmmsg");
+            sent = 1;
+        }
+
+        udp->tail = (udp->tail + sent) % UDP_RING_SLOTS;
+        udp->count -= sent;
+    }
+    return 0;
+}
+
+int handle_udp_read(UdpEndpoint *udp) {
+    for (int round = 0; round < UDP_MAX_BATCHES_PER_EVENT; round++) {
+        // Receive into the contiguous run of free slots after head
+        unsigned free_slots = UDP_RING_SLOTS - udp->count;
+        unsigned batch = free_slots;
+        if (batch > UDP_RING_SLOTS - udp->head) {
+            batch = UDP_RING_SLOTS - udp->head;
+        }
+        if (batch > UDP_BATCH) {
+            batch = UDP_BATCH;
+        }
+        if (batch == 0) {
+            return 1; // Ring full of unsent replies
+        }
+
+        for (unsigned i = 0; i < batch; i++) {
+            udp_prepare_recv(udp, udp->head + i);
+        }
+
+        int received = recvmmsg(udp->fd, &udp->msgs[udp->head], batch, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("recvmmsg");
+            return -1;
+        }
+
+        for (int i = 0; i < received; i++) {
+            udp_prepare_reply(udp, udp->head + i);
+        }
+        udp->head = (udp->head + received) % UDP_RING_SLOTS;
+        udp->count += received;
+
+        if (handle_udp_write(udp) == 1) {
+            return 1;
+        }
+        if ((unsigned)received < batch) {
+            break; // Socket drained
+        }
+    }
+    return handle_udp_write(udp);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define UDP_RING_SLOTS 256   // Preallocated message buffers per endpoint
+#define UDP_BATCH 64         // Datagrams per recvmmsg/sendmmsg call
+#define UDP_SLOT_SIZE 2048   // Fits any single datagram on a 1500-byte MTU
+#define UDP_GRO_SLOT_SIZE 65536 // Room for a full GRO super-datagram
+
+// Datagram echo endpoint. Received messages are queued in a ring of
+// preallocated slots and echoed back in order; a slot is only reused once
+// its reply has been handed to the kernel.
+typedef struct {
+    int fd;
+    bool offload; // UDP_GRO on receive, UDP_SEGMENT on send
+    size_t slot_size;
+    char *buffers; // UDP_RING_SLOTS * slot_size bytes
+    struct mmsghdr msgs[UDP_RING_SLOTS];
+    struct iovec iovs[UDP_RING_SLOTS];
+    struct sockaddr_storage addrs[UDP_RING_SLOTS];
+    char control[UDP_RING_SLOTS][64];
+    unsigned head;  // Next slot to receive into
+    unsigned tail;  // Next slot to send from
+    unsigned count; // Slots holding a reply not yet sent
+} UdpEndpoint;
+
+// Create a UDP socket bound to port and set up its message ring
+UdpEndpoint *create_udp_endpoint(int port, bool offload);
+
+// Receive and echo as many datagrams as possible without blocking
+// Returns: 0 when all replies went out, 1 if some wait for writability, -1 on error
+int handle_udp_read(UdpEndpoint *udp);
+
+// Retry replies that hit a full socket buffer (same return values)
+int handle_udp_write(UdpEndpoint *udp);
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "config.h"
+#include "error.h"
+#include "heap.h"
+#include "metrics.h"
+#include "stats.h"
+#include "uring.h"
+#include "watchdog.h"
+
+#define URING_ENTRIES 4096
+#define SQPOLL_IDLE_MS 2000
+#define MAX_REGISTERED_BUFFER (1u << 30) // Kernel limit per registered iovec
+#define URING_POOL_BUFFERS 4096            // Provided buffers shared by all clients, power of two
+#define URING_BUFFER_GROUP 0
+
+// Operation in the top byte of user_data, client slot in the low 32 bits
+enum { OP_ACCEPT = 1, OP_READ, OP_WRITE, OP_CLOSE };
+#define USER_DATA(op, slot) (((uint64_t)(op) << 56) | (uint32_t)(slot))
+#define USER_DATA_OP(data) ((int)((data) >> 56))
+#define USER_DATA_SLOT(data) ((int)(uint32_t)(data))
+
+// Client state on the io_uring path. With URING_FIXED_FILES the socket only
+// exists in the ring's registered file table, so fd is that table index (and
+// equal to the slot); otherwise it is a regular descriptor. Idle clients hold
+// no buffer: the kernel picks one from the provided-buffer ring when data
+// arrives, and it goes back once echoed.
+typedef struct {
+    int fd;          // Fixed-file index or raw fd, -1 when the slot is free
+    int buffer;      // Pool buffer holding unsent data, -1 if none
+    uint32_t len;    // Bytes received into that buffer
+    uint32_t offset; // How much of them we've already echoed back
+} UringClient;
+
+// A minimal io_uring instance talking to the kernel through raw syscalls
+typedef struct {
+    int ring_fd;
+    unsigned features; // URING_* flags in effect
+    unsigned entries;
+
+    // Submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; // Includes SQEs prepared but not yet published
+    unsigned to_submit;
+
+    // Completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Buffer pool: URING_POOL_BUFFERS slots of BUFFER_SIZE, lent to clients
+    // through the provided-buffer ring
+    char *arena;
+    size_t arena_size;
+    unsigned slots_per_registered_buffer;
+    struct io_uring_buf_ring *buf_ring;
+    uint16_t buf_ring_tail;
+
+    // Clients whose read failed because the pool ran dry, re-armed as
+    // buffers come back
+    int *starved;
+    int starved_count;
+
+    UringClient *clients;
+    int max_clients;
+    int server_fd;
+} UringServer;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) { return (int)syscall(__NR_io_uring_setup, entries, params); }
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) { return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args); }
+
+// Registered file tables are limited by RLIMIT_NOFILE, so raise it as far as allowed
+static void raise_nofile_limit(rlim_t wanted) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= wanted) {
+        return;
+    }
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("setrlimit(RLIMIT_NOFILE)");
+    }
+}
+
+// Create the ring and map its submission and completion queues
+static void uring_init(UringServer *ring, unsigned entries, unsigned features) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (features & URING_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+
+    ring->ring_fd = sys_io_uring_setup(entries, &params);
+    if (ring->ring_fd < 0) {
+        fatal_error("io_uring_setup failed");
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        fatal_error("io_uring without IORING_FEAT_SINGLE_MMAP is not supported");
+    }
+    ring->features = features;
+    ring->entries = params.sq_entries;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char *ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring_ptr == MAP_FAILED) {
+        fatal_error("mmap(io_uring rings) failed");
+    }
+    ring->sq_head = (unsigned *)(ring_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(ring_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ring_ptr + params.sq_off.ring_mask);
+    ring->sq_flags = (unsigned *)(ring_ptr + params.sq_off.flags);
+    ring->sq_array = (unsigned *)(ring_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)(ring_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ring_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ring_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring_ptr + params.cq_off.cqes);
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        fatal_error("mmap(io_uring sqes) failed");
+    }
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->to_submit = 0;
+}
+
+// Publish prepared SQEs and optionally wait for completions.
+// With SQPOLL the kernel thread picks SQEs up by itself, so this only enters
+// the kernel to wake an idle poller or to block for completions.
+static int uring_submit(UringServer *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = ring->to_submit;
+    unsigned flags = 0;
+    if (ring->features & URING_SQPOLL) {
+        to_submit = 0;
+        ring->to_submit = 0;
+        // Order the tail store before checking whether the poller went to sleep
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+    }
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (to_submit == 0 && flags == 0) {
+        ring->to_submit = 0;
+        return 0;
+    }
+
+    int ret = sys_io_uring_enter(ring->ring_fd, to_submit, wait_nr, flags);
+    if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return 0; // Retried on the next loop iteration
+        }
+        perror("io_uring_enter");
+        return -1;
+    }
+    ring->to_submit -= (unsigned)ret;
+    return 0;
+}
+
+// Get a zeroed SQE, flushing the queue to the kernel if it is full
+static struct io_uring_sqe *uring_get_sqe(UringServer *ring) {
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+        if (uring_submit(ring, 0) < 0) {
+            fatal_error("Failed to flush io_uring submission queue");
+        }
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+// Point an SQE at a client socket, through the fixed file table if enabled
+static void prep_client_fd(UringServer *ring, struct io_uring_sqe *sqe, int slot) {
+    sqe->fd = ring->clients[slot].fd;
+    if (ring->features & URING_FIXED_FILES) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+static char *pool_buffer(UringServer *ring, int buffer) { return ring->arena + (size_t)buffer * BUFFER_SIZE; }
+
+// Hand a pool buffer back to the kernel for future reads
+static void recycle_buffer(UringServer *ring, int buffer) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_ring_tail & (URING_POOL_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)pool_buffer(ring, buffer);
+    buf->len = BUFFER_SIZE;
+    buf->bid = (uint16_t)buffer;
+    ring->buf_ring_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+// Queue a (multishot) accept on the listening socket
+static void queue_accept(UringServer *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    if (ring->features & URING_FIXED_FILES) {
+        sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    }
+    sqe->user_data = USER_DATA(OP_ACCEPT, 0);
+}
+
+// Queue a read into whichever pool buffer the kernel selects
+static void queue_read(UringServer *ring, int slot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    prep_client_fd(ring, sqe, slot);
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->len = BUFFER_SIZE;
+    sqe->user_data = USER_DATA(OP_READ, slot);
+}
+
+// Queue a write of the unsent part of the client's pool buffer
+static void queue_write(UringServer *ring, int slot) {
+    UringClient *client = &ring->clients[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    prep_client_fd(ring, sqe, slot);
+    sqe->addr = (uint64_t)(uintptr_t)(pool_buffer(ring, client->buffer) + client->offset);
+    sqe->len = client->len - client->offset;
+    if (ring->features & URING_FIXED_BUFFERS) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = client->buffer / ring->slots_per_registered_buffer;
+    } else {
+        sqe->opcode = IORING_OP_WRITE;
+    }
+    sqe->user_data = USER_DATA(OP_WRITE, slot);
+}
+
+// Give a buffer back and, if a read failed for lack of one, retry it now.
+// Every return goes through here, whether the buffer was echoed, never
+// filled or freed by a close, so no starved client is left unread.
+static void release_buffer(UringServer *ring, int buffer) {
+    recycle_buffer(ring, buffer);
+    if (ring->starved_count > 0) {
+        queue_read(ring, ring->starved[--ring->starved_count]);
+    }
+}
+
+// Drop a closing client's pending retry, so it isn't read once gone, or
+// read twice once the slot is reused
+static void forget_starved(UringServer *ring, int slot) {
+    for (int i = 0; i < ring->starved_count; i++) {
+        if (ring->starved[i] == slot) {
+            ring->starved[i] = ring->starved[--ring->starved_count];
+            return;
+        }
+    }
+}
+
+// Queue a close and free the slot; later CQEs for it can't arrive before the
+// close completes, and the fd/index can't be handed out again until then
+static void close_uring_client(UringServer *ring, int slot) {
+    UringClient *client = &ring->clients[slot];
+    if (client->fd < 0) {
+        return;
+    }
+
+    log_event("Closing client slot=%d\n", slot);
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    if (ring->features & URING_FIXED_FILES) {
+        sqe->file_index = client->fd + 1;
+    } else {
+        sqe->fd = client->fd;
+    }
+    sqe->user_data = USER_DATA(OP_CLOSE, slot);
+    client->fd = -1;
+    metric_sub(connections, 1);
+    forget_starved(ring, slot);
+    if (client->buffer >= 0) {
+        int buffer = client->buffer;
+        client->buffer = -1;
+        release_buffer(ring, buffer);
+    }
+}
+
+// Register the provided-buffer ring and fill it with the whole pool
+static void register_buffer_ring(UringServer *ring) {
+    size_t size = URING_POOL_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        fatal_error("mmap(buffer ring) failed");
+    }
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)ring->buf_ring,
+        .ring_entries = URING_POOL_BUFFERS,
+        .bgid = URING_BUFFER_GROUP,
+    };
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fatal_error("IORING_REGISTER_PBUF_RING failed");
+    }
+    for (int i = 0; i < URING_POOL_BUFFERS; i++) {
+        recycle_buffer(ring, i);
+    }
+}
+
+// Register the buffer pool, split into iovecs the kernel accepts
+static void register_arena(UringServer *ring) {
+    size_t chunk = (size_t)ring->slots_per_registered_buffer * BUFFER_SIZE;
+    unsigned nr = (unsigned)((ring->arena_size + chunk - 1) / chunk);
+    struct iovec *iov = heap_alloc(nr * sizeof(*iov));
+    for (unsigned i = 0; i < nr; i++) {
+        iov[i].iov_base = ring->arena + i * chunk;
+        iov[i].iov_len = ring->arena_size - i * chunk < chunk ? ring->arena_size - i * chunk : chunk;
+    }
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, iov, nr) < 0) {
+        fatal_error("IORING_REGISTER_BUFFERS failed");
+    }
+    heap_free(iov);
+}
+
+// Register an empty (sparse) file table with one entry per client slot
+static void register_file_table(UringServer *ring) {
+    int *files = heap_alloc(ring->max_clients * sizeof(int));
+    for (int i = 0; i < ring->max_clients; i++) {
+        files[i] = -1;
+    }
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES, files, ring->max_clients) < 0) {
+        fatal_error("IORING_REGISTER_FILES failed");
+    }
+    heap_free(files);
+}
+
+static void handle_accept(UringServer *ring, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        queue_accept(ring); // Multishot accept was terminated, re-arm it
+    }
+    if (cqe->res < 0) {
+        fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    int slot = cqe->res;
+    if (slot >= ring->max_clients) {
+        // A fixed file only exists in the ring's table, so it closes through
+        // the ring; a plain descriptor closes directly
+        fprintf(stderr, "Too many clients, rejecting connection\n");
+        if (ring->features & URING_FIXED_FILES) {
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = (uint32_t)slot + 1;
+            sqe->user_data = USER_DATA(OP_CLOSE, ring->max_clients);
+        } else {
+            close(slot);
+        }
+        return;
+    }
+
+    ring->clients[slot] = (UringClient){.fd = cqe->res, .buffer = -1, .len = 0, .offset = 0};
+    metric_add(connections, 1);
+    log_event("New client connected (slot=%d)\n", slot);
+    queue_read(ring, slot);
+}
+
+// Echo received data back
+static void handle_read(UringServer *ring, int slot, int res, unsigned flags) {
+    int buffer = flags & IORING_CQE_F_BUFFER ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    if (buffer >= 0 && (ring->clients[slot].fd < 0 || res <= 0)) {
+        release_buffer(ring, buffer); // Nothing to echo from it
+    }
+    if (ring->clients[slot].fd < 0) {
+        return;
+    }
+    if (res == -ENOBUFS) {
+        // Every pool buffer is lent out; retry once one comes back
+        ring->starved[ring->starved_count++] = slot;
+        return;
+    }
+    if (res <= 0) {
+        if (res < 0) {
+            fprintf(stderr, "read(slot=%d): %s\n", slot, strerror(-res));
+        } else {
+            log_event("Client disconnected (slot=%d)\n", slot);
+        }
+        close_uring_client(ring, slot);
+        return;
+    }
+    ring->clients[slot].buffer = buffer;
+    ring->clients[slot].len = res;
+    ring->clients[slot].offset = 0;
+    queue_write(ring, slot);
+}
+
+// Continue a partial write, or go back to reading once everything is sent
+static void handle_write(UringServer *ring, int slot, int res) {
+    UringClient *client = &ring->clients[slot];
+    if (client->fd < 0) {
+        return;
+    }
+    // Nothing written with data left to send would only repeat forever
+    if (res <= 0) {
+        fprintf(stderr, "write(slot=%d): %s\n", slot, res < 0 ? strerror(-res) : "wrote nothing");
+        close_uring_client(ring, slot);
+        return;
+    }
+    client->offset += res;
+    if (client->offset < client->len) {
+        queue_write(ring, slot);
+        return;
+    }
+
+    int buffer = client->buffer;
+    client->buffer = -1;
+    queue_read(ring, slot);
+    release_buffer(ring, buffer);
+}
+
+// Main server loop using io_uring
+int run_server_with_uring(int server_fd) {
+    UringServer ring = {.server_fd = server_fd, .max_clients = server_config.max_clients};
+    unsigned features = server_config.uring_features;
+
+    raise_nofile_limit(ring.max_clients + 64);
+    uring_init(&ring, URING_ENTRIES, features);
+
+    ring.clients = heap_alloc(ring.max_clients * sizeof(UringClient));
+    ring.starved = heap_alloc(ring.max_clients * sizeof(int));
+    if (ring.clients == NULL || ring.starved == NULL) {
+        fatal_error("Failed to allocate client table");
+    }
+    for (int i = 0; i < ring.max_clients; i++) {
+        ring.clients[i].fd = -1;
+        ring.clients[i].buffer = -1;
+    }
+
+    ring.arena_size = (size_t)URING_POOL_BUFFERS * BUFFER_SIZE;
+    ring.arena = arena_map(&ring.arena_size, server_config.prefault ? SIZE_MAX : 0, "io_uring buffer arena");
+    ring.slots_per_registered_buffer = MAX_REGISTERED_BUFFER / BUFFER_SIZE;
+
+    register_buffer_ring(&ring);
+    if (features & URING_FIXED_BUFFERS) {
+        register_arena(&ring);
+    }
+    if (features & URING_FIXED_FILES) {
+        register_file_table(&ring);
+    }
+
+    printf("Server ready (io_uring%s%s%s), waiting for connections...\n", features & URING_FIXED_BUFFERS ? " fixed_bufs" : "",
+           features & URING_FIXED_FILES ? " fixed_files" : "", features & URING_SQPOLL ? " sqpoll" : "");
+
+    queue_accept(&ring);
+
+    LoopHeartbeat heartbeat = {0};
+    watchdog_watch(&heartbeat);
+    LoopStats stats = {0};
+    stats_watch_loop(&stats, "io_uring");
+
+    // Main event loop. Per-event logging is left out so this loop can be
+    // benchmarked; only connects and disconnects are reported.
+    while (true) {
+        unsigned head = *ring.cq_head;
+        bool idle = head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        heartbeat_beat(&heartbeat, idle ? HEARTBEAT_WAITING : HEARTBEAT_LOOP);
+        if (uring_submit(&ring, idle ? 1 : 0) < 0) {
+            stats_unwatch_loop(&stats);
+            watchdog_unwatch(&heartbeat);
+            return -1;
+        }
+        uint64_t pass_start = loop_stats_start();
+
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int slot = USER_DATA_SLOT(cqe->user_data);
+            // Rejected connections close under slot max_clients, past the table
+            heartbeat_beat(&heartbeat, USER_DATA_OP(cqe->user_data) == OP_ACCEPT || slot >= ring.max_clients ? ring.server_fd : ring.clients[slot].fd);
+
+            switch (USER_DATA_OP(cqe->user_data)) {
+            case OP_ACCEPT:
+                handle_accept(&ring, cqe);
+                break;
+            case OP_READ:
+                if (cqe->res > 0) {
+                    loop_stat_add(stats.reads, 1);
+                    loop_stat_add(stats.bytes_in, cqe->res);
+                }
+                handle_read(&ring, slot, cqe->res, cqe->flags);
+                break;
+            case OP_WRITE:
+                handle_write(&ring, slot, cqe->res);
+                break;
+            case OP_CLOSE:
+                if (cqe->res < 0) {
+                    fprintf(stderr, "close(slot=%d): %s\n", slot, strerror(-cqe->res));
+                }
+                break;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        loop_stats_pass(&stats, pass_start);
+    }
+
+    return 0;
+}
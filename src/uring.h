@@ -0,0 +1,4 @@
+#pragma once
+
+// Main server loop using io_uring (see config.h for the URING_* features)
+int run_server_with_uring(int server_fd);
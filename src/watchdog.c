@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+#define BACKTRACE_DEPTH 64
+
+// What the watchdog last saw of a loop
+typedef struct {
+    LoopHeartbeat *heartbeat;
+    uint64_t beats;
+    uint64_t since_ms; // When beats last changed
+    bool reported;     // This stall was logged already
+} WatchedLoop;
+
+static struct {
+    pthread_mutex_t lock; // Guards loops against watch/unwatch
+    WatchedLoop loops[WATCHDOG_MAX_LOOPS];
+    int nloops;
+    unsigned stall_ms;
+} watchdog = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void watchdog_watch(LoopHeartbeat *heartbeat) {
+    heartbeat->thread = pthread_self();
+    heartbeat->fd = HEARTBEAT_LOOP;
+    pthread_mutex_lock(&watchdog.lock);
+    if (watchdog.nloops == WATCHDOG_MAX_LOOPS) {
+        fprintf(stderr, "Too many loops for the watchdog, ignoring one\n");
+    } else {
+        watchdog.loops[watchdog.nloops++] = (WatchedLoop){.heartbeat = heartbeat, .beats = heartbeat->beats, .since_ms = now_ms()};
+    }
+    pthread_mutex_unlock(&watchdog.lock);
+}
+
+void watchdog_unwatch(LoopHeartbeat *heartbeat) {
+    pthread_mutex_lock(&watchdog.lock);
+    for (int i = 0; i < watchdog.nloops; i++) {
+        if (watchdog.loops[i].heartbeat == heartbeat) {
+            watchdog.loops[i] = watchdog.loops[--watchdog.nloops];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watchdog.lock);
+}
+
+// Runs on the stalled loop thread. backtrace_symbols_fd writes straight to
+// the descriptor, so a loop stuck inside stdio doesn't block the report.
+static void capture_backtrace(int signo) {
+    (void)signo;
+    int saved_errno = errno;
+    void *frames[BACKTRACE_DEPTH];
+    int nframes = backtrace(frames, BACKTRACE_DEPTH);
+    backtrace_symbols_fd(frames, nframes, STDERR_FILENO);
+    errno = saved_errno;
+}
+
+// Write a line without stdio; the loop may be blocked holding its locks
+static void report(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void report(const char *fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(line) - 1) {
+        len = sizeof(line) - 1;
+    }
+    if (write(STDERR_FILENO, line, len) != len) {
+        // Nowhere left to report it
+    }
+}
+
+static void check_loop(WatchedLoop *loop, uint64_t now) {
+    uint64_t beats = __atomic_load_n(&loop->heartbeat->beats, __ATOMIC_RELAXED);
+    int fd = __atomic_load_n(&loop->heartbeat->fd, __ATOMIC_RELAXED);
+    if (beats != loop->beats || fd == HEARTBEAT_WAITING) {
+        if (loop->reported) {
+            report("Loop recovered after %llu ms\n", (unsigned long long)(now - loop->since_ms));
+        }
+        *loop = (WatchedLoop){.heartbeat = loop->heartbeat, .beats = beats, .since_ms = now};
+        return;
+    }
+    if (loop->reported || now - loop->since_ms < watchdog.stall_ms) {
+        return;
+    }
+    loop->reported = true;
+    metric_add(loop_stalls, 1);
+    if (fd >= 0) {
+        report("Loop stalled for %llu ms handling fd %d, backtrace:\n", (unsigned long long)(now - loop->since_ms), fd);
+    } else {
+        report("Loop stalled for %llu ms between handlers, backtrace:\n", (unsigned long long)(now - loop->since_ms));
+    }
+    pthread_kill(loop->heartbeat->thread, SIGRTMIN);
+}
+
+static void *watchdog_thread(void *arg) {
+    (void)arg;
+    pthread_setname_np(pthread_self(), "watchdog");
+    unsigned period_ms = watchdog.stall_ms / 4 > 0 ? watchdog.stall_ms / 4 : 1;
+    struct timespec period = {.tv_sec = period_ms / 1000, .tv_nsec = (long)(period_ms % 1000) * 1000000L};
+    while (true) {
+        nanosleep(&period, NULL);
+        uint64_t now = now_ms();
+        pthread_mutex_lock(&watchdog.lock);
+        for (int i = 0; i < watchdog.nloops; i++) {
+            check_loop(&watchdog.loops[i], now);
+        }
+        pthread_mutex_unlock(&watchdog.lock);
+    }
+    return NULL;
+}
+
+void start_watchdog(unsigned stall_ms) {
+    watchdog.stall_ms = stall_ms;
+
+    // The first backtrace() loads the unwinder, which isn't safe in a signal
+    // handler; get that done now
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action = {.sa_handler = capture_backtrace, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGRTMIN, &action, NULL) == -1) {
+        fatal_error("sigaction failed");
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watchdog_thread, NULL) != 0) {
+        fatal_error("Failed to start watchdog thread");
+    }
+    pthread_detach(thread);
+    printf("Watchdog reports loops stalled for %u ms\n", stall_ms);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define HEARTBEAT_WAITING -2 // Blocked waiting for events, which is never a stall
+#define HEARTBEAT_LOOP -1    // Between handlers: loop events, accepts, the memory budget
+#define WATCHDOG_MAX_LOOPS 8
+
+// A loop's progress as the watchdog sees it. The loop beats before each
+// handler and around each wait; the watchdog thread samples it.
+typedef struct {
+    uint64_t beats;
+    int fd; // Descriptor being handled, or HEARTBEAT_*
+    pthread_t thread;
+} LoopHeartbeat;
+
+// Record progress: about to handle fd (or enter a HEARTBEAT_* state). Two
+// relaxed stores on the loop thread, so cheap enough to run per event.
+static inline void heartbeat_beat(LoopHeartbeat *heartbeat, int fd) {
+    __atomic_store_n(&heartbeat->fd, fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&heartbeat->beats, heartbeat->beats + 1, __ATOMIC_RELAXED);
+}
+
+// Watch the calling thread's loop until watchdog_unwatch. Registering is
+// fine without a watchdog running; nothing samples the heartbeat then.
+void watchdog_watch(LoopHeartbeat *heartbeat);
+void watchdog_unwatch(LoopHeartbeat *heartbeat);
+
+// Start a thread that checks the watched loops every stall_ms / 4. A loop
+// that hasn't beaten in stall_ms while not waiting is reported on stderr,
+// once per stall: the fd it was handling, then its backtrace, captured by
+// signalling the loop thread so the stack is the stalled one. Backtraces
+// name functions the executable exports (it links with -rdynamic); static
+// ones show as offsets. The signal is SA_RESTART, but calls the kernel never
+// restarts (sleeps, select) return early with EINTR.
+void start_watchdog(unsigned stall_ms);
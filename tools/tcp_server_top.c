@@ -0,0 +1,148 @@
+// Live view of a server's stats segment (tcp_server -S stats_file)
+//
+// Maps the file read-only and takes seqlock snapshots of it, so watching a
+// server costs it nothing: no admin connection, no syscalls on its side.
+// Shows each event loop's read rate, input throughput, busy share and loop
+// pass latency percentiles, then every server metric with its change:
+//
+//   ./build/tools/tcp_server_top [-i interval_s] [-n refreshes] stats_file
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "stats.h"
+
+// Copy the segment between two equal, even reads of seq. Gives up after
+// about a second, which only a server killed mid-publish takes.
+static void snapshot(const StatsSegment *segment, StatsSegment *copy) {
+    const struct timespec pause = {.tv_nsec = 1000000};
+    for (int tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            nanosleep(&pause, NULL); // A publish is in progress
+            continue;
+        }
+        memcpy(copy, segment, sizeof(StatsSegment));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+    fprintf(stderr, "Stats segment stuck mid-update; did the server die?\n");
+    exit(EXIT_FAILURE);
+}
+
+static const StatsSegment *map_segment(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fatal_error("Failed to open stats file");
+    }
+    const StatsSegment *segment = mmap(NULL, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fatal_error("Failed to map stats file");
+    }
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || segment->version != STATS_VERSION || segment->size != sizeof(StatsSegment)) {
+        fprintf(stderr, "%s: not a stats segment of version %d\n", path, STATS_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    return segment;
+}
+
+// Upper bound in us of the bucket holding the given fraction of passes
+static uint64_t pass_percentile(const uint64_t *passes, uint64_t total, double fraction) {
+    uint64_t rank = (uint64_t)(total * fraction), seen = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+        seen += passes[b];
+        if (seen > rank) {
+            return (uint64_t)1 << b;
+        }
+    }
+    return (uint64_t)1 << (STATS_LATENCY_BUCKETS - 1);
+}
+
+static const StatsLoop *find_loop(const StatsSegment *segment, int32_t tid) {
+    for (int i = 0; i < STATS_MAX_LOOPS; i++) {
+        if (segment->loops[i].tid == tid) {
+            return &segment->loops[i];
+        }
+    }
+    return NULL;
+}
+
+static void show(const StatsSegment *now, const StatsSegment *before) {
+    double seconds = (now->updated_ns - before->updated_ns) / 1e9;
+    double age = (stats_now_ns() - now->updated_ns) / 1e9;
+    printf("tcp_server pid %d, updated %.2f s ago%s\n\n", now->pid, age, age > 2.0 ? " (stale: is the server running?)" : "");
+
+    printf("%-10s %8s %12s %10s %7s %12s %12s\n", "loop", "tid", "reads/s", "MB/s in", "busy%", "pass p50 us", "pass p99 us");
+    for (int i = 0; i < STATS_MAX_LOOPS; i++) {
+        const StatsLoop *loop = &now->loops[i];
+        const StatsLoop *prev = find_loop(before, loop->tid);
+        if (loop->tid == 0 || prev == NULL || seconds <= 0) {
+            continue;
+        }
+        uint64_t passes[STATS_LATENCY_BUCKETS], total = 0;
+        for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+            passes[b] = loop->stats.pass_ns[b] - prev->stats.pass_ns[b];
+            total += passes[b];
+        }
+        printf("%-10s %8d %12.0f %10.2f %7.1f", loop->name, loop->tid, (loop->stats.reads - prev->stats.reads) / seconds,
+               (loop->stats.bytes_in - prev->stats.bytes_in) / seconds / 1e6, (loop->stats.busy_ns - prev->stats.busy_ns) / seconds / 1e7);
+        if (total > 0) {
+            printf(" %12llu %12llu\n", (unsigned long long)pass_percentile(passes, total, 0.5), (unsigned long long)pass_percentile(passes, total, 0.99));
+        } else {
+            printf(" %12s %12s\n", "-", "-");
+        }
+    }
+
+    printf("\n%-24s %16s %12s\n", "metric", "value", "change");
+    for (uint32_t i = 0; i < now->nmetrics && i < STATS_MAX_METRICS; i++) {
+        printf("%-24s %16llu %+12lld\n", now->metric_names[i], (unsigned long long)now->metrics[i], (long long)(now->metrics[i] - before->metrics[i]));
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "[-i interval_s] [-n refreshes] stats_file";
+    double interval = 1.0;
+    long refreshes = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            refreshes = atol(optarg);
+            break;
+        default:
+            usage_error(argv[0], usage);
+        }
+    }
+    if (optind != argc - 1 || interval <= 0 || refreshes < 0) {
+        usage_error(argv[0], usage);
+    }
+
+    const StatsSegment *segment = map_segment(argv[optind]);
+    static StatsSegment before, now;
+    snapshot(segment, &before);
+    bool tty = isatty(STDOUT_FILENO);
+    struct timespec period = {.tv_sec = (time_t)interval, .tv_nsec = (long)((interval - (time_t)interval) * 1e9)};
+    for (long n = 0; refreshes == 0 || n < refreshes; n++) {
+        nanosleep(&period, NULL);
+        snapshot(segment, &now);
+        printf(tty ? "\033[H\033[2J" : (n > 0 ? "\n" : ""));
+        show(&now, &before);
+        fflush(stdout);
+        before = now;
+    }
+    return 0;
+}